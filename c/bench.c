@@ -0,0 +1,283 @@
+/* bench.c : latency benchmarks of context switches, syscalls and interrupts
+ *
+ * Built with RUNBENCH, run_bench takes over from initproc and prints the
+ * minimum, median and 99th percentile of each measurement, in TSC cycles
+ * and in nanoseconds from a cycles per microsecond figure calibrated
+ * against PIT counter 2.
+ */
+
+#include <xeroskernel.h>
+#include <xeroslib.h>
+#include <i386.h>
+
+#if RUNBENCH
+
+extern pcb pcbTable[MAX_NUM_PROCESS];
+extern pcb *idle;
+
+#define BENCH_SAMPLES 1000
+#define BENCH_SLEEPS 100
+#define BENCH_USLEEP_US 300
+#define BENCH_TICKS 100
+#define BENCH_STACK_SIZE 0x4000
+#define BENCH_SIG 20
+#define BENCH_STOP 0xffffffff
+// Two TSC reads further apart than this were interrupted
+#define BENCH_GAP_CYCLES 2000
+// PIT counter 2 runs for CALIBRATE_MS while the TSC is read,
+// its gate and output are bits of the keyboard controller port B
+#define CALIBRATE_MS 50
+#define PORT_B 0x61
+#define PORT_B_GATE2 0x01
+#define PORT_B_SPEAKER 0x02
+#define PORT_B_OUT2 0x20
+
+static void bench_root(void);
+static unsigned long calibrate_tsc(void);
+static void record(unsigned long cycles);
+static void report(char *name);
+static unsigned long to_ns(unsigned long cycles);
+static int cmp_cycles(void *a, void *b);
+
+static unsigned long samples[BENCH_SAMPLES];
+static int numSamples;
+static unsigned long cyclesPerUs;
+// TSC when the signal benchmark called syskill, and its end
+static unsigned long sigStart;
+static Bool sigDone;
+
+/*
+ * Replaces the normal start up, runs the benchmarks in a process
+ * next to the idle process with the timer interrupt enabled
+ */
+void run_bench(void) {
+  unsigned int pcb_index;
+  int pid;
+
+  cyclesPerUs = calibrate_tsc();
+  kmeminit();
+  init_pcb_table();
+  initSyscall();
+  enableTimerInterrupt();
+
+  create(bench_root, BENCH_STACK_SIZE, NULL);
+  pid = create(idleproc, DEFAULT_STACK_SIZE, NULL);
+  pidMapLookup(pid, &pcb_index);
+  idle = pcbTable + pcb_index;
+  setprio(idle, IDLE_PRIORITY);
+  dispatch();
+}
+
+void yield_peer(void) {
+  int i;
+
+  for (i = 0; i < BENCH_SAMPLES; i++) {
+    sysyield();
+  }
+}
+
+void echo_peer(void) {
+  unsigned int from_pid, word;
+
+  for (;;) {
+    from_pid = 0;
+    sysrecv(&from_pid, &word, sizeof(int));
+    if (word == BENCH_STOP) {
+      return;
+    }
+    syssend(from_pid, &word, sizeof(int));
+  }
+}
+
+static void sig_record(void *cntx) {
+  record((unsigned long) read_tsc() - sigStart);
+}
+
+void sig_peer(void) {
+  syssighandler(BENCH_SIG, sig_record, NULL);
+  while (!sigDone) {
+    syssigwait();
+  }
+}
+
+static void call_getpid(void) {
+  sysgetpid();
+}
+
+static void call_getpid_generic(void) {
+  syscall(GET_PID);
+}
+
+static void call_getprio(void) {
+  sysgetprio(0);
+}
+
+static void call_yield(void) {
+  sysyield();
+}
+
+static void call_send_nopid(void) {
+  syssend(BENCH_STOP, NULL, 0);
+}
+
+static void bench_syscall(char *name, void (*call)(void)) {
+  unsigned long start;
+  int i;
+
+  for (i = 0; i < BENCH_SAMPLES; i++) {
+    start = (unsigned long) read_tsc();
+    call();
+    record((unsigned long) read_tsc() - start);
+  }
+  report(name);
+}
+
+static void bench_root(void) {
+  unsigned long start, last, now, period, median;
+  unsigned int peer, word, from_pid;
+  int i;
+
+  kprintf("TSC %u cycles/us, %u samples per row, times include the TSC reads\n",
+      cyclesPerUs, BENCH_SAMPLES);
+  kprintf("%-28s %10s %10s %10s %10s %10s %10s\n", "benchmark",
+      "min cyc", "med cyc", "p99 cyc", "min ns", "med ns", "p99 ns");
+
+  // Both processes only yield, each round trip is two switches
+  syscreate(yield_peer, BENCH_STACK_SIZE);
+  for (i = 0; i < BENCH_SAMPLES; i++) {
+    start = (unsigned long) read_tsc();
+    sysyield();
+    record(((unsigned long) read_tsc() - start) / 2);
+  }
+  // Let the peer stop
+  sysyield();
+  report("yield to yield switch");
+
+  bench_syscall("GET_PID fast", call_getpid);
+  bench_syscall("GET_PID generic", call_getpid_generic);
+  bench_syscall("GET_PRIO", call_getprio);
+  bench_syscall("YIELD, nobody else ready", call_yield);
+  bench_syscall("SEND to missing PID", call_send_nopid);
+
+  peer = syscreate(echo_peer, BENCH_STACK_SIZE);
+  for (word = 0; word < BENCH_SAMPLES; word++) {
+    start = (unsigned long) read_tsc();
+    syssend(peer, &word, sizeof(int));
+    from_pid = peer;
+    sysrecv(&from_pid, &word, sizeof(int));
+    record((unsigned long) read_tsc() - start);
+  }
+  word = BENCH_STOP;
+  syssend(peer, &word, sizeof(int));
+  report("SEND and RECV ping-pong");
+
+  // The peer handles the signal once this process yields
+  peer = syscreate(sig_peer, BENCH_STACK_SIZE);
+  sysyield();
+  for (i = 0; i < BENCH_SAMPLES; i++) {
+    sigStart = (unsigned long) read_tsc();
+    syskill(peer, BENCH_SIG);
+    sysyield();
+  }
+  sigDone = TRUE;
+  syskill(peer, BENCH_SIG);
+  sysyield();
+  report("KILL and yield to handler");
+
+  // Sleeps start right after a wakeup, so each one should last one period,
+  // the jitter is the distance from the median
+  period = cyclesPerUs * 1000 * TIME_SLICE_MS;
+  syssleep(TIME_SLICE_MS);
+  for (i = 0; i < BENCH_SLEEPS; i++) {
+    start = (unsigned long) read_tsc();
+    syssleep(TIME_SLICE_MS);
+    record((unsigned long) read_tsc() - start);
+  }
+  kprintf("sleep of %u ms, expected %u ns\n", TIME_SLICE_MS, to_ns(period));
+  report("sleep elapsed");
+  // The samples stay sorted after the report
+  median = samples[BENCH_SLEEPS / 2];
+  for (i = 0; i < BENCH_SLEEPS; i++) {
+    record(samples[i] > median ? samples[i] - median : median - samples[i]);
+  }
+  report("sleep wakeup jitter");
+
+  // Shorter than a time slice, the one-shot PIT wakes the process up
+  sysusleep(BENCH_USLEEP_US);
+  for (i = 0; i < BENCH_SLEEPS; i++) {
+    start = (unsigned long) read_tsc();
+    sysusleep(BENCH_USLEEP_US);
+    record((unsigned long) read_tsc() - start);
+  }
+  kprintf("usleep of %u us, timer tick %u us\n", BENCH_USLEEP_US, TIMER_RES_US);
+  report("usleep elapsed");
+
+  // Alone on the CPU, gaps in the TSC are timer interrupts going through
+  // the ISR, tick, the dispatcher and back
+  last = (unsigned long) read_tsc();
+  while (numSamples < BENCH_TICKS) {
+    now = (unsigned long) read_tsc();
+    if (now - last > BENCH_GAP_CYCLES) {
+      record(now - last);
+    }
+    last = now;
+  }
+  report("timer tick preemption");
+
+  kprintf("Benchmarks done\n");
+  debug_exit(EXIT_PASS);
+}
+
+/*
+ * TSC cycles per microsecond, counted while PIT counter 2 counts
+ * down CALIBRATE_MS in mode 0
+ */
+static unsigned long calibrate_tsc(void) {
+  unsigned long long start;
+  unsigned int count;
+
+  count = TIMER_FREQ / 1000 * CALIBRATE_MS;
+  outb(PORT_B, (inb(PORT_B) & ~PORT_B_SPEAKER) | PORT_B_GATE2);
+  outb(TIMER_MODE, TIMER_SEL2 | TIMER_16BIT | TIMER_INTTC);
+  outb(TIMER_CNTR2, count & 0xff);
+  outb(TIMER_CNTR2, count >> 8);
+  start = read_tsc();
+  while (!(inb(PORT_B) & PORT_B_OUT2));
+  return max((unsigned long) (read_tsc() - start) / (CALIBRATE_MS * 1000), 1);
+}
+
+static void record(unsigned long cycles) {
+  if (numSamples < BENCH_SAMPLES) {
+    samples[numSamples++] = cycles;
+  }
+}
+
+/*
+ * Prints a row for the recorded samples and starts a new one
+ */
+static void report(char *name) {
+  unsigned long lo, mid, p99;
+
+  qsort((char*) samples, numSamples, sizeof(unsigned long), cmp_cycles);
+  lo = samples[0];
+  mid = samples[numSamples / 2];
+  p99 = samples[numSamples * 99 / 100];
+  kprintf("%-28s %10u %10u %10u %10u %10u %10u\n", name, lo, mid, p99,
+      to_ns(lo), to_ns(mid), to_ns(p99));
+  numSamples = 0;
+}
+
+/* Without 64 bit division */
+static unsigned long to_ns(unsigned long cycles) {
+  return cycles / cyclesPerUs * 1000 + (cycles % cyclesPerUs) * 1000 / cyclesPerUs;
+}
+
+static int cmp_cycles(void *a, void *b) {
+  unsigned long x, y;
+
+  x = *((unsigned long*) a);
+  y = *((unsigned long*) b);
+  return x < y ? -1 : x > y;
+}
+
+#endif
@@ -0,0 +1,235 @@
+/* buddy.c : buddy page allocator
+ */
+
+#include <xeroskernel.h>
+#include <i386.h>
+
+extern  long  freemem;
+
+#define NUM_PAGE (FREEMEM_END / NBPG)
+#define NO_ORDER 0xff
+#define PAGE_NUM(addr) (((unsigned long) (addr)) / NBPG)
+#define PAGE_ADDR(pfn) ((void*) ((pfn) * NBPG))
+
+// Page states, only meaningful for the first page of a block
+#define PAGE_RESERVED 0
+#define PAGE_FREE 1
+#define PAGE_USED 2
+#define PAGE_HEAP 3
+
+typedef struct _pageInfo {
+  unsigned char state;
+  // Order of a free block, NO_ORDER for every page that does not start one
+  unsigned char order;
+  // Number of pages of an allocation
+  unsigned short npages;
+} pageInfo;
+
+// Free list links, kept in the first page of a free block
+typedef struct _buddyLinks {
+  struct _buddyLinks *prev;
+  struct _buddyLinks *next;
+} buddyLinks;
+
+static int alloc_block(int order);
+static void free_block(unsigned int pfn, int order);
+static void free_range(unsigned int pfn, unsigned int npages);
+static void list_insert(unsigned int pfn, int order);
+static void list_remove(unsigned int pfn, int order);
+
+static pageInfo pageMap[NUM_PAGE];
+// Free blocks by order, bit i of orderBitmap is set if order i is not empty
+static buddyLinks *freeBlocks[BUDDY_NUM_ORDER];
+static unsigned int numFreeBlocks[BUDDY_NUM_ORDER];
+static unsigned int orderBitmap;
+static unsigned int freePages;
+
+/*
+ * Gives all pages between freemem and FREEMEM_END, except the hole,
+ * to the buddy allocator
+ */
+void buddy_init(void) {
+  unsigned int pfn, start;
+
+  for (pfn = 0; pfn < NUM_PAGE; pfn++) {
+    pageMap[pfn].state = PAGE_RESERVED;
+    pageMap[pfn].order = NO_ORDER;
+    pageMap[pfn].npages = 0;
+  }
+  for (pfn = 0; pfn < BUDDY_NUM_ORDER; pfn++) {
+    freeBlocks[pfn] = NULL;
+    numFreeBlocks[pfn] = 0;
+  }
+  orderBitmap = 0;
+  freePages = 0;
+
+  start = PAGE_NUM(freemem + NBPG - 1);
+  free_range(start, PAGE_NUM(HOLESTART) - start);
+  free_range(PAGE_NUM(HOLEEND), PAGE_NUM(FREEMEM_END) - PAGE_NUM(HOLEEND));
+}
+
+/*
+ * Allocates npages contiguous pages, the pages past npages of the
+ * power of two block they are taken from go back to the free lists
+ * @return address of the first page or NULL if out of memory
+ */
+void *alloc_pages(int npages) {
+  int order, pfn;
+
+  if (npages <= 0) {
+    return NULL;
+  }
+  order = npages > 1 ? bit_scan_reverse(npages - 1) + 1 : 0;
+  if (order >= BUDDY_NUM_ORDER) {
+    return NULL;
+  }
+
+  pfn = alloc_block(order);
+  if (pfn == SYSERR) {
+    return NULL;
+  }
+  pageMap[pfn].state = PAGE_USED;
+  pageMap[pfn].npages = npages;
+  free_range(pfn + npages, (1 << order) - npages);
+  return PAGE_ADDR(pfn);
+}
+
+/*
+ * Allocates pages for the kmalloc heap, they can not be freed
+ * with free_pages, even if a heap block starts at their address
+ */
+void *alloc_heap_pages(int npages) {
+  void *ptr;
+
+  ptr = alloc_pages(npages);
+  if (ptr) {
+    pageMap[PAGE_NUM(ptr)].state = PAGE_HEAP;
+  }
+  return ptr;
+}
+
+/*
+ * Frees pages returned by alloc_pages
+ * @return OK, or SYSERR if ptr is not the start of a page allocation
+ */
+int free_pages(void *ptr) {
+  unsigned int pfn;
+
+  pfn = PAGE_NUM(ptr);
+  if (((unsigned long) ptr) % NBPG || pfn >= NUM_PAGE ||
+      pageMap[pfn].state != PAGE_USED) {
+    return SYSERR;
+  }
+  free_range(pfn, pageMap[pfn].npages);
+  return OK;
+}
+
+/*
+ * Fills the free page counts of a fragmentation report
+ */
+void buddy_report(memInfo *info) {
+  int i;
+
+  info->freePages = freePages;
+  info->largestFree = orderBitmap ? NBPG << bit_scan_reverse(orderBitmap) : 0;
+  for (i = 0; i < BUDDY_NUM_ORDER; i++) {
+    info->freeBlocks[i] = numFreeBlocks[i];
+  }
+}
+
+/*
+ * Takes a free block of the given order, splitting a larger one if needed
+ * @return page number of the block or SYSERR
+ */
+static int alloc_block(int order) {
+  unsigned int pfn;
+  int k;
+
+  if (!(orderBitmap >> order)) {
+    return SYSERR;
+  }
+  k = bit_scan_forward(orderBitmap >> order) + order;
+  pfn = PAGE_NUM(freeBlocks[k]);
+  list_remove(pfn, k);
+
+  // Give back the upper half until the block has the right order
+  while (k > order) {
+    k--;
+    list_insert(pfn + (1 << k), k);
+  }
+  return pfn;
+}
+
+/*
+ * Frees a block, merging it with its buddy as long as the buddy is free
+ */
+static void free_block(unsigned int pfn, int order) {
+  unsigned int buddy;
+
+  pageMap[pfn].state = PAGE_FREE;
+  while (order < BUDDY_NUM_ORDER - 1) {
+    buddy = pfn ^ (1 << order);
+    if (buddy >= NUM_PAGE || pageMap[buddy].state != PAGE_FREE ||
+        pageMap[buddy].order != order) {
+      break;
+    }
+    list_remove(buddy, order);
+    pfn = min(pfn, buddy);
+    order++;
+  }
+  list_insert(pfn, order);
+}
+
+/*
+ * Frees a range of pages as the largest aligned blocks that fit
+ */
+static void free_range(unsigned int pfn, unsigned int npages) {
+  int order;
+
+  while (npages > 0) {
+    order = min(bit_scan_reverse(npages), BUDDY_NUM_ORDER - 1);
+    while (pfn & ((1 << order) - 1)) {
+      order--;
+    }
+    free_block(pfn, order);
+    pfn += 1 << order;
+    npages -= 1 << order;
+  }
+}
+
+static void list_insert(unsigned int pfn, int order) {
+  buddyLinks *links;
+
+  links = (buddyLinks*) PAGE_ADDR(pfn);
+  links->prev = NULL;
+  links->next = freeBlocks[order];
+  if (freeBlocks[order]) {
+    freeBlocks[order]->prev = links;
+  }
+  freeBlocks[order] = links;
+  orderBitmap |= 1 << order;
+  numFreeBlocks[order]++;
+  freePages += 1 << order;
+  pageMap[pfn].state = PAGE_FREE;
+  pageMap[pfn].order = order;
+}
+
+static void list_remove(unsigned int pfn, int order) {
+  buddyLinks *links;
+
+  links = (buddyLinks*) PAGE_ADDR(pfn);
+  if (links->prev) {
+    links->prev->next = links->next;
+  } else {
+    freeBlocks[order] = links->next;
+    if (!freeBlocks[order]) {
+      orderBitmap &= ~(1 << order);
+    }
+  }
+  if (links->next) {
+    links->next->prev = links->prev;
+  }
+  numFreeBlocks[order]--;
+  freePages -= 1 << order;
+  pageMap[pfn].order = NO_ORDER;
+}
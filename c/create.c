@@ -8,8 +8,7 @@ extern unsigned short getCS(void);
 
 // process management variables
 extern pcb pcbTable[MAX_NUM_PROCESS];
-extern treeNode *pidMap;
-extern unsigned int nextPid;
+extern pcb *free_pcbs;
 
 /* Set all general registers in a context frame struct to zero */
 void zeroRegisters(contextFrame *context) {
@@ -23,11 +22,18 @@ void zeroRegisters(contextFrame *context) {
   context->edi = 0;
 }
 
-// returns next ununsed non-zero PID
-unsigned int getNextPid(void) {
-  unsigned int pcbIndex;
-  while (!nextPid || pidMapLookup(nextPid, &pcbIndex) == OK) nextPid++;
-  return nextPid++;
+// returns a new PID for the PCB at pcbIndex, one generation after its last PID
+unsigned int getNextPid(unsigned int pcbIndex) {
+  unsigned int generation;
+
+  generation = (pcbTable[pcbIndex].pid >> PID_INDEX_BITS) + 1;
+  // Wrap around to generation 1 before the PROC_SLOT_FLAG bit,
+  // so a PID is never 0 and never names a slot
+  if (!(generation << PID_INDEX_BITS) ||
+      ((generation << PID_INDEX_BITS) & PROC_SLOT_FLAG)) {
+    generation = 1;
+  }
+  return (generation << PID_INDEX_BITS) | pcbIndex;
 }
 
 /* Create a process 
@@ -44,27 +50,20 @@ int create (void (*func)(void), int stack, unsigned int parent) {
 
   // In additional to stack size, allocate some space for a safety margin and context frame
   mallocSize = stack + SAFETY_MARGIN + sizeof(contextFrame);
-  
-  ptr = (unsigned int) kmalloc(mallocSize);
-  if (ptr != NULL) {
-    pcb = NULL;
-
-    // Look for usable PCB
-    for (i = 0; i < MAX_NUM_PROCESS; i++) {
-      if (pcbTable[i].state == STOPPED) {
-        pcb = &pcbTable[i];
-        break;
-      }
-    }
 
-    if (pcb) {
-      // Find the next currently unused PID
-      pcb->pid = getNextPid();
+  // Use the PCB at the head of the free list, fail if the PCB table is full
+  pcb = free_pcbs;
+  if (pcb) {
+    // Stacks above KMALLOC_PAGE_MIN get whole pages from the buddy
+    // allocator, which takes them back when the process is cleaned up
+    ptr = (unsigned int) kmalloc(mallocSize);
+    if (ptr != NULL) {
+      free_pcbs = pcb->next;
+
+      // Tag PCB index with the next generation
+      pcb->pid = getNextPid(pcb - pcbTable);
       pcb->parentPid = parent;
       pcb->stack = (void*) ptr;
-      
-      // Update PID in the PCB map
-      pidMapInsert(pcb->pid, i);
 
       pcb->esp = ptr + ((stack/16) + (stack%16?1:0))*16;
       context = (contextFrame*) (pcb->esp) ;
@@ -81,20 +80,25 @@ int create (void (*func)(void), int stack, unsigned int parent) {
 
       // Reset PCB
       pcb->next = NULL;
-      pcb->senders = NULL;
-      pcb->receivers = NULL;
+      pcb->priority = DEFAULT_PRIORITY;
+      pcb->slice_left = MLFQ_QUANTUM(DEFAULT_PRIORITY);
+      pcb->prev = NULL;
+      pcb->wait_queue = NULL;
+      pcb->senders.head = pcb->senders.tail = NULL;
+      pcb->receivers.head = pcb->receivers.tail = NULL;
+      pcb->awaiting_reply.head = pcb->awaiting_reply.tail = NULL;
+      pcb->pollers.head = pcb->pollers.tail = NULL;
+      pcb->batch = NULL;
+      pcb->cycles = pcb->wait_cycles = 0;
+      pcb->ticks = pcb->voluntary = pcb->involuntary = pcb->syscalls = 0;
       for (i = 0; i < NUM_SIGNAL; i++) {
         pcb->sig_handler[i] = NULL;
       }
       pcb->pending_sig = 0;
       pcb->allowed_sig = 0;
       pcb->hi_sig = 0xFFFFFFFF;
-      pcb->delta = 0;
       pcb->iargs = 0;
       pcb->irc = 0;
-      for(i = 0; i < NUM_FD; i++) {
-        pcb->opened_dv[i] = NULL;
-      }
 
       // Set file descriptor table to NULL
       for (i = 0; i < NUM_FD; i++) {
@@ -104,12 +108,7 @@ int create (void (*func)(void), int stack, unsigned int parent) {
       // Add to ready queue
       ready(pcb);
       return pcb->pid;
-
-    } else {
-      // PCB table full, free space and return error
-      kfree((void*) ptr);
     }
   }
   return SYSERR;
 }
-
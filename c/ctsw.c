@@ -15,22 +15,24 @@ static unsigned int ESP;
 static int rc, interrupt;
 
 extern void set_evec(unsigned int xnum, unsigned long handler);
-extern void initPIT( int divisor );
 extern const char* syscall_str[];
 void debugContextFrame(contextFrame*, unsigned int);
 
 /* Declaration of _SyscallEntryPoint, which enter contextswitch midway */
 void _SyscallEntryPoint(void);
 void _SystimerISREntryPoint(void);
+void _FastSyscallEntryPoint(void);
 
-/* Setup the IDT to map interrupt SYSCALL to _SyscallEntryPoint */
+/* Setup the IDT to map interrupt SYSCALL to _SyscallEntryPoint
+   and SYSCALL_FAST to _FastSyscallEntryPoint */
 void initSyscall(void) {
   set_evec(SYSCALL, (unsigned long) _SyscallEntryPoint);
+  set_evec(SYSCALL_FAST, (unsigned long) _FastSyscallEntryPoint);
 }
 
 void enableTimerInterrupt(void) {
   set_evec(IRQBASE, (unsigned long) _SystimerISREntryPoint);
-  initPIT(TIME_SLICE_DIV);
+  timer_start();
 }
 
 /* 
@@ -40,12 +42,17 @@ void enableTimerInterrupt(void) {
 */
 extern int contextswitch(pcb* p) {
   contextFrame *context;
+  unsigned long long start;
   ESP = p->esp;
 
   // Set return value in process context %eax
   context = (contextFrame*) ESP;
   context->eax = p->irc;
 
+  trace(TR_SWITCH_IN, p->pid, 0);
+  // The process is charged from here until it traps back
+  start = read_tsc();
+
   // Save kernel context to kernal stack,
   // swap CPU state and return to user process
   asm volatile(
@@ -61,6 +68,11 @@ extern int contextswitch(pcb* p) {
     "pusha;\n"
     "movl $1, %%ecx;\n"
     "jmp _CommonJump;\n"
+  "_FastSyscallEntryPoint:\n"
+    "cli;\n"
+    "pusha;\n"
+    "movl $2, %%ecx;\n"
+    "jmp _CommonJump;\n"
   "_SyscallEntryPoint:\n"
     "cli;\n"
     "pusha;\n"
@@ -74,12 +86,25 @@ extern int contextswitch(pcb* p) {
     "popf;\n"
     :::"%eax","%ecx");
 
+  p->cycles += read_tsc() - start;
+  trace(TR_SWITCH_OUT, p->pid, interrupt);
   p->esp = ESP;
   context = (contextFrame*) ESP;
 
-  if (interrupt) {
+  if (interrupt == 1) {
     p->irc = rc;
     return SYS_TIMER;
+  }
+  p->syscalls++;
+  if (interrupt == 2) {
+    // Copy the saved argument registers where the dispatcher reads
+    // arguments, instead of following a pointer into user memory
+    p->rargs[0] = context->ebx;
+    p->rargs[1] = context->ecx;
+    p->rargs[2] = context->edx;
+    p->rargs[3] = context->esi;
+    p->iargs = (unsigned int) p->rargs;
+    return context->eax;
   } else {
     // Put argument pointer in PCB for dispatcher
     p->iargs= context->args[1];
@@ -103,6 +103,54 @@ int di_read(pcb* p, int fd, void* buf, int buf_len) {
   }
 }
 
+/*
+ * Vectored write, the driver gathers the segments itself
+ */
+int di_writev(pcb* p, int fd, iovec* iov, int iovcnt) {
+  int rc;
+
+  // Invalid device number, device not opened by process or no vectored write
+  if (fd < 0 || fd >= NUM_FD || p->opened_dv[fd] == NULL ||
+      !p->opened_dv[fd]->dvwritev || iov_length(iov, iovcnt) == SYSERR) {
+    p->irc = -1;
+    return DRV_ERROR;
+
+  } else {
+    rc = p->opened_dv[fd]->dvwritev(p, iov, iovcnt);
+    if (rc == DRV_BLOCK || rc == DRV_DONE) {
+      return rc;
+
+    } else {
+      p->irc = -1;
+      return DRV_ERROR;
+    }
+  }
+}
+
+/*
+ * Vectored read, the driver scatters into the segments itself
+ */
+int di_readv(pcb* p, int fd, iovec* iov, int iovcnt) {
+  int rc;
+
+  // Invalid device number, device not opened by process or no vectored read
+  if (fd < 0 || fd >= NUM_FD || p->opened_dv[fd] == NULL ||
+      !p->opened_dv[fd]->dvreadv || iov_length(iov, iovcnt) == SYSERR) {
+    p->irc = -1;
+    return DRV_ERROR;
+
+  } else {
+    rc = p->opened_dv[fd]->dvreadv(p, iov, iovcnt);
+    if (rc == DRV_BLOCK || rc == DRV_DONE) {
+      return rc;
+
+    } else {
+      p->irc = -1;
+      return DRV_ERROR;
+    }
+  }
+}
+
 int di_ioctl(pcb* p, int fd, unsigned long cmd, va_list ap) {
   int rc;
 
@@ -10,7 +10,6 @@ extern long freemem;
 extern void end_of_intr(void);
 extern void enable_irq(unsigned int, int);
 extern int contextswitch(pcb* );
-extern int create (void (*func)(void), int stack, unsigned int parent);
 extern void register_sig_handler(pcb* p, int signal, handler, handler*);
 extern void deliver_signal(pcb* p);
 extern int signal(unsigned int pid, int sig_no);
@@ -18,23 +17,44 @@ extern int di_open(pcb* p, int major_no);
 extern int di_close(pcb* p, int fd);
 extern int di_write(pcb* p, int fd, void* buf, int buflen);
 extern int di_read(pcb* p, int fd, void* buf, int buflen);
+extern int di_writev(pcb* p, int fd, iovec* iov, int iovcnt);
+extern int di_readv(pcb* p, int fd, iovec* iov, int iovcnt);
 extern int di_ioctl(pcb* p, int fd, unsigned long cmd, va_list ap);
 
 const char* syscall_str[] = {
   "TIME_INT", "CREATE", "YIELD", "STOP", "GET_PID", "GET_P_PID", "PUTS",
   "SEND", "RECV", "SYS_TIMER", "SLEEP", "SIGHANDLER", "SIGRETURN", "KILL",
-  "SIGWAIT", "OPEN", "CLOSE", "WRITE", "READ", "IO_CTL"
+  "SIGWAIT", "OPEN", "CLOSE", "WRITE", "READ", "IO_CTL", "SET_PRIO",
+  "GET_PRIO", "MEM_INFO", "SEND_TIMED", "RECV_TIMED",
+  "ASEND", "SENDRECV", "REPLY", "BUF_ALLOC", "BUF_FREE", "LEND", "RECV_LENT",
+  "SENDV", "RECVV", "READV", "WRITEV", "POLL", "BATCH", "PROC_STAT",
+  "PROFILE", "TRACE_CTL", "USLEEP"
 };
 
-void cleanup(pcb* p);
 void print_ready_q(void);
+static void ready_remove(pcb* p);
+static pcb* lookup_pcb(pcb* p, unsigned int pid);
+static int batch_next(pcb* p);
+static int proc_stat(pcb* p, unsigned int pid, procStat* stat);
+static void ready_front(pcb* p);
+#if SCHEDULER == SCHED_MLFQ
+static void mlfq_tick(pcb* p);
+static void mlfq_block(pcb* p);
+static void mlfq_boost(void);
+#endif
 
 // Some process management variables
 pcb pcbTable[MAX_NUM_PROCESS];
 pcb *idle = NULL;
-pcb *ready_queue;
-treeNode *pidMap = NULL;
-unsigned int nextPid;
+// Stopped PCBs, linked through next
+pcb *free_pcbs;
+// One FIFO per priority level, bit i of ready_bitmap is set if level i is not empty
+pcbQueue ready_queue[NUM_PRIORITY];
+unsigned int ready_bitmap;
+#if SCHEDULER == SCHED_MLFQ
+// Time slices since the last priority boost
+static unsigned int mlfq_ticks;
+#endif
 
 void idleproc(void) {
   while (TRUE) {
@@ -46,21 +66,26 @@ void idleproc(void) {
 void dispatch(void) {
   unsigned int dest_pid, *from_pid;
   unsigned long cmd;
-  int rc, pid, sig_no, fd;
+  int rc, pid, sig_no, fd, prio;
   void* buf;
   va_list ap;
   request_type request = SYS_TIMER;
-  pcb *p, *to_ready;
+  pcb *p, *to_ready, *target, *last;
+  Bool slice_over;
   signal_frame *sig_frame;
   funcptr fp;
   handler new_h, *old_h;
 
   for (p = next(); p != NULL;) {
     to_ready = NULL;
+    slice_over = FALSE;
     deliver_signal(p);
     p->state = RUNNING;
     request = contextswitch(p);
     handle_request:
+    if (request != SYS_TIMER) {
+      trace(TR_SYSCALL, p->pid, request);
+    }
     ap = (va_list) p->iargs;
     switch (request) {
       case (CREATE):
@@ -96,13 +121,31 @@ void dispatch(void) {
         receive(p, from_pid);
         break;
       case SYS_TIMER:
-        to_ready = p;
-        tick();
+        trace(TR_IRQ, 0, p->pid);
+        slice_over = timer_interrupt();
+        if (slice_over) {
+          // Sampled on slice ends only, the one-shot interrupts
+          // for timers would bias the profile towards wakeups
+          prof_sample(p);
+          p->ticks++;
+#if SCHEDULER == SCHED_MLFQ
+          mlfq_tick(p);
+#else
+          to_ready = p;
+#endif
+        } else {
+          // Interrupted for a timer, p keeps the CPU unless
+          // the timer readied a higher priority process
+          ready_front(p);
+        }
         end_of_intr();
         break;
       case SLEEP:
         sleep(p, (unsigned int) va_arg(ap, int));
         break;
+      case USLEEP:
+        usleep(p, (unsigned int) va_arg(ap, int));
+        break;
       case TIME_INT:
         request = contextswitch(p);
         goto  handle_request;
@@ -171,49 +214,285 @@ void dispatch(void) {
         di_ioctl(p, fd, cmd, va_arg(ap, va_list));
         to_ready = p;
         break;
+      case SET_PRIO:
+        target = lookup_pcb(p, (unsigned int) va_arg(ap, int));
+        prio = va_arg(ap, int);
+        // The idle level is reserved for the idle process
+        if (target && prio >= 0 && prio < IDLE_PRIORITY) {
+          p->irc = setprio(target, prio);
+        } else {
+          p->irc = SYSERR;
+        }
+        to_ready = p;
+        break;
+      case GET_PRIO:
+        target = lookup_pcb(p, (unsigned int) va_arg(ap, int));
+        p->irc = target ? target->priority : SYSERR;
+        to_ready = p;
+        break;
+      case MEM_INFO:
+        buf = (void*) va_arg(ap, int);
+        if (buf) {
+          mem_report((memInfo*) buf);
+          p->irc = OK;
+        } else {
+          p->irc = SYSERR;
+        }
+        to_ready = p;
+        break;
+      case SEND_TIMED:
+        dest_pid = (unsigned int) va_arg(ap, unsigned int);
+        // skip buffer and length, the transfer reads them from iargs
+        va_arg(ap, int);
+        va_arg(ap, int);
+        send_timed(p, dest_pid, (unsigned int) va_arg(ap, int));
+        break;
+      case RECV_TIMED:
+        from_pid = (unsigned int*) va_arg(ap, unsigned int);
+        va_arg(ap, int);
+        va_arg(ap, int);
+        receive_timed(p, from_pid, (unsigned int) va_arg(ap, int));
+        break;
+      case ASEND:
+        dest_pid = (unsigned int) va_arg(ap, unsigned int);
+        va_arg(ap, int);
+        va_arg(ap, int);
+        asend(p, dest_pid, va_arg(ap, int));
+        break;
+      case SENDRECV:
+        dest_pid = (unsigned int) va_arg(ap, unsigned int);
+        sendrecv(p, dest_pid);
+        break;
+      case REPLY:
+        dest_pid = (unsigned int) va_arg(ap, unsigned int);
+        reply(p, dest_pid);
+        break;
+      case BUF_ALLOC:
+        p->irc = (int) lend_alloc(p, va_arg(ap, int));
+        to_ready = p;
+        break;
+      case BUF_FREE:
+        p->irc = lend_free(p, (void*) va_arg(ap, int));
+        to_ready = p;
+        break;
+      case LEND:
+        dest_pid = (unsigned int) va_arg(ap, unsigned int);
+        lend(p, dest_pid);
+        break;
+      case RECV_LENT:
+        from_pid = (unsigned int*) va_arg(ap, unsigned int);
+        receive_lent(p, from_pid);
+        break;
+      case SENDV:
+        dest_pid = (unsigned int) va_arg(ap, unsigned int);
+        sendv(p, dest_pid);
+        break;
+      case RECVV:
+        from_pid = (unsigned int*) va_arg(ap, unsigned int);
+        receivev(p, from_pid);
+        break;
+      case WRITEV:
+        fd = va_arg(ap, int);
+        buf = (void*) va_arg(ap, int);
+        rc = di_writev(p, fd, (iovec*) buf, va_arg(ap, int));
+        if (rc == DRV_BLOCK) {
+          p->state = WRITING;
+        } else {
+          to_ready = p;
+        }
+        break;
+      case READV:
+        fd = va_arg(ap, int);
+        buf = (void*) va_arg(ap, int);
+        rc = di_readv(p, fd, (iovec*) buf, va_arg(ap, int));
+        if (rc == DRV_BLOCK) {
+          p->state = READING;
+        } else {
+          to_ready = p;
+        }
+        break;
+      case POLL:
+        poll(p);
+        break;
+      case BATCH:
+        p->batch = (batchEntry*) va_arg(ap, int);
+        p->batch_count = va_arg(ap, int);
+        p->batch_next = 0;
+        if (!p->batch || p->batch_count < 0 || p->batch_count > MAX_BATCH) {
+          p->batch = NULL;
+          p->irc = SYSERR;
+        }
+        to_ready = p;
+        break;
+      case PROFILE:
+        p->irc = prof_control(va_arg(ap, int));
+        to_ready = p;
+        break;
+      case TRACE_CTL:
+        p->irc = trace_control(va_arg(ap, int));
+        to_ready = p;
+        break;
+      case PROC_STAT:
+        pid = va_arg(ap, int);
+        p->irc = proc_stat(p, pid, (procStat*) va_arg(ap, int));
+        to_ready = p;
+        break;
       default:
         break;
     }
+    if (request != SYS_TIMER) {
+      trace(TR_SYSRET, p->pid, request);
+    }
+
+    // Run the next request of a batch without going back to the process,
+    // a request that blocks ends the batch and returns its own result
+    if (p->batch) {
+      if (to_ready == p) {
+        request = batch_next(p);
+        if (request != SYSERR) {
+          to_ready = NULL;
+          goto handle_request;
+        }
+      } else {
+        p->batch = NULL;
+      }
+    }
 
     if (to_ready) {
       ready(to_ready);
     }
+#if SCHEDULER == SCHED_MLFQ
+    else if (p->state == READING || p->state == RECEIVING ||
+        p->state == SLEEPING || p->state == REPLY_BLOCKED ||
+        p->state == POLLING) {
+      mlfq_block(p);
+    }
+#endif
 
+    // The idle process sits alone on the lowest level,
+    // so it only gets picked when nothing else is ready
+    last = p;
     p = next();
+    if (p == NULL) {
+      kprintf("Ready queue empty, dispatch() returning\n");
+    }
 
-    // Try to not run the idle process if there are others in queue
-    if (idle != NULL && p == idle) {
-      p = next();
-      if (p == NULL) {
-        p = idle;
+    // Only the end of its time slice preempts a process, any other
+    // switch follows a syscall it made
+    if (p != last && last->state != STOPPED) {
+      if (slice_over) {
+        last->involuntary++;
       } else {
-        ready(idle);
+        last->voluntary++;
       }
-    } else if (p == NULL) {
-      kprintf("Ready queue empty, dispatch() returning\n");
     }
   }
 }
 
-/* PID to PCB indx lookup map functions */
-static int balanceFactor(treeNode*);
-static void updateHeight(treeNode*);
-static treeNode* rotateLeft(treeNode*);
-static treeNode* rotateRight(treeNode*node);
-static treeNode* insert(treeNode*, unsigned int, unsigned int);
-static int lookup(treeNode*, unsigned int, unsigned int *);
-static treeNode* delete(treeNode*, unsigned int);
-
-void pidMapInsert(unsigned int pid, unsigned int pcbIndex) {
-  pidMap = insert(pidMap, pid, pcbIndex);
+/*
+ * Posts the result of the batch entry that just ran and moves on to the
+ * next one, entries with requests that may switch processes or leave p
+ * on the ready queue get SYSERR, only requests the dispatcher completes
+ * right away can run in a batch
+ * @return request of the next entry, or SYSERR at the end of the batch
+ */
+static int batch_next(pcb* p) {
+  batchEntry *entry;
+
+  if (p->batch_next) {
+    p->batch[p->batch_next - 1].result = p->irc;
+  }
+  while (p->batch_next < p->batch_count) {
+    entry = p->batch + p->batch_next++;
+    switch (entry->request) {
+      case GET_PID:
+      case GET_P_PID:
+      case PUTS:
+      case KILL:
+      case OPEN:
+      case CLOSE:
+      case WRITE:
+      case WRITEV:
+      case SET_PRIO:
+      case GET_PRIO:
+      case MEM_INFO:
+      case PROC_STAT:
+      case BUF_ALLOC:
+      case BUF_FREE:
+      case SIGHANDLER:
+        p->iargs = (unsigned int) entry->args;
+        return entry->request;
+      default:
+        entry->result = SYSERR;
+        break;
+    }
+  }
+  p->irc = p->batch_count;
+  p->batch = NULL;
+  return SYSERR;
 }
 
-void pidMapDelete(unsigned int pid) {
-  pidMap = delete(pidMap, pid);
+/*
+ * Copies the accounting of pid, of p itself if pid is 0,
+ * or of the process in slot i if pid is PROC_SLOT(i)
+ * @return OK, or SYSERR if there is no such process or stat is NULL
+ */
+static int proc_stat(pcb* p, unsigned int pid, procStat* stat) {
+  pcb *target;
+
+  if (pid & PROC_SLOT_FLAG) {
+    pid &= ~PROC_SLOT_FLAG;
+    target = pid < MAX_NUM_PROCESS ? pcbTable + pid : NULL;
+    if (target && target->state == STOPPED) {
+      target = NULL;
+    }
+  } else {
+    target = lookup_pcb(p, pid);
+  }
+  if (!target || !stat) {
+    return SYSERR;
+  }
+
+  stat->pid = target->pid;
+  stat->parentPid = target->parentPid;
+  stat->state = target->state;
+  stat->priority = target->priority;
+  stat->cycles = target->cycles;
+  stat->wait_cycles = target->wait_cycles;
+  stat->ticks = target->ticks;
+  stat->voluntary = target->voluntary;
+  stat->involuntary = target->involuntary;
+  stat->syscalls = target->syscalls;
+  return OK;
+}
+
+/* Returns the PCB of pid, or of p itself if pid is 0, NULL if pid is unused */
+static pcb* lookup_pcb(pcb* p, unsigned int pid) {
+  unsigned int pcb_index;
+
+  if (!pid) {
+    return p;
+  } else if (pidMapLookup(pid, &pcb_index) == OK) {
+    return pcbTable + pcb_index;
+  }
+  return NULL;
 }
 
+/*
+ * PID to PCB index lookup
+ * The low bits of a PID are the PCB table index and the high bits are a
+ * generation number bumped every time the PCB is reused, so a stale PID
+ * of a stopped process never matches the current occupant of its PCB
+ */
 int pidMapLookup(unsigned int pid, unsigned int *pcbIndex) {
-  return lookup(pidMap, pid, pcbIndex);
+  pcb *p;
+
+  p = pcbTable + PID_INDEX(pid);
+  if (pid && p->pid == pid && p->state != STOPPED) {
+    *pcbIndex = PID_INDEX(pid);
+    return OK;
+  }
+  return 0;
 }
 
 
@@ -222,217 +501,284 @@ void init_pcb_table(void) {
   unsigned int i;
   pcb* p;
 
-  for (i = 0; i < MAX_NUM_PROCESS; i++) {
+  free_pcbs = NULL;
+  for (i = MAX_NUM_PROCESS; i-- > 0;) {
     p = pcbTable + i;
     p->pid = 0;
     p->state = STOPPED;
-    p->next = p->senders = p->receivers = NULL;
-    p->irc = p->iargs = p->delta = p->pending_sig = p->allowed_sig = 0;
+    p->prev = NULL;
+    p->wait_queue = NULL;
+    p->senders.head = p->senders.tail = NULL;
+    p->receivers.head = p->receivers.tail = NULL;
+    p->awaiting_reply.head = p->awaiting_reply.tail = NULL;
+    p->pollers.head = p->pollers.tail = NULL;
+    p->mbox = NULL;
+    p->lent = NULL;
+    p->next = free_pcbs;
+    free_pcbs = p;
+    p->irc = p->iargs = p->pending_sig = p->allowed_sig = 0;
+    p->timer.prev = p->timer.next = NULL;
+    p->priority = DEFAULT_PRIORITY;
+    p->cycles = p->wait_cycles = 0;
+    p->ticks = p->voluntary = p->involuntary = p->syscalls = 0;
   }
-  nextPid = 1;
-  ready_queue = NULL;
+  init_ready_queue();
+  init_timers();
   idle = NULL;
-  pidMap = NULL;
 }
 
-/* Returns a PCB pointer  */
+void init_ready_queue(void) {
+  int i;
+
+  for (i = 0; i < NUM_PRIORITY; i++) {
+    ready_queue[i].head = ready_queue[i].tail = NULL;
+  }
+  ready_bitmap = 0;
+}
+
+/* Returns the PCB at the head of the highest non-empty level */
 pcb *next(void) {
-  pcb *next = ready_queue;
-  if (next) {
-    ready_queue = next->next;
-    next->next = NULL;
+  pcb *next;
+  pcbQueue *q;
+  int level;
+
+  if (!ready_bitmap) {
+    return NULL;
+  }
+
+  level = bit_scan_forward(ready_bitmap);
+  q = ready_queue + level;
+  next = q->head;
+  q->head = next->next;
+  if (!q->head) {
+    q->tail = NULL;
+    ready_bitmap &= ~(1 << level);
   }
+  next->next = NULL;
+  next->wait_cycles += read_tsc() - next->ready_since;
   return next;
 }
 
+/* Appends p to the tail of its priority level */
 void ready(pcb* p) {
-  pcb **end;
+  pcbQueue *q;
 
-  end = &ready_queue;
-  while(*end) {
-    end = &((*end)->next);
+  if (p->state > READY) {
+    trace(TR_WAKEUP, p->pid, p->state);
   }
-  *end = p;
+  q = ready_queue + p->priority;
+  if (q->tail) {
+    q->tail->next = p;
+  } else {
+    q->head = p;
+    ready_bitmap |= 1 << p->priority;
+  }
+  q->tail = p;
   p->next = NULL;
   p->state = READY;
+  p->ready_since = read_tsc();
 }
 
-void cleanup(pcb* p) {
-  int fd;
-  pcb *sender, *receiver;
+/*
+ * Changes the priority level of p, moving it to the new level
+ * if it is currently on the ready queue
+ * @return the old priority or SYSERR if priority is out of range
+ */
+int setprio(pcb* p, int priority) {
+  int old;
 
-  // Unblock all blocked trying to send to/ receive from this process
-  while (p->senders) {
-    sender = p->senders;
-    p->senders = sender->next;
-    sender->irc = SYS_SR_NO_PID;
-    ready(sender);
-  }
-  while (p->receivers) {
-    receiver = p->receivers;
-    p->receivers = receiver->next;
-    receiver->irc = SYS_SR_NO_PID;
-    ready(receiver);
+  if (priority < 0 || priority >= NUM_PRIORITY) {
+    return SYSERR;
   }
 
-  // Close all opened device
-  for (fd = 0; fd < NUM_FD; fd++) {
-    if (p->opened_dv[fd]) {
-      di_close(p, fd);
-    }
+  old = p->priority;
+  if (p->state == READY && old != priority) {
+    ready_remove(p);
+    p->priority = priority;
+    ready(p);
+  } else {
+    p->priority = priority;
   }
-
-  kfree(p->stack);
-  p->next = NULL;
-  p->stack = NULL;
-  p->state = STOPPED;
-  pidMapDelete(p->pid);
+  return old;
 }
 
-void print_ready_q() {
-  int nl = 0;
-  pcb *pcb = ready_queue;
-  while (pcb) {
-    nl = 1;
-    kprintf("pid%u->", pcb->pid);
-    assertEquals(pcb->state, READY);
-    pcb = pcb->next;
+#if SCHEDULER == SCHED_MLFQ
+/*
+ * Charges a time slice to the interrupted process. A process that used up
+ * its quantum is demoted and goes to the back of the lower level, otherwise
+ * it goes back to the front of its level so it keeps running unless a
+ * higher level process became ready.
+ */
+static void mlfq_tick(pcb* p) {
+  if (++mlfq_ticks >= MLFQ_BOOST_TICKS) {
+    mlfq_ticks = 0;
+    mlfq_boost();
   }
-  kprintf(nl?"\n":"");
-}
 
-/******************************************************************************
-  AVL tree implementations
- *****************************************************************************/
-static int balanceFactor(treeNode *node) {
-  unsigned int lH, rH;
-  lH = node->left ? node->left->height : 0;
-  rH = node->right ? node->right->height : 0;
-  return lH - rH;
+  if (p->priority == IDLE_PRIORITY) {
+    ready(p);
+  } else if (--p->slice_left == 0) {
+    if (p->priority < IDLE_PRIORITY - 1) {
+      p->priority++;
+    }
+    p->slice_left = MLFQ_QUANTUM(p->priority);
+    ready(p);
+  } else {
+    ready_front(p);
+  }
 }
 
-/* 
- * Update height of AVL tree node, leaf has height of 1
- * Assumes children heights are correct
+/*
+ * Promotes a process that blocked waiting for input, a message or a timer
  */
-static void updateHeight(treeNode *node) {
-  node->height = max(node->left ? node->left->height : 0,
-      node->right ? node->right->height : 0) + 1;
-}
-
-static treeNode* rotateLeft(treeNode* node) {
-  treeNode* ret = node->right;
-  node->right = ret->left;
-  ret->left = node;
-  updateHeight(node);
-  updateHeight(ret);
-  return ret;
-}
-
-static treeNode* rotateRight(treeNode* node) {
-  treeNode* ret = node->left;
-  node->left = ret->right;
-  updateHeight(node);
-  updateHeight(ret);
-  return ret;
+static void mlfq_block(pcb* p) {
+  if (p->priority != IDLE_PRIORITY && p->priority > 0) {
+    p->priority--;
+  }
+  p->slice_left = MLFQ_QUANTUM(p->priority);
 }
 
 /*
- * Inserts a node and balances the tree
+ * Moves every process back to the top level so CPU bound
+ * processes can not be starved by interactive ones
  */
-static treeNode* insert(treeNode* node, unsigned int pid, unsigned int pcbIndex) {
-  treeNode *newNode;
-  if (!node) {
-    newNode = (treeNode*) kmalloc(sizeof(treeNode));
-    if (!newNode) {
-      kprintf("PID map insert failed\n");
-      abort();
+static void mlfq_boost(void) {
+  int level, i;
+  pcbQueue *top, *q;
+  pcb *p;
+
+  // Splice the ready lower levels onto the top level
+  top = ready_queue;
+  for (level = 1; level < IDLE_PRIORITY; level++) {
+    q = ready_queue + level;
+    if (!q->head) {
+      continue;
     }
-    newNode->pid = pid;
-    newNode->pcbIndex = pcbIndex;
-    newNode->left = newNode->right = NULL;
-    newNode->height = 1;
-    node = newNode;
-    return node;
-  } else if (pid > node->pid) {
-    node->right = insert(node->right, pid, pcbIndex);
-    updateHeight(node);
-  } else if (pid < node->pid) {
-    node->left = insert(node->left, pid, pcbIndex);
-    updateHeight(node);
-  } else {
-    node->pcbIndex = pcbIndex;
-    return node;
+    if (top->tail) {
+      top->tail->next = q->head;
+    } else {
+      top->head = q->head;
+    }
+    top->tail = q->tail;
+    q->head = q->tail = NULL;
+    ready_bitmap = (ready_bitmap & ~(1 << level)) | 1;
   }
 
-  /* Retore Balance */
-  if (balanceFactor(node) > 1) {
-    // New inserted in left subtree caused imbalance
-    if (balanceFactor(node->left) < 0) {
-      node->left = rotateLeft(node->left);
-    }
-    node = rotateRight(node);
-  } else if (balanceFactor(node) < -1) {
-    // New inserted in right subtree caused imbalance
-    if (balanceFactor(node->right) > 0) {
-      node->right = rotateRight(node->right);
+  for (i = 0; i < MAX_NUM_PROCESS; i++) {
+    p = pcbTable + i;
+    if (p->state != STOPPED && p->priority != IDLE_PRIORITY) {
+      p->priority = 0;
+      p->slice_left = MLFQ_QUANTUM(0);
     }
-    node = rotateLeft(node);
   }
-  return node; 
 }
 
-/*
- * Recursive binary tree lookup
- */
-static int lookup(treeNode* node, unsigned int pid, unsigned int *pcbIndex) {
-  if (!node) {
-    return 0;
-  } else if (node->pid == pid) {
-    *pcbIndex = node->pcbIndex;
-    return OK;
-  } else if (pid > node->pid) {
-    return lookup(node->right, pid, pcbIndex);
-  } else {
-    return lookup(node->left, pid, pcbIndex);
+#endif
+
+/* Pushes p to the head of its priority level */
+static void ready_front(pcb* p) {
+  pcbQueue *q;
+
+  q = ready_queue + p->priority;
+  p->next = q->head;
+  q->head = p;
+  if (!q->tail) {
+    q->tail = p;
+    ready_bitmap |= 1 << p->priority;
   }
+  p->state = READY;
+  p->ready_since = read_tsc();
 }
 
 /*
- * Returns the element with the largest key that is less then node's key in node's subtree
+ * Unlinks a ready process from its level, only used when priority changes
  */
-treeNode* predecessor(treeNode* node) {
-  treeNode *pred = node->left;
-  while (pred && pred->right)
-    pred = pred->right;
-  return pred;
+static void ready_remove(pcb* p) {
+  pcbQueue *q;
+  pcb **link, *prev;
+
+  q = ready_queue + p->priority;
+  prev = NULL;
+  link = &q->head;
+  while (*link && *link != p) {
+    prev = *link;
+    link = &prev->next;
+  }
+  if (*link) {
+    *link = p->next;
+    if (q->tail == p) {
+      q->tail = prev;
+    }
+    if (!q->head) {
+      ready_bitmap &= ~(1 << p->priority);
+    }
+    p->next = NULL;
+  }
 }
 
-/*
- * Removes a node from tree 
- */
-static treeNode* delete(treeNode* node, unsigned int pid) {
-  treeNode *pred, *child;
-  if (!node) {
-    // PID not in tree, nothing to do
-    return NULL;
-  } else if (node->pid == pid) {
-    if (node->left && node->right) {
-      // Node has 2 children
-      pred = predecessor(node);
-      node->pid = pred->pid;
-      node->pcbIndex = pred->pcbIndex;
-      node->left = delete(node->left, pred->pid);
-    } else {
-      // Node has 1 child or no child, child has no children since tree is balanced
-      child = node->left ? node->left : node->right;
-      kfree(node);
-      return child;
+void cleanup(pcb* p) {
+  int fd;
+  pcb *sender, *receiver, *poller;
+
+  // Unblock all blocked trying to send to/ receive from this process
+  while ((sender = p->senders.head)) {
+    msg_dequeue(sender);
+    sender->irc = SYS_SR_NO_PID;
+    ready(sender);
+  }
+  while ((receiver = p->receivers.head)) {
+    msg_dequeue(receiver);
+    receiver->irc = SYS_SR_NO_PID;
+    ready(receiver);
+  }
+  while ((sender = p->awaiting_reply.head)) {
+    msg_dequeue(sender);
+    sender->irc = SYS_SR_NO_PID;
+    ready(sender);
+  }
+  // Pollers waiting for a message from this process can receive the error
+  while ((poller = p->pollers.head)) {
+    msg_dequeue(poller);
+    poller->irc = POLL_MSG;
+    ready(poller);
+  }
+
+  timer_cancel(&p->timer);
+  mbox_release(p);
+  lend_release(p);
+
+  // Close all opened device
+  for (fd = 0; fd < NUM_FD; fd++) {
+    if (p->opened_dv[fd]) {
+      di_close(p, fd);
     }
-  } else if (pid > node->pid) { 
-    node->right = delete(node->right, pid);
-  } else {
-    node->left = delete(node->left, pid);
   }
-  return node;
+
+  kfree(p->stack);
+  p->stack = NULL;
+  p->state = STOPPED;
+
+  // Return PCB to the free list
+  p->next = free_pcbs;
+  free_pcbs = p;
+}
+
+void print_ready_q() {
+  int nl, level;
+  pcb *pcb;
+
+  for (level = 0; level < NUM_PRIORITY; level++) {
+    nl = 0;
+    pcb = ready_queue[level].head;
+    while (pcb) {
+      if (!nl) {
+        kprintf("P%d: ", level);
+      }
+      nl = 1;
+      kprintf("pid%u->", pcb->pid);
+      assertEquals(pcb->state, READY);
+      pcb = pcb->next;
+    }
+    kprintf(nl?"\n":"");
+  }
 }
@@ -160,6 +160,17 @@ void enable_irq( unsigned int irq, int disable )
 }
 
 
+/*------------------------------------------------------------------------
+ * debug_exit - report a test result to QEMU through its isa-debug-exit
+ *              device, does nothing if there is no such device
+ *------------------------------------------------------------------------
+ */
+void debug_exit(int code)
+{
+        outb( DEBUG_EXIT_PORT, code );
+}
+
+
 /*------------------------------------------------------------------------
  * getCS - returns current CS selector
  *------------------------------------------------------------------------
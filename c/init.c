@@ -16,17 +16,10 @@ extern devsw devtab[NUM_DEVICE];
 
 extern void set_evec(unsigned int xnum, unsigned long handler);
 extern void enable_irq(unsigned int, int);
-extern void initSyscall(void);
-extern void enableTimerInterrupt(void);
 extern void set_keyboard_ISR(void);
-extern void init_pcb_table(void);
-extern void dispatch(void);
-extern void kmeminit(void);
-extern int create (void (*func)(void), int stack, int parent);
-extern void idleproc(void);
-
-extern pcb *ready_queue;
-extern pcb *sleep_list;
+#if RUNBENCH
+extern void run_bench(void);
+#endif
 
 static void init_keyboard(void);
 
@@ -35,11 +28,23 @@ static void init_keyboard(void);
 static void run_test(void);
 static void testFreeList(void);
 static void testKmalloc(void);
-static void testContextSwitch(void);
+static void testSizeClasses(void);
 static void testProcessManagement(void);
+static void testSlabCache(void);
+static void testTlsf(void);
+static void benchKmalloc(void);
+static void testContextSwitch(void);
+static void testReadyQueue(void);
 static void testPidMap(void);
+static void testPcbChurn(void);
+static void benchPidMap(void);
 static void testSendReceive(void);
+static void benchRpc(void);
+static void benchSyscall(void);
+static void testBatch(void);
+static void testProcStat(void);
 static void testTimeSharing(void);
+static void testProfiler(void);
 static void testSleepList(void);
 static void test_signal(void);
 static void test_device(void);
@@ -54,14 +59,32 @@ void run_test() {
   kprintf("Passed memory test 1\n");
   testFreeList();
   kprintf("Passed memory test 2\n");
+  testSizeClasses();
+  kprintf("Passed memory test 3\n");
+  testTlsf();
+  kprintf("Passed TLSF test\n");
+  benchKmalloc();
+  testSlabCache();
+  kprintf("Passed slab cache test\n");
   testContextSwitch();
   kprintf("Passed context switch test\n");
+  testReadyQueue();
+  kprintf("Passed ready queue test\n");
   testProcessManagement();
   kprintf("Passed process management test\n");
   testPidMap();
   kprintf("Passed PID reuse test\n");
+  benchPidMap();
+  testPcbChurn();
+  kprintf("Passed PCB churn test\n");
   testSendReceive();
   kprintf("Passed messaging test\n");
+  benchRpc();
+  benchSyscall();
+  testBatch();
+  kprintf("Passed syscall batch test\n");
+  testProcStat();
+  kprintf("Passed process accounting test\n");
   testSleepList();
   kprintf("Passed sleep list test\n");
   
@@ -71,6 +94,8 @@ void run_test() {
 
   testTimeSharing();
   kprintf("Passed time sharing test\n");
+  testProfiler();
+  kprintf("Passed profiler test\n");
   test_signal();
   kprintf("Passed signal tests\n");
 
@@ -96,11 +121,17 @@ void init_keyboard() {
   devtab[KEYBOARD_0].dvread = keyboard_read;
   devtab[KEYBOARD_0].dvwrite = keyboard_write;
   devtab[KEYBOARD_0].dvioctl = keyboard_ioclt;
+  devtab[KEYBOARD_0].dvreadv = keyboard_readv;
+  devtab[KEYBOARD_0].dvwritev = keyboard_writev;
+  devtab[KEYBOARD_0].dvpoll = keyboard_poll;
   devtab[KEYBOARD_1].dvopen = keyboard_open_echo;
   devtab[KEYBOARD_1].dvclose = keyboard_close;
   devtab[KEYBOARD_1].dvread = keyboard_read;
   devtab[KEYBOARD_1].dvwrite = keyboard_write;
   devtab[KEYBOARD_1].dvioctl = keyboard_ioclt;
+  devtab[KEYBOARD_1].dvreadv = keyboard_readv;
+  devtab[KEYBOARD_1].dvwritev = keyboard_writev;
+  devtab[KEYBOARD_1].dvpoll = keyboard_poll;
   // Disable keyboard interrupt
   enable_irq(1,1);
 }
@@ -116,6 +147,13 @@ void initproc( void )
 
   #if RUNTEST
   run_test();
+  // Only returns if not running under QEMU
+  debug_exit(EXIT_PASS);
+  #endif
+
+  #if RUNBENCH
+  // Never returns
+  run_bench();
   #endif
 
   // Init memory management
@@ -134,20 +172,27 @@ void initproc( void )
   init_keyboard();
 
   // Create first user process
-  pid = create(root, 0x2000, NULL);
-  // pid = create(semaphore_root, 0x2000, NULL);
+  pid = create(root, DEFAULT_STACK_SIZE, NULL);
+  // pid = create(semaphore_root, DEFAULT_STACK_SIZE, NULL);
   if (pid == SYSERR) {
     kprintf("failed to create root process\n");
   }
 
+#if TOP_PROCESS
+  if (create(top, DEFAULT_STACK_SIZE, NULL) == SYSERR) {
+    kprintf("failed to create top process\n");
+  }
+#endif
+
   // Create the idle process
-  pid = create(idleproc, 0x2000, NULL);
+  pid = create(idleproc, DEFAULT_STACK_SIZE, NULL);
   if (pid == SYSERR) {
     kprintf("failed to create idle process\n");
   }
   pidMapLookup(pid, &pcb_index);
   idle = pcbTable + pcb_index;
   assertEquals(idle->state, READY);
+  setprio(idle, IDLE_PRIORITY);
 
   dispatch();
 
@@ -185,65 +230,32 @@ void inline abort() {
 #define SIG_MID 16
 #define SIG_HI 31
 
-extern memHeader *freeList;
+extern sizeClassStats kmallocStats[LARGE_CLASS];
 extern  long  freemem;
 extern int contextswitch(pcb* );
 extern pcb pcbTable[MAX_NUM_PROCESS];
-extern treeNode *pidMap;
-extern void cleanup(pcb*);
-extern unsigned int nextPid;
+extern pcb *free_pcbs;
 extern int test_insert_char(unsigned char c);
 
 void debugMemHeader(memHeader *hdr) {
-  dprintf("header@0x%x: size(0x%x), next(0x%x), prev(0x%x), sanityCheck(0x%x)\n",
-      (void*) hdr, hdr->size, hdr->next, hdr->prev, hdr->sanityCheck);
-}
-
-void traverseFreeList(void) {
-  memHeader *hdr = freeList;
-  kprintf("Free list:\n");
-  while (hdr) {
-    kprintf("@0x%x:size(0x%x)\n", (void*) hdr, hdr->size);
-    hdr = hdr->next;
-  }
+  dprintf("header@0x%x: size(0x%x), prevSize(0x%x), flags(0x%x), sanityCheck(0x%x)\n",
+      (void*) hdr, hdr->size, hdr->prevSize, hdr->flags, hdr->sanityCheck);
 }
 
 int getFreeListSize(void) {
-  int i = 0;
-  memHeader *hdr = freeList;
-  dprintf("Free list:\n");
-  while (hdr != NULL) {
-    dprintf("node%u@0x%x: size(0x%x), next(0x%x), prev(0x%x), sanityCheck(0x%x)\n",
-        i, (void*) hdr, hdr->size, hdr->next, hdr->prev, hdr->sanityCheck);
-    hdr = hdr->next;
-    i++;
-  }
-  return i;
-}
-
-void printTree(treeNode* node, int indent) {
-  int i;
-  if (!node) return;
-  printTree(node->right, indent+1);
-  for (i=0; i<indent; i++)
-    kprintf("  ");
-  //kprintf("%02u->%02u\n", node->pid, node->pcbIndex);
-  kprintf("%02u\n", node->pid);
-  printTree(node->left, indent+1);
-  if (!indent)
-    kprintf("\n");
+  return heap_free_blocks();
 }
 
 void *testKmallocHelper(int size) {
-  memHeader *hdr ;
   void *addr;
 
   addr = kmalloc(size);
   dprintf("kmalloc(0x%x) returned address 0x%x\n", size, addr);
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
   if (addr) {
-    hdr = (memHeader*) (addr - sizeof(memHeader));
-    debugMemHeader(hdr);
+    debugMemHeader((memHeader*) (addr - sizeof(memHeader)));
   }
+#endif
   return addr;
 }
 
@@ -256,111 +268,327 @@ void testFreeList(void) {
   void *ptr1, *ptr2, *ptr3;
   int listSize;
 
-  // Expects 2 node, before and after hole
-  listSize = getFreeListSize();
-  assertEquals(listSize, 2);
-
-  // Allocate all memory before hole
-  ptr1 = testKmallocHelper(freeList->size);
+  // The heap chunk taken by the last test is a single free block
   listSize = getFreeListSize();
   assertEquals(listSize, 1);
 
-  // Allocate all memory after hole
-  ptr2 = testKmallocHelper(freeList->size);
-  listSize = getFreeListSize();
-  assertEquals(listSize, 0);
-  
-  // Free all memory after hole
-  testKfree(ptr2);
+  // Page allocations do not touch the free list
+  ptr1 = testKmallocHelper(2*NBPG);
   listSize = getFreeListSize();
   assertEquals(listSize, 1);
-    
-  // Free all memory before hole
   testKfree(ptr1);
   listSize = getFreeListSize();
-  assertEquals(listSize, 2);
+  assertEquals(listSize, 1);
 
   // Try to free some random address
   testKfree((void*) HOLEEND + 0x4000);
   listSize = getFreeListSize();
-  assertEquals(listSize, 2);
+  assertEquals(listSize, 1);
   
   // Allocate blocks then free in reverse order
   ptr1 = testKmallocHelper(0x100);
   listSize = getFreeListSize();
-  assertEquals(listSize, 2);
+  assertEquals(listSize, 1);
   
   ptr2 = testKmallocHelper(0x100);
   ptr3 = testKmallocHelper(0x100);
   listSize = getFreeListSize();
-  assertEquals(listSize, 2);
+  assertEquals(listSize, 1);
 
   // no coalision
   testKfree(ptr2);
   listSize = getFreeListSize();
-  assertEquals(listSize, 3);
+  assertEquals(listSize, 2);
 
   // first 2 coalesce
   testKfree(ptr1);
   listSize = getFreeListSize();
-  assertEquals(listSize, 3);
+  assertEquals(listSize, 2);
 
   // expected coalision
   testKfree(ptr3);
   listSize = getFreeListSize();
-  assertEquals(listSize, 2);
+  assertEquals(listSize, 1);
 }
 
 void testKmalloc(void) {
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
   memHeader *hdr;
-  void *ptr, *expected, *alignedStart, *ptr_a[3];
+#endif
+  void *ptr, *ptr_a[4];
+  memInfo before, after;
   int size;
 
-  // Setup
-  alignedStart = (void*) ((freemem/16 + (freemem%16?1:0)) * 16);
+  mem_report(&before);
+  assertEquals(before.heapPages, 0);
 
-  // Regular case
+  // Regular case, the heap takes its first chunk of pages
   size = 0x100;
   ptr = ptr_a[0] = testKmallocHelper(size);
-  expected = alignedStart + sizeof(memHeader);
-  assertEquals(ptr, expected);
-  hdr = (memHeader*) (ptr - sizeof(memHeader));
+  assert(ptr);
+  mem_report(&after);
+  assertEquals(after.heapPages, KMALLOC_CHUNK_PAGES);
+  assertEquals(after.freePages, before.freePages - KMALLOC_CHUNK_PAGES);
+  ptr = ptr_a[1] = testKmallocHelper(size - 0xf);
+  assert(ptr);
+  assertEquals((unsigned int) ptr % 16, 0);
+
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
+  // Blocks are carved from the start of the chunk
+  hdr = (memHeader*) (ptr_a[0] - sizeof(memHeader));
   assertEquals(hdr->size, size);
+  assertEquals((unsigned int) hdr % NBPG, 0);
   
   // Test memory alignment
-  size = 0x100;
-  ptr = ptr_a[1] = testKmallocHelper(size - 0xf);
-  expected = alignedStart + 2*sizeof(memHeader) + 0x100;
-  assertEquals(ptr, expected);
+  assertEquals(ptr, ptr_a[0] + size + sizeof(memHeader));
   hdr = (memHeader*) (ptr - sizeof(memHeader));
   assertEquals(hdr->size, size);
+  // Boundary tag of the block right below
+  assertEquals(hdr->prevSize, size);
+#endif
 
-  // Allocate all memory before HOLESTART
-  size = HOLESTART - ((int) alignedStart + 3*sizeof(memHeader) + 0x200);
-  ptr = ptr_a[2] = testKmallocHelper(size);
-  expected = alignedStart + 3*sizeof(memHeader) + 0x200;
-  assertEquals(ptr, expected);
-  hdr = (memHeader*) (ptr - sizeof(memHeader));
-  assertEquals(hdr->size, size);
-
-  // Allocate something after hole
-  size = 0x100;
-  ptr = ptr_a[3] = testKmallocHelper(size);
-  expected = (void*) HOLEEND + sizeof(memHeader);
-  
-  // Assert returned address is after HOLE
-  assertEquals(ptr, expected);
+  // Larger blocks get exactly the pages they need
+  ptr = ptr_a[2] = testKmallocHelper(KMALLOC_PAGE_MIN + 1);
+  assertEquals((unsigned int) ptr % NBPG, 0);
+  ptr = ptr_a[3] = testKmallocHelper(3*NBPG);
+  assertEquals((unsigned int) ptr % NBPG, 0);
+  mem_report(&after);
+  assertEquals(after.freePages, before.freePages - KMALLOC_CHUNK_PAGES - 4);
 
   kfree(ptr_a[0]);
   kfree(ptr_a[1]);
   kfree(ptr_a[2]);
   kfree(ptr_a[3]);
 
+  // Heap pages are kept, other pages are merged back
+  mem_report(&after);
+  assertEquals(after.freePages, before.freePages - KMALLOC_CHUNK_PAGES);
+  assertEquals(after.largestFree, before.largestFree);
+
   // Try to allocate more memory than possible
   ptr = testKmallocHelper(0x400000);
   assertEquals(ptr, NULL);
 }
 
+void testSizeClasses(void) {
+  void *ptr1, *ptr2, *ptr3, *ptr4;
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
+  memHeader *hdr;
+  unsigned int hits, misses;
+#endif
+
+  ptr1 = testKmallocHelper(0x81);
+  ptr2 = testKmallocHelper(0x100);
+  ptr3 = testKmallocHelper(0x10);
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
+  // Small requests are rounded up to a power of two
+  hdr = (memHeader*) (ptr1 - sizeof(memHeader));
+  assertEquals(hdr->size, 0x100);
+  hdr = (memHeader*) (ptr3 - sizeof(memHeader));
+  assertEquals(hdr->size, 0x10);
+  hits = kmallocStats[4].hits;
+  misses = kmallocStats[4].misses;
+#endif
+
+  // A freed block between allocated blocks is reused
+  testKfree(ptr2);
+  assertEquals(testKmallocHelper(0xf0), ptr2);
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
+  // from its size class
+  assertEquals(kmallocStats[4].hits, hits + 1);
+  assertEquals(kmallocStats[4].misses, misses);
+#endif
+
+  // Nothing that fits is left in between, the block comes from
+  // further up
+  ptr4 = testKmallocHelper(0x100);
+  assert(ptr4 > ptr3);
+#if KMALLOC_BACKEND == KMALLOC_SEGFIT
+  assertEquals(kmallocStats[4].misses, misses + 1);
+#endif
+
+  // Double free is ignored
+  testKfree(ptr3);
+  testKfree(ptr3);
+  testKfree(ptr1);
+  testKfree(ptr2);
+  testKfree(ptr4);
+  assertEquals(getFreeListSize(), 1);
+}
+
+#define TLSF_TEST_REGION 0x10000
+void testTlsf(void) {
+  tlsfPool pool;
+  void *region, *ptr1, *ptr2, *ptr3;
+  tlsfBlock *block;
+
+  region = kmalloc(TLSF_TEST_REGION);
+  assert(region);
+  tlsf_init(&pool);
+  assertEquals(tlsf_add_region(&pool, region, region + 2*sizeof(tlsfBlock)), SYSERR);
+  assertEquals(tlsf_add_region(&pool, region, region + TLSF_TEST_REGION), OK);
+
+  // Blocks are 16 byte aligned and carved from the start of the region
+  ptr1 = tlsf_malloc(&pool, 0x81);
+  assertEquals(ptr1, region + sizeof(tlsfBlock));
+  block = (tlsfBlock*) (ptr1 - sizeof(tlsfBlock));
+  assertEquals(block->size, 0x90);
+  ptr2 = tlsf_malloc(&pool, 0x100);
+  assertEquals(ptr2, ptr1 + 0x90 + sizeof(tlsfBlock));
+  ptr3 = tlsf_malloc(&pool, 0x10);
+  assertEquals(ptr3, ptr2 + 0x100 + sizeof(tlsfBlock));
+
+  // A freed block between allocated blocks is the best fit
+  tlsf_free(&pool, ptr2);
+  assertEquals(tlsf_malloc(&pool, 0xf0), ptr2);
+
+  // Too large
+  assertEquals(tlsf_malloc(&pool, TLSF_TEST_REGION), NULL);
+
+  // Double free is ignored, everything coalesces back into one block
+  tlsf_free(&pool, ptr3);
+  tlsf_free(&pool, ptr3);
+  tlsf_free(&pool, ptr1);
+  tlsf_free(&pool, ptr2);
+  block = (tlsfBlock*) region;
+  assert(block->isFree);
+  assertEquals(block->size, TLSF_TEST_REGION - 2*sizeof(tlsfBlock));
+  assertEquals(pool.flBitmap, 1 << (bit_scan_reverse(block->size) - TLSF_FL_SHIFT + 1));
+  assertEquals(tlsf_free_blocks(&pool), 1);
+  assertEquals(tlsf_malloc(&pool, TLSF_TEST_REGION / 2), ptr1);
+
+  kfree(region);
+}
+
+#define TRACE_SEED 415
+#define TRACE_SLOTS 128
+#define TRACE_OPS 20000
+static tlsfPool benchPool;
+
+static void* benchTlsfMalloc(int size) {
+  return tlsf_malloc(&benchPool, size);
+}
+
+static void benchTlsfFree(void *ptr) {
+  tlsf_free(&benchPool, ptr);
+}
+
+/*
+ * Runs the same randomized alloc/free trace against an allocator, mostly
+ * small blocks with an occasional large one, and prints the average and
+ * worst case cycles of each operation
+ */
+static void runAllocTrace(char *name, void* (*alloc)(int), void (*release)(void*)) {
+  void *slots[TRACE_SLOTS];
+  unsigned long start, cycles, allocMax, allocTotal, freeMax, freeTotal;
+  unsigned int i, op, numAlloc, numFree;
+  int size;
+
+  for (i = 0; i < TRACE_SLOTS; i++) {
+    slots[i] = NULL;
+  }
+  allocMax = allocTotal = freeMax = freeTotal = 0;
+  numAlloc = numFree = 0;
+
+  srand(TRACE_SEED);
+  for (op = 0; op < TRACE_OPS; op++) {
+    i = rand() % TRACE_SLOTS;
+    if (slots[i]) {
+      start = (unsigned long) read_tsc();
+      release(slots[i]);
+      cycles = (unsigned long) read_tsc() - start;
+      slots[i] = NULL;
+      freeTotal += cycles;
+      freeMax = max(freeMax, cycles);
+      numFree++;
+    } else {
+      size = (rand() % 16) ? rand() % 0x400 + 1 : rand() % 0x8000 + 1;
+      start = (unsigned long) read_tsc();
+      slots[i] = alloc(size);
+      cycles = (unsigned long) read_tsc() - start;
+      assert(slots[i]);
+      allocTotal += cycles;
+      allocMax = max(allocMax, cycles);
+      numAlloc++;
+    }
+  }
+
+  for (i = 0; i < TRACE_SLOTS; i++) {
+    if (slots[i]) {
+      release(slots[i]);
+    }
+  }
+
+  kprintf("%s: alloc avg %u max %u cycles, free avg %u max %u cycles\n",
+      name, allocTotal / numAlloc, allocMax, freeTotal / numFree, freeMax);
+}
+
+/*
+ * Compares both kmalloc backends on the whole kernel heap, then kmalloc
+ */
+void benchKmalloc(void) {
+  segfit_init();
+  segfit_add_region((void*) freemem, (void*) HOLESTART);
+  segfit_add_region((void*) HOLEEND, (void*) FREEMEM_END);
+  runAllocTrace("segfit", segfit_malloc, segfit_free);
+
+  tlsf_init(&benchPool);
+  tlsf_add_region(&benchPool, (void*) freemem, (void*) HOLESTART);
+  tlsf_add_region(&benchPool, (void*) HOLEEND, (void*) FREEMEM_END);
+  runAllocTrace("tlsf", benchTlsfMalloc, benchTlsfFree);
+
+  // Pages for large blocks, the selected backend for small ones
+  kmeminit();
+  runAllocTrace("kmalloc", kmalloc, kfree);
+
+  kmeminit();
+  init_pcb_table();
+}
+
+#define SLAB_TEST_SIZE 40
+#define SLAB_TEST_MAGIC 0x5ab
+void slabCtor(void *obj) {
+  ((unsigned int*) obj)[0] = SLAB_TEST_MAGIC;
+}
+
+void testSlabCache(void) {
+  kmem_cache *cache;
+  void *obj[KMEM_SLAB_SIZE / SLAB_TEST_SIZE + 1], *first;
+  unsigned int i, n;
+
+  cache = kmem_cache_create("test", SLAB_TEST_SIZE, slabCtor);
+  assert(cache);
+  assertEquals(cache->size % 16, 0);
+  assert(cache->size >= SLAB_TEST_SIZE + sizeof(void*));
+
+  // Allocating one more object than a slab holds takes a second slab
+  n = cache->per_slab + 1;
+  for (i = 0; i < n; i++) {
+    obj[i] = kmem_cache_alloc(cache);
+    assert(obj[i]);
+    assertEquals(((unsigned int*) obj[i])[0], SLAB_TEST_MAGIC);
+  }
+  assertEquals(cache->slabs, 2);
+  assertEquals(cache->in_use, n);
+  assertEquals(obj[1], obj[0] + cache->size);
+
+  // Freed object is handed out again, still constructed
+  first = obj[0];
+  kmem_cache_free(cache, obj[0]);
+  assertEquals(kmem_cache_alloc(cache), first);
+  assertEquals(((unsigned int*) first)[0], SLAB_TEST_MAGIC);
+  assertEquals(cache->slabs, 2);
+
+  for (i = 0; i < n; i++) {
+    kmem_cache_free(cache, obj[i]);
+  }
+  assertEquals(cache->in_use, 0);
+
+  // Slabs are only released by kmeminit
+  kmeminit();
+  init_pcb_table();
+}
+
 void testContextSwitchChild(void) {
   int ret;
   __asm __volatile(
@@ -395,7 +623,7 @@ void testContextSwitch(void) {
   
   // Create a process that will set some values to its general registers
   pid = create(testContextSwitchChild, 0x2000, NULL);
-  assertEquals(pid, 1);
+  assertEquals(pid, 1 << PID_INDEX_BITS);
 
   // Get the new process PCB
   p = next();
@@ -419,7 +647,56 @@ void testContextSwitch(void) {
 
   // Clean up
   cleanup(p);
-  nextPid = 0;
+}
+
+void test_sysprio(void) {
+  assertEquals(sysgetprio(0), DEFAULT_PRIORITY);
+  assertEquals(sysgetprio(sysgetpid()), DEFAULT_PRIORITY);
+  assertEquals(sysgetprio(0xdeadbeef), SYSERR);
+
+  // Idle level is reserved
+  assertEquals(syssetprio(0, IDLE_PRIORITY), SYSERR);
+  assertEquals(syssetprio(0, -1), SYSERR);
+  assertEquals(syssetprio(0xdeadbeef, 1), SYSERR);
+
+  assertEquals(syssetprio(0, 1), DEFAULT_PRIORITY);
+  assertEquals(sysgetprio(0), 1);
+  test_print("syssetprio and sysgetprio return expected values\n");
+}
+
+void testReadyQueue(void) {
+  int i, pid;
+  unsigned int pcb_index;
+  pcb *p[3];
+
+  assertEquals(next(), NULL);
+  for (i = 0; i < 3; i++) {
+    pid = create(testContextSwitchChild, 0x2000, NULL);
+    pidMapLookup(pid, &pcb_index);
+    p[i] = pcbTable + pcb_index;
+  }
+
+  // Move the first process to the lowest level and the last one level down
+  assertEquals(setprio(p[0], IDLE_PRIORITY), DEFAULT_PRIORITY);
+  assertEquals(setprio(p[2], DEFAULT_PRIORITY + 1), DEFAULT_PRIORITY);
+  assertEquals(setprio(p[1], NUM_PRIORITY), SYSERR);
+
+  // Highest level is served first, FIFO within a level
+  assertEquals(next(), p[1]);
+  assertEquals(next(), p[2]);
+  ready(p[1]);
+  ready(p[2]);
+  assertEquals(next(), p[1]);
+  assertEquals(next(), p[2]);
+  assertEquals(next(), p[0]);
+  assertEquals(next(), NULL);
+
+  for (i = 0; i < 3; i++) {
+    cleanup(p[i]);
+  }
+
+  create(test_sysprio, TEST_STACK_SIZE, NULL);
+  dispatch();
 }
 
 static volatile int procMaxed = FALSE;
@@ -446,22 +723,25 @@ void spawner(void) {
 
 /* Spawn a tree of process until out of memory */
 void testProcessManagement(void) {
-  void *ptr;
-  int i, pid, maxNumStack;
-
-  // Allocate all memory before hole
-  ptr = testKmallocHelper(freeList->size);
-  
-  // Free list should be everything after HOLE
-  assertEquals((unsigned int) freeList, HOLEEND);
-  maxNumStack = (FREEMEM_END - HOLEEND) / (TEST_STACK_SIZE + SAFETY_MARGIN + sizeof(contextFrame));
+  int i, pid, firstPid, maxNumStack, order;
+  unsigned int pcb_index;
+  memInfo before, after;
+
+  // Every stack takes a free block of this order,
+  // the pages past its end are too few to hold another one
+  order = bit_scan_reverse((TEST_STACK_SIZE + SAFETY_MARGIN + sizeof(contextFrame) - 1) / NBPG) + 1;
+  mem_report(&before);
+  maxNumStack = 0;
+  for (i = order; i < BUDDY_NUM_ORDER; i++) {
+    maxNumStack += before.freeBlocks[i] << (i - order);
+  }
 
   // Init test variable
   numProc = 0;
 
   // Create a list of process that will take up all memory
-  pid = create(spawner, TEST_STACK_SIZE, NULL);
-  assertEquals(pid, 1);
+  pid = firstPid = create(spawner, TEST_STACK_SIZE, NULL);
+  assert(pid != SYSERR);
   
   // Run dispatch, but this dispatch will return when root process calls sysstop
   dispatch();
@@ -469,17 +749,22 @@ void testProcessManagement(void) {
   // Assert that maxNumStack processes were created
   assertEquals(numProc, maxNumStack);
 
-  // Assert the next process will get PID equals to numProc, shows PID reuse interval is large
-  printTree(pidMap, 0);
-
   // Assert all PCB have stopped state
   for (i = 0; i < MAX_NUM_PROCESS; i++) {
     assertEquals(pcbTable[i].state, STOPPED);
   }
 
+  // All stacks are merged back into the same blocks
+  mem_report(&after);
+  assertEquals(after.freePages, before.freePages);
+  assertEquals(after.largestFree, before.largestFree);
+
   // Rerun
   pid = create(spawner, TEST_STACK_SIZE, NULL);
-  assertEquals(pid, numProc + 1);
+
+  // Assert the reused PCB got a new PID and the old one is stale
+  assert(pid != firstPid);
+  assertEquals(pidMapLookup(firstPid, &pcb_index), 0);
   numProc = 0;
   procMaxed = FALSE;
   dispatch();
@@ -487,82 +772,234 @@ void testProcessManagement(void) {
   for (i = 0; i < MAX_NUM_PROCESS; i++) {
     assertEquals(pcbTable[i].state, STOPPED);
   }
+}
 
-  // Clean up
-  nextPid = 0;
-  kfree(ptr);
+void testPidMap(void) {
+  unsigned int value, oldPid;
+  int pid;
+  pcb *p;
+
+  // PID 0 and PIDs of unused PCBs do not map to anything
+  assertEquals(pidMapLookup(0, &value), 0);
+  assertEquals(pidMapLookup(0xdeadbeef, &value), 0);
+
+  pid = create(testContextSwitchChild, 0x2000, NULL);
+  assertEquals(pidMapLookup(pid, &value), OK);
+  assertEquals(value, PID_INDEX(pid));
+  p = pcbTable + value;
+  assertEquals(next(), p);
+  cleanup(p);
+  assertEquals(pidMapLookup(pid, &value), 0);
+
+  // Reusing the PCB gives a new PID, the old one stays stale
+  oldPid = pid;
+  pid = create(testContextSwitchChild, 0x2000, NULL);
+  assertEquals(PID_INDEX(pid), PID_INDEX(oldPid));
+  assert(pid != oldPid);
+  assertEquals(pidMapLookup(oldPid, &value), 0);
+  assertEquals(pidMapLookup(pid, &value), OK);
+  assertEquals(value, PID_INDEX(pid));
+  assertEquals(next(), p);
+  cleanup(p);
+
+  // Generation wraps around to 1 before the slot flag, never producing
+  // PID 0 or a PID sysprocstat would take for a slot
+  p->pid = ((PROC_SLOT_FLAG - 1) & (~0u << PID_INDEX_BITS)) | PID_INDEX(oldPid);
+  pid = create(testContextSwitchChild, 0x2000, NULL);
+  assertEquals(pid, ((1 << PID_INDEX_BITS) | PID_INDEX(oldPid)));
+  assertEquals(next(), p);
+  cleanup(p);
 }
 
-int sprintTreePreorder(treeNode* node, char *buffer) {
-  if (!node) return 0;
-  int written = 0;
-  written = sprintf(buffer, "%u ", node->pid);
-  written += sprintTreePreorder(node->right, buffer+written);
-  written += sprintTreePreorder(node->left, buffer+written);
-  return written;
+/*
+ * Reference AVL tree PID map the PID table replaced, kept for benchmarking
+ */
+typedef struct _treeNode {
+  unsigned int pid;
+  unsigned int pcbIndex;
+  struct _treeNode *left, *right;
+  unsigned int height;
+} treeNode;
+
+static int avlHeight(treeNode *node) {
+  return node ? node->height : 0;
 }
 
-void testPidMap(void) {
-  // char buffer[0x1000];
-  // int written;
-  unsigned int value;
-
-  pidMapInsert(3, 3);
-  pidMapInsert(0, 0);
-  pidMapInsert(2, 2);
-  pidMapInsert(4, 4);
-  pidMapInsert(1, 1);
-  pidMapInsert(5, 5);
-  pidMapInsert(6, 6);
-  pidMapInsert(7, 7);
-  pidMapInsert(8, 8);
-  pidMapInsert(9, 9);
-  pidMapInsert(10, 10);
-  pidMapInsert(11, 11);
-  pidMapInsert(12, 12);
-  pidMapInsert(13, 13);
-  pidMapInsert(14, 14);
-  pidMapInsert(15, 15);
-  // printTree(pidMap, 0);
-  // kprintf("height = %u\n", pidMap->height);
-  assert(pidMap->height <= 5);
-
-  pidMapDelete(0);
-  pidMapDelete(1);
-  pidMapDelete(2);
-  pidMapDelete(3);
-  pidMapDelete(4);
-  pidMapDelete(5);
-  pidMapDelete(6);
-  pidMapDelete(7);
-  assert(pidMap->height <= 4);
-  assertEquals(pidMapLookup(8, &value), OK);
-  assertEquals(value, 8);
-  assertEquals(pidMapLookup(10, &value), OK);
-  assertEquals(value, 10);
-  assertEquals(pidMapLookup(12, &value), OK);
-  assertEquals(value, 12);
-  assertEquals(pidMapLookup(14, &value), OK);
-  assertEquals(value, 14);
-  assertEquals(pidMapLookup(7, &value), 0);
-  assertEquals(pidMapLookup(5, &value), 0);
-  assertEquals(pidMapLookup(3, &value), 0);
-  assertEquals(pidMapLookup(1, &value), 0);
-
-
-  pidMapDelete(7);
-  pidMapDelete(7);
-  pidMapDelete(7);
-
-  pidMapDelete(8);
-  pidMapDelete(9);
-  pidMapDelete(10);
-  pidMapDelete(11);
-  pidMapDelete(12);
-  pidMapDelete(13);
-  pidMapDelete(14);
-  pidMapDelete(15);
-  assertEquals(pidMap, NULL);
+static void avlUpdateHeight(treeNode *node) {
+  node->height = max(avlHeight(node->left), avlHeight(node->right)) + 1;
+}
+
+static treeNode* avlRotateLeft(treeNode* node) {
+  treeNode* ret = node->right;
+  node->right = ret->left;
+  ret->left = node;
+  avlUpdateHeight(node);
+  avlUpdateHeight(ret);
+  return ret;
+}
+
+static treeNode* avlRotateRight(treeNode* node) {
+  treeNode* ret = node->left;
+  node->left = ret->right;
+  ret->right = node;
+  avlUpdateHeight(node);
+  avlUpdateHeight(ret);
+  return ret;
+}
+
+static treeNode* avlInsert(treeNode* node, unsigned int pid, unsigned int pcbIndex) {
+  if (!node) {
+    node = (treeNode*) kmalloc(sizeof(treeNode));
+    assert(node);
+    node->pid = pid;
+    node->pcbIndex = pcbIndex;
+    node->left = node->right = NULL;
+    node->height = 1;
+    return node;
+  } else if (pid > node->pid) {
+    node->right = avlInsert(node->right, pid, pcbIndex);
+  } else if (pid < node->pid) {
+    node->left = avlInsert(node->left, pid, pcbIndex);
+  } else {
+    node->pcbIndex = pcbIndex;
+    return node;
+  }
+  avlUpdateHeight(node);
+
+  if (avlHeight(node->left) - avlHeight(node->right) > 1) {
+    if (avlHeight(node->left->left) < avlHeight(node->left->right)) {
+      node->left = avlRotateLeft(node->left);
+    }
+    node = avlRotateRight(node);
+  } else if (avlHeight(node->right) - avlHeight(node->left) > 1) {
+    if (avlHeight(node->right->right) < avlHeight(node->right->left)) {
+      node->right = avlRotateRight(node->right);
+    }
+    node = avlRotateLeft(node);
+  }
+  return node;
+}
+
+static int avlLookup(treeNode* node, unsigned int pid, unsigned int *pcbIndex) {
+  if (!node) {
+    return 0;
+  } else if (node->pid == pid) {
+    *pcbIndex = node->pcbIndex;
+    return OK;
+  } else if (pid > node->pid) {
+    return avlLookup(node->right, pid, pcbIndex);
+  } else {
+    return avlLookup(node->left, pid, pcbIndex);
+  }
+}
+
+static void avlFree(treeNode* node) {
+  if (node) {
+    avlFree(node->left);
+    avlFree(node->right);
+    kfree(node);
+  }
+}
+
+#define BENCH_NUM_PROC 200
+#define BENCH_ROUNDS 20
+/*
+ * Compares lookup cost of the AVL tree and the PID table with
+ * BENCH_NUM_PROC live processes
+ */
+void benchPidMap(void) {
+  unsigned int pids[BENCH_NUM_PROC], i, j, value;
+  unsigned long start, avlCycles, tableCycles;
+  treeNode *tree;
+  pcb *p;
+
+  tree = NULL;
+  for (i = 0; i < BENCH_NUM_PROC; i++) {
+    pids[i] = create(testContextSwitchChild, 0x200, NULL);
+    assert(pids[i] != SYSERR);
+    tree = avlInsert(tree, pids[i], PID_INDEX(pids[i]));
+  }
+
+  start = (unsigned long) read_tsc();
+  for (j = 0; j < BENCH_ROUNDS; j++) {
+    for (i = 0; i < BENCH_NUM_PROC; i++) {
+      avlLookup(tree, pids[i], &value);
+    }
+  }
+  avlCycles = (unsigned long) read_tsc() - start;
+
+  start = (unsigned long) read_tsc();
+  for (j = 0; j < BENCH_ROUNDS; j++) {
+    for (i = 0; i < BENCH_NUM_PROC; i++) {
+      pidMapLookup(pids[i], &value);
+    }
+  }
+  tableCycles = (unsigned long) read_tsc() - start;
+
+  kprintf("PID lookup with %u processes: AVL tree %u cycles, PID table %u cycles\n",
+      BENCH_NUM_PROC, avlCycles / (BENCH_NUM_PROC * BENCH_ROUNDS),
+      tableCycles / (BENCH_NUM_PROC * BENCH_ROUNDS));
+
+  avlFree(tree);
+  while ((p = next())) {
+    cleanup(p);
+  }
+}
+
+#define CHURN_BG_PROC (MAX_NUM_PROCESS - 8)
+#define CHURN_ROUNDS 4096
+/*
+ * Creates and stops thousands of processes with the PCB table nearly full,
+ * measuring create() latency, then checks create() fails on a full table
+ */
+void testPcbChurn(void) {
+  unsigned int i, pcb_index;
+  unsigned long start, cycles, minCycles, maxCycles, totalCycles;
+  int pid;
+  pcb *p;
+
+  // Fill most of the table with processes that sit on a lower level
+  for (i = 0; i < CHURN_BG_PROC; i++) {
+    pid = create(testContextSwitchChild, 0x100, NULL);
+    assert(pid != SYSERR);
+    pidMapLookup(pid, &pcb_index);
+    setprio(pcbTable + pcb_index, IDLE_PRIORITY);
+  }
+
+  minCycles = ~0;
+  maxCycles = totalCycles = 0;
+  for (i = 0; i < CHURN_ROUNDS; i++) {
+    start = (unsigned long) read_tsc();
+    pid = create(testContextSwitchChild, 0x100, NULL);
+    cycles = (unsigned long) read_tsc() - start;
+    assert(pid != SYSERR);
+
+    minCycles = min(minCycles, cycles);
+    maxCycles = max(maxCycles, cycles);
+    totalCycles += cycles;
+
+    p = next();
+    assertEquals(p->pid, pid);
+    cleanup(p);
+  }
+  kprintf("create() with %u processes: min %u, avg %u, max %u cycles\n",
+      CHURN_BG_PROC, minCycles, totalCycles / CHURN_ROUNDS, maxCycles);
+
+  // Fill the table, the next create fails
+  for (i = CHURN_BG_PROC; i < MAX_NUM_PROCESS; i++) {
+    assert(create(testContextSwitchChild, 0x100, NULL) != SYSERR);
+  }
+  assertEquals(free_pcbs, NULL);
+  assertEquals(create(testContextSwitchChild, 0x100, NULL), SYSERR);
+
+  // Every PCB goes back on the free list
+  while ((p = next())) {
+    cleanup(p);
+  }
+  for (i = 0, p = free_pcbs; p; p = p->next, i++) {
+    assertEquals(p->state, STOPPED);
+  }
+  assertEquals(i, MAX_NUM_PROCESS);
 }
 
 void test_send_recv_fail(void) {
@@ -773,6 +1210,101 @@ void sender_4(void) {
   }
 }
 
+void mbox_consumer(void) {
+  unsigned int from_pid, word, i;
+
+  for (i = 0; i <= MBOX_SLOTS; i++) {
+    from_pid = sysgetppid();
+    assertEquals(sysrecv(&from_pid, &word, sizeof(int)), sizeof(int));
+    assertEquals(word, i);
+  }
+  test_print("Process %03u received %u messages in order\n", sysgetpid(), i);
+}
+
+void mbox_producer(void) {
+  unsigned int pid, word;
+
+  // The consumer has not run yet, messages go to its mailbox
+  pid = syscreate(mbox_consumer, TEST_STACK_SIZE);
+  for (word = 0; word < MBOX_SLOTS; word++) {
+    assertEquals(sysasend(pid, &word, sizeof(int), MSG_NONBLOCK), sizeof(int));
+  }
+  assertEquals(sysasend(pid, &word, sizeof(int), MSG_NONBLOCK), BLOCKERR);
+  assertEquals(sysasend(pid, &word, MBOX_MSG_SIZE + 1, 0), SYS_SR_ERR);
+  test_print("Process %03u filled the mailbox of %03u\n", sysgetpid(), pid);
+
+  // Blocks until the consumer drained the mailbox
+  assertEquals(sysasend(pid, &word, sizeof(int), 0), sizeof(int));
+}
+
+#define LEND_SIZE 0x2000
+
+void borrower(void) {
+  unsigned int from_pid;
+  char *buf;
+
+  from_pid = sysgetppid();
+  assertEquals(sysrecvlent(&from_pid, (void**) &buf), LEND_SIZE);
+  assertEquals(buf[0], 'L');
+  assertEquals(buf[LEND_SIZE - 1], 'E');
+  test_print("Process %03u borrowed buffer 0x%x\n", sysgetpid(), buf);
+
+  // A copied message also arrives in a buffer of our own
+  assertEquals(sysrecvlent(&from_pid, (void**) &buf), LEND_SIZE / 2);
+  assertEquals(buf[0], 'L');
+  assertEquals(sysbuffree(buf), OK);
+  // The lent buffer is not freed, cleanup() frees it
+}
+
+void lender(void) {
+  unsigned int pid;
+  char *buf;
+
+  pid = syscreate(borrower, TEST_STACK_SIZE);
+  buf = sysbufalloc(LEND_SIZE);
+  assert(buf);
+  buf[0] = 'L';
+  buf[LEND_SIZE - 1] = 'E';
+  assertEquals(syslend(pid, buf, LEND_SIZE + 1), SYS_SR_ERR);
+  assertEquals(syslend(pid, buf + 16, 16), SYS_SR_ERR);
+  assertEquals(syslend(pid, buf, LEND_SIZE), LEND_SIZE);
+  // The buffer now belongs to the receiver
+  assertEquals(sysbuffree(buf), SYSERR);
+  assertEquals(syssend(pid, buf, LEND_SIZE / 2), LEND_SIZE / 2);
+}
+
+#define VEC_HEADER 0xfeed
+
+void vec_receiver(void) {
+  unsigned int from_pid, header;
+  char payload[RECV_BUFFER_SIZE];
+  iovec iov[2];
+
+  from_pid = sysgetppid();
+  iov[0].base = &header;
+  iov[0].len = sizeof(header);
+  iov[1].base = payload;
+  iov[1].len = sizeof(payload);
+  assertEquals(sysrecvv(&from_pid, iov, MAX_IOV + 1), SYS_SR_ERR);
+  assertEquals(sysrecvv(&from_pid, iov, 2), sizeof(header) + sizeof(TEST_MSG));
+  assertEquals(header, VEC_HEADER);
+  assert(strcmp(payload, TEST_MSG) == 0);
+  test_print("Process %03u received header 0x%x and payload\n", sysgetpid(), header);
+}
+
+void vec_sender(void) {
+  unsigned int pid, header;
+  iovec iov[2];
+
+  pid = syscreate(vec_receiver, TEST_STACK_SIZE);
+  header = VEC_HEADER;
+  iov[0].base = &header;
+  iov[0].len = sizeof(header);
+  iov[1].base = TEST_MSG;
+  iov[1].len = sizeof(TEST_MSG);
+  assertEquals(syssendv(pid, iov, 2), sizeof(header) + sizeof(TEST_MSG));
+}
+
 void testSendReceive(void) {
   // Test bad syssend sysrecv
   test_print("Tests for send and receive failures:\n");
@@ -799,62 +1331,373 @@ void testSendReceive(void) {
   create(sender_4, TEST_STACK_SIZE, NULL);
   dispatch();
 
-  // cleanup
-  nextPid = 0;
+  // Test asynchronous send to a mailbox
+  test_print("Test for sending to a mailbox:\n");
+  create(mbox_producer, TEST_STACK_SIZE, NULL);
+  dispatch();
+
+  // Test gathering and scattering a message
+  test_print("Test for vectored send and receive:\n");
+  create(vec_sender, TEST_STACK_SIZE, NULL);
+  dispatch();
+
+  // Test lending a buffer
+  test_print("Test for lending a buffer:\n");
+  create(lender, TEST_STACK_SIZE, NULL);
+  dispatch();
+
 }
 
-void testSleepList(void) {
-  pcb process[NUM_SLEEP_P], *p;
+#define RPC_ROUNDS 1000
+#define RPC_STOP 0xffffffff
+static Bool rpcReply;
+
+void rpc_server(void) {
+  unsigned int from_pid, word, answer;
+
+  for (;;) {
+    from_pid = 0;
+    sysrecv(&from_pid, &word, sizeof(int));
+    if (word == RPC_STOP) {
+      return;
+    }
+    answer = word + 1;
+    if (rpcReply) {
+      assertEquals(sysreply(from_pid, &answer, sizeof(int)), sizeof(int));
+    } else {
+      syssend(from_pid, &answer, sizeof(int));
+    }
+  }
+}
+
+void rpc_client(void) {
+  unsigned int server, from_pid, word, answer;
+  unsigned long start, rpcCycles, pairCycles;
+
+  server = syscreate(rpc_server, TEST_STACK_SIZE);
+  // Nobody is waiting for a reply yet
+  assertEquals(sysreply(server, &word, sizeof(int)), SYS_SR_NO_PID);
+
+  rpcReply = TRUE;
+  start = (unsigned long) read_tsc();
+  for (word = 0; word < RPC_ROUNDS; word++) {
+    assertEquals(syssendrecv(server, &word, sizeof(int), &answer, sizeof(int)), sizeof(int));
+    assertEquals(answer, word + 1);
+  }
+  rpcCycles = (unsigned long) read_tsc() - start;
+
+  rpcReply = FALSE;
+  start = (unsigned long) read_tsc();
+  for (word = 0; word < RPC_ROUNDS; word++) {
+    syssend(server, &word, sizeof(int));
+    from_pid = server;
+    sysrecv(&from_pid, &answer, sizeof(int));
+    assertEquals(answer, word + 1);
+  }
+  pairCycles = (unsigned long) read_tsc() - start;
+
+  word = RPC_STOP;
+  syssend(server, &word, sizeof(int));
+  kprintf("RPC round trip: syssendrecv and sysreply %u cycles, syssend and sysrecv pairs %u cycles\n",
+      rpcCycles / RPC_ROUNDS, pairCycles / RPC_ROUNDS);
+}
+
+/*
+ * Ping-pong between a client and a server, once with syssendrecv and
+ * sysreply and once with a syssend and sysrecv pair on each side
+ */
+void benchRpc(void) {
+  create(rpc_client, TEST_STACK_SIZE, NULL);
+  dispatch();
+}
+
+#define SYSCALL_ROUNDS 1000
+static Bool benchFast;
+
+/* Sends through the fast or the generic syscall path */
+static int bench_send(unsigned int dest_pid, void *buf, int len) {
+  return benchFast ? syssend(dest_pid, buf, len) : syscall(SEND, dest_pid, buf, len);
+}
+
+static int bench_recv(unsigned int *from_pid, void *buf, int len) {
+  return benchFast ? sysrecv(from_pid, buf, len) : syscall(RECV, from_pid, buf, len);
+}
+
+void echo_server(void) {
+  unsigned int from_pid, word;
+
+  for (;;) {
+    from_pid = 0;
+    bench_recv(&from_pid, &word, sizeof(int));
+    if (word == RPC_STOP) {
+      return;
+    }
+    bench_send(from_pid, &word, sizeof(int));
+  }
+}
+
+void syscall_client(void) {
+  unsigned int server, from_pid, word, answer, i, pid, me;
+  unsigned long start, cycles[2][3];
+  int fast;
+
+  me = sysgetpid();
+  assertEquals(syscall(GET_PID), me);
+  server = syscreate(echo_server, TEST_STACK_SIZE);
+  for (fast = 0; fast < 2; fast++) {
+    benchFast = fast;
+
+    start = (unsigned long) read_tsc();
+    for (i = 0; i < SYSCALL_ROUNDS; i++) {
+      pid = fast ? sysgetpid() : syscall(GET_PID);
+    }
+    cycles[fast][0] = (unsigned long) read_tsc() - start;
+    assertEquals(pid, me);
+
+    start = (unsigned long) read_tsc();
+    for (i = 0; i < SYSCALL_ROUNDS; i++) {
+      if (fast) {
+        sysyield();
+      } else {
+        syscall(YIELD);
+      }
+    }
+    cycles[fast][1] = (unsigned long) read_tsc() - start;
+
+    start = (unsigned long) read_tsc();
+    for (word = 0; word < SYSCALL_ROUNDS; word++) {
+      bench_send(server, &word, sizeof(int));
+      from_pid = server;
+      assertEquals(bench_recv(&from_pid, &answer, sizeof(int)), sizeof(int));
+      assertEquals(answer, word);
+    }
+    cycles[fast][2] = (unsigned long) read_tsc() - start;
+  }
+
+  word = RPC_STOP;
+  syssend(server, &word, sizeof(int));
+  kprintf("Syscall latency, generic -> fast path: GET_PID %u -> %u, YIELD %u -> %u,"
+      " SEND and RECV round trip %u -> %u cycles\n",
+      cycles[0][0] / SYSCALL_ROUNDS, cycles[1][0] / SYSCALL_ROUNDS,
+      cycles[0][1] / SYSCALL_ROUNDS, cycles[1][1] / SYSCALL_ROUNDS,
+      cycles[0][2] / SYSCALL_ROUNDS, cycles[1][2] / SYSCALL_ROUNDS);
+}
+
+/*
+ * Times the hot syscalls through the generic path, arguments on the user
+ * stack, and through SYSCALL_FAST, arguments in registers
+ */
+void benchSyscall(void) {
+  create(syscall_client, TEST_STACK_SIZE, NULL);
+  dispatch();
+}
+
+#define BATCH_ROUNDS 100
+#define BATCH_SIZE 16
+
+void batch_client(void) {
+  batchEntry entries[BATCH_SIZE];
+  unsigned long start, callCycles, batchCycles;
+  memInfo info;
+  int i, j;
+
+  assertEquals(sysbatch(NULL, 1), -1);
+  assertEquals(sysbatch(entries, MAX_BATCH + 1), -1);
+  assertEquals(sysbatch(entries, 0), 0);
+
+  // Results in order, requests that can not run in a batch fail alone
+  entries[0].request = GET_PID;
+  entries[1].request = SET_PRIO;
+  entries[1].args[0] = 0;
+  entries[1].args[1] = 1;
+  entries[2].request = GET_PRIO;
+  entries[2].args[0] = 0;
+  entries[3].request = SLEEP;
+  entries[3].args[0] = 1000;
+  entries[4].request = MEM_INFO;
+  entries[4].args[0] = (unsigned int) &info;
+  entries[5].request = SET_PRIO;
+  entries[5].args[0] = 0;
+  entries[5].args[1] = DEFAULT_PRIORITY;
+  assertEquals(sysbatch(entries, 6), 6);
+  assertEquals(entries[0].result, sysgetpid());
+  assert(entries[1].result >= 0);
+  assertEquals(entries[2].result, 1);
+  assertEquals(entries[3].result, SYSERR);
+  assertEquals(entries[4].result, OK);
+  assertEquals(entries[5].result, 1);
+
+  for (i = 0; i < BATCH_SIZE; i++) {
+    entries[i].request = GET_PRIO;
+    entries[i].args[0] = 0;
+  }
+  start = (unsigned long) read_tsc();
+  for (j = 0; j < BATCH_ROUNDS; j++) {
+    for (i = 0; i < BATCH_SIZE; i++) {
+      sysgetprio(0);
+    }
+  }
+  callCycles = (unsigned long) read_tsc() - start;
+  start = (unsigned long) read_tsc();
+  for (j = 0; j < BATCH_ROUNDS; j++) {
+    sysbatch(entries, BATCH_SIZE);
+  }
+  batchCycles = (unsigned long) read_tsc() - start;
+  // No time slice ends inside a batch
+  for (i = 0; i < BATCH_SIZE; i++) {
+    assertEquals(entries[i].result, entries[0].result);
+  }
+  kprintf("Syscall batch: %u GET_PRIO calls %u cycles, one sysbatch %u cycles\n",
+      BATCH_SIZE, callCycles / BATCH_ROUNDS, batchCycles / BATCH_ROUNDS);
+}
+
+/*
+ * Runs a batch of mixed requests and times a batch against single calls
+ */
+void testBatch(void) {
+  create(batch_client, TEST_STACK_SIZE, NULL);
+  dispatch();
+}
+
+#define STAT_ROUNDS 50
+
+static procStat peerStat;
+
+void stat_peer(void) {
   int i;
+
+  // Every call goes to the back of the ready queue behind the client,
+  // a voluntary switch
+  for (i = 0; i < STAT_ROUNDS; i++) {
+    sysgetprio(0);
+  }
+  sysprocstat(0, &peerStat);
+}
+
+void stat_client(void) {
+  procStat stat;
+  unsigned int me, peer;
+  int i;
+
+  me = sysgetpid();
+  assertEquals(sysprocstat(0, NULL), SYSERR);
+  assertEquals(sysprocstat(me + (1 << PID_INDEX_BITS), &stat), SYSERR);
+  assertEquals(sysprocstat(PROC_SLOT(MAX_NUM_PROCESS - 1), &stat), SYSERR);
+  assertEquals(sysprocstat(PROC_SLOT(MAX_NUM_PROCESS), &stat), SYSERR);
+  // The first process in slot 0 has generation 1, its PID is not a slot
+  assertEquals(me, 1 << PID_INDEX_BITS);
+  assertEquals(sysprocstat(me, &stat), OK);
+  assertEquals(stat.pid, me);
+  assertEquals(sysprocstat(PROC_SLOT(0), &stat), OK);
+  assertEquals(stat.pid, me);
+
+  peer = syscreate(stat_peer, TEST_STACK_SIZE);
+  for (i = 0; i < STAT_ROUNDS; i++) {
+    sysyield();
+  }
+  assertEquals(sysprocstat(peer, &stat), OK);
+  assertEquals(stat.pid, peer);
+  assertEquals(stat.parentPid, me);
+  assertEquals(stat.state, READY);
+  // Let the peer finish
+  sysyield();
+  assertEquals(sysprocstat(peer, &stat), SYSERR);
+
+  // Switched away from on each sysgetprio, no time slice ended
+  assertEquals(peerStat.pid, peer);
+  assert(peerStat.voluntary >= STAT_ROUNDS);
+  assertEquals(peerStat.involuntary, 0);
+  assert(peerStat.syscalls > STAT_ROUNDS);
+  assert(peerStat.cycles);
+  assert(peerStat.wait_cycles);
+
+  assertEquals(sysprocstat(PROC_SLOT(PID_INDEX(me)), &stat), OK);
+  assertEquals(stat.pid, me);
+  assertEquals(stat.state, RUNNING);
+  assert(stat.voluntary >= STAT_ROUNDS);
+  assert(stat.syscalls > STAT_ROUNDS);
+  assert(stat.cycles);
+  assert(stat.wait_cycles);
+  // The timer is not enabled yet
+  assertEquals(stat.ticks, 0);
+}
+
+/*
+ * Checks the switch, syscall and cycle counts of sysprocstat
+ */
+void testProcStat(void) {
+  // Start from a fresh table so the client gets slot 0 at generation 1
+  init_pcb_table();
+  create(stat_client, TEST_STACK_SIZE, NULL);
+  dispatch();
+}
+
+static unsigned int timerFired;
+static void countTimer(void *arg) {
+  timerFired = *((unsigned int*) arg);
+}
+
+void testSleepList(void) {
+  pcb process[NUM_SLEEP_P];
+  ktimer timer;
+  unsigned int i, ticks;
   
   for (i = 0; i < NUM_SLEEP_P; i++) {
     process[i].pid = i+1;
+    process[i].priority = DEFAULT_PRIORITY;
+    process[i].timer.prev = process[i].timer.next = NULL;
   }
 
-  sleep(process, 70);
-  sleep(process+1, 20);
-  sleep(process+5, 19);
-  sleep(process+2, 40);
-  sleep(process+3, 1);
-  sleep(process+4, 119);
-  // traverseSleepList();
-
-  p = sleep_list;
-  assertEquals(p, process+3);
-  assertEquals(p->delta,1);
-  p = p->next;
-  assertEquals(p, process+1);
-  assertEquals(p->delta,1);
-  p = p->next;
-  assertEquals(p, process+5);
-  assertEquals(p->delta,0);
-  p = p->next;
-  assertEquals(p, process+2);
-  assertEquals(p->delta,2);
-  p = p->next;
-  assertEquals(p, process);
-  assertEquals(p->delta,3);
-  p = p->next;
-  assertEquals(p, process+4);
-  assertEquals(p->delta,5);
-  p = p->next;
-  assertEquals(p, NULL);
+  // Tenths of a tick, rounded up
+  usleep(process, 70 * TIMER_RES_US / 10);
+  usleep(process+1, 20 * TIMER_RES_US / 10);
+  usleep(process+5, 19 * TIMER_RES_US / 10);
+  usleep(process+2, 40 * TIMER_RES_US / 10);
+  usleep(process+3, 1 * TIMER_RES_US / 10);
+  usleep(process+4, 119 * TIMER_RES_US / 10);
+  for (i = 0; i < NUM_SLEEP_P; i++) {
+    assertEquals(process[i].state, SLEEPING);
+  }
+  assert(timer_remaining(&process[4].timer) == 12);
 
+  // Processes wake up on their tick, in the order they went to sleep
   tick();
-
-  p = sleep_list;
-  assertEquals(p, process+1);
-  assertEquals(p->delta,1);
-
+  assertEquals(next(), process+3);
+  assertEquals(next(), NULL);
+  tick();
+  assertEquals(next(), process+1);
+  assertEquals(next(), process+5);
+  assertEquals(next(), NULL);
   tick();
+  tick();
+  assertEquals(next(), process+2);
+  assertEquals(next(), NULL);
+
+  // A cancelled sleeper is not woken up
+  assert(timer_cancel(&process[0].timer));
+  assert(!timer_cancel(&process[0].timer));
+  for (i = 0; i < 8; i++) {
+    tick();
+  }
+  assertEquals(next(), process+4);
+  assertEquals(next(), NULL);
 
-  p = sleep_list;
-  assertEquals(p, process+2);
-  assertEquals(p->delta,2);
+  // Long timers cascade down the levels and still fire on their tick
+  timer.prev = timer.next = NULL;
+  for (ticks = TW_SIZE - 1; ticks < TW_SIZE * TW_SIZE * 2; ticks = ticks * 3 + 1) {
+    timerFired = 0;
+    timer_set(&timer, ticks, countTimer, &ticks);
+    for (i = 1; i < ticks; i++) {
+      tick();
+    }
+    assertEquals(timerFired, 0);
+    tick();
+    assertEquals(timerFired, ticks);
+  }
 
   // clean up
-  sleep_list = NULL;
-  ready_queue = NULL;
+  init_timers();
+  init_ready_queue();
   assert(next() == NULL);
 }
 
@@ -876,6 +1719,7 @@ void preemptive(void) {
 void gets_preempted(void) {
   unsigned int pid = sysgetpid();
   char str[TEST_STR_SIZE];
+  procStat stat;
 
   syscreate(preemptive, TEST_STACK_SIZE);
 
@@ -886,6 +1730,8 @@ void gets_preempted(void) {
   sprintf(str, "Process %03u entering loop with condition (global variable == False)\n", pid);
 
   while (!preempted);
+  assertEquals(sysprocstat(0, &stat), OK);
+  assert(stat.involuntary >= 1);
   
   sprintf(str, "Process %03u was preempted, exiting\n", pid);
 }
@@ -915,6 +1761,123 @@ void sleeping(void) {
   awake = TRUE;  
 }
 
+void timed_receiver(void) {
+  unsigned int from_pid, word, pcb_index;
+
+  from_pid = sysgetppid();
+  pidMapLookup(from_pid, &pcb_index);
+  assertEquals(sysrecvtimed(&from_pid, &word, sizeof(int), 3 * TIME_SLICE_MS), TIMEOUT);
+  assertEquals(pcbTable[pcb_index].receivers.head, NULL);
+  test_print("Process %03u timed out receiving\n", sysgetpid());
+
+  assertEquals(sysrecv(&from_pid, &word, sizeof(int)), sizeof(int));
+  assertEquals(word, TEST_IRET_VALUE);
+}
+
+void timed_sleeper(void) {
+  syssleep(20 * TIME_SLICE_MS);
+}
+
+static unsigned int wakeOrder[2], numWoken;
+
+void short_sleeper(void) {
+  assertEquals(sysusleep(2 * TIMER_RES_US), 0);
+  wakeOrder[numWoken++] = sysgetpid();
+}
+
+void usleeping(void) {
+  unsigned int pid;
+
+  assertEquals(sysusleep(0), 0);
+  numWoken = 0;
+  pid = syscreate(short_sleeper, TEST_STACK_SIZE);
+  assertEquals(sysusleep(5 * TIMER_RES_US), 0);
+  wakeOrder[numWoken++] = sysgetpid();
+  assertEquals(numWoken, 2);
+  assertEquals(wakeOrder[0], pid);
+  awake = TRUE;
+}
+
+void timed_messages(void) {
+  unsigned int pid, from_pid, word, pcb_index;
+
+  // Nobody is sending, a 0 ms timeout returns right away
+  from_pid = 0;
+  assertEquals(sysrecvtimed(&from_pid, &word, sizeof(int), 0), TIMEOUT);
+
+  // Receiver times out, then takes a plain send
+  pid = syscreate(timed_receiver, TEST_STACK_SIZE);
+  syssleep(10 * TIME_SLICE_MS);
+  word = TEST_IRET_VALUE;
+  assertEquals(syssendtimed(pid, &word, sizeof(int), 10 * TIME_SLICE_MS), sizeof(int));
+
+  // Sender times out on a sleeping process
+  pid = syscreate(timed_sleeper, TEST_STACK_SIZE);
+  pidMapLookup(pid, &pcb_index);
+  assertEquals(syssendtimed(pid, &word, sizeof(int), 3 * TIME_SLICE_MS), TIMEOUT);
+  assertEquals(pcbTable[pcb_index].senders.head, NULL);
+  test_print("Process %03u timed out sending\n", sysgetpid());
+  awake = TRUE;
+}
+
+#if SCHEDULER == SCHED_MLFQ
+static volatile Bool demoted;
+void mlfq_hog(void) {
+  // Spin without yielding until the scheduler demotes this process
+  while (sysgetprio(0) == DEFAULT_PRIORITY);
+  demoted = TRUE;
+}
+
+void mlfq_sleeper(void) {
+  int i;
+
+  demoted = FALSE;
+  syscreate(mlfq_hog, TEST_STACK_SIZE);
+  for (i = 0; i < 10 && !demoted; i++) {
+    syssleep(TIME_SLICE_MS);
+    assertEquals(sysgetprio(0), DEFAULT_PRIORITY);
+  }
+  assertEquals(demoted, TRUE);
+  test_print("CPU bound process was demoted, sleeping process was not\n");
+}
+#endif
+
+#define PROF_TEST_TICKS 5
+#define PROF_SPIN 100000
+
+extern int etext;
+static int profSamples;
+
+void prof_spin(void) {
+  procStat stat;
+  volatile int i;
+
+  assertEquals(sysprofile(PROF_START), 0);
+  do {
+    for (i = 0; i < PROF_SPIN; i++);
+    sysprocstat(0, &stat);
+  } while (stat.ticks < PROF_TEST_TICKS);
+  profSamples = sysprofile(PROF_STOP);
+  assertEquals(sysprofile(-1), SYSERR);
+}
+
+/*
+ * Samples a process spinning alone for a few time slices,
+ * every sample lands in the text of the image
+ */
+void testProfiler(void) {
+  unsigned int addr, sum;
+
+  create(prof_spin, TEST_STACK_SIZE, NULL);
+  dispatch();
+  assert(profSamples > 0);
+  sum = 0;
+  for (addr = 0; addr < (unsigned int) &etext; addr += 1 << PROF_SHIFT) {
+    sum += prof_hits(addr);
+  }
+  assertEquals(sum, profSamples);
+}
+
 void testTimeSharing(void) {
   unsigned int pid, pcb_index;
 
@@ -935,10 +1898,40 @@ void testTimeSharing(void) {
   pid = create(idling, TEST_STACK_SIZE, NULL);
   pidMapLookup(pid, &pcb_index);
   idle = pcbTable + pcb_index;
+  setprio(idle, IDLE_PRIORITY);
 
   dispatch();
   assertEquals(awake, TRUE);
   assert(ticks);
+
+  // Test timed send and receive give up and leave the peer's queue
+  test_print("Test for message timeouts:\n");
+  awake = FALSE;
+  create(timed_messages, TEST_STACK_SIZE, NULL);
+  pid = create(idling, TEST_STACK_SIZE, NULL);
+  pidMapLookup(pid, &pcb_index);
+  idle = pcbTable + pcb_index;
+  setprio(idle, IDLE_PRIORITY);
+  dispatch();
+  assertEquals(awake, TRUE);
+
+  // Test sleeps shorter than a time slice wake up in order
+  test_print("Test for microsecond sleep:\n");
+  awake = FALSE;
+  create(usleeping, TEST_STACK_SIZE, NULL);
+  pid = create(idling, TEST_STACK_SIZE, NULL);
+  pidMapLookup(pid, &pcb_index);
+  idle = pcbTable + pcb_index;
+  setprio(idle, IDLE_PRIORITY);
+  dispatch();
+  assertEquals(awake, TRUE);
+
+#if SCHEDULER == SCHED_MLFQ
+  // Test CPU bound process gets demoted while a sleeper keeps its level
+  test_print("Test for MLFQ demotion:\n");
+  create(mlfq_sleeper, TEST_STACK_SIZE, NULL);
+  dispatch();
+#endif
 }
 
 void handler_exit(void *cntx) {
@@ -1476,37 +2469,119 @@ void test_nonblocking_sysread(void) {
   test_puts(str, "Closed fd %d\n", fd);
 }
 
-void test_blocking_sysread(void) {
-  int rc, fd;
-  unsigned int bg_pid, me;
+void test_sysreadv(void) {
+  int rc, fd, i;
+  char str[TEST_STR_SIZE], head[1], tail[SHORT_BUF_SIZE];
+  iovec iov[3];
+
+  fd = sysopen(KEYBOARD_0);
+  assertEquals(fd, 0);
+  for (i = 0; i < sizeof(TEST_STRING)/sizeof(char) - 1; i++) {
+    rc = test_insert_char(*(TEST_STRING+i));
+    assertEquals(rc, 0);
+  }
+
+  iov[0].base = head;
+  iov[0].len = sizeof(head);
+  iov[1].base = NULL;
+  iov[1].len = 0;
+  iov[2].base = tail;
+  iov[2].len = sizeof(tail);
+  assertEquals(sysreadv(fd, iov, MAX_IOV + 1), -1);
+  assertEquals(syswritev(fd, iov, 3), -1);
+  rc = sysreadv(fd, iov, 3);
+  assertEquals(rc, 3);
+  assertEquals(head[0], 'a');
+  assertEquals(tail[0], 'b');
+  assertEquals(tail[1], 'c');
+  test_puts(str, "sysreadv fd %d returns %d bytes over 3 segments\n", fd, rc);
+
+  rc = sysclose(fd);
+  assertEquals(rc, 0);
+}
+
+void poll_sender(void) {
+  int word;
+
+  word = 42;
+  assertEquals(syssend(sysgetppid(), &word, sizeof(int)), sizeof(int));
+}
+
+void poll_quitter(void) {
+  sysyield();
+}
+
+void test_syspoll(void) {
+  int rc, fd, word;
+  unsigned int pid;
+  char str[TEST_STR_SIZE], c;
+
+  fd = sysopen(KEYBOARD_0);
+  assertEquals(fd, 0);
+  assertEquals(syspoll(0, 0), -1);
+  assertEquals(syspoll(POLL_FD(fd + 1), 0), -1);
+  assertEquals(syspoll(POLL_MSG, sysgetpid()), -1);
+
+  // Buffered characters are ready right away
+  assertEquals(test_insert_char('a'), 0);
+  rc = syspoll(POLL_FD(fd) | POLL_MSG, 0);
+  assertEquals(rc, POLL_FD(fd));
+  assertEquals(sysread(fd, &c, 1), 1);
+  assertEquals(c, 'a');
+  test_puts(str, "syspoll fd %d returns 0x%x with buffered characters\n", fd, rc);
+
+  // A sender blocking on the poller wakes it up
+  pid = syscreate(poll_sender, TEST_STACK_SIZE);
+  rc = syspoll(POLL_FD(fd) | POLL_MSG, pid);
+  assertEquals(rc, POLL_MSG);
+  assertEquals(sysrecv(&pid, &word, sizeof(int)), sizeof(int));
+  assertEquals(word, 42);
+  test_puts(str, "syspoll returns 0x%x for a message from process %03u\n", rc, pid);
+
+  // So does the process it waits for stopping
+  pid = syscreate(poll_quitter, TEST_STACK_SIZE);
+  rc = syspoll(POLL_FD(fd) | POLL_MSG, pid);
+  assertEquals(rc, POLL_MSG);
+  assertEquals(sysrecv(&pid, &word, sizeof(int)), SYS_SR_NO_PID);
+  test_puts(str, "syspoll returns 0x%x when process %03u stopped\n", rc, pid);
+
+  rc = sysclose(fd);
+  assertEquals(rc, 0);
+}
+
+// Fills the whole keyboard buffer, so the read does not block
+#define LINE_STRING "ab\nc"
+void test_line_sysread(void) {
+  int rc, fd, i;
+  unsigned int me;
   char str[TEST_STR_SIZE];
   char buf[TEST_STR_SIZE + 1];
 
   me = sysgetpid();
-  test_puts(str, "Process %03d started\n", me);
-
-  bg_pid = syscreate(idle_wait_sig, TEST_STACK_SIZE);
-  test_puts(str, "Process %03d created idle process %03d\n", me, bg_pid);
-
   fd = sysopen(KEYBOARD_1);
   assertEquals(fd, 0);
   test_puts(str, "Process %03d opened device %d, got fd %d\n",
-      me, KEYBOARD_0, fd);
+      me, KEYBOARD_1, fd);
 
-  test_puts(str, "Process %03d calling sysread fd %d, len 0x%x\n",
-      me, fd, TEST_STR_SIZE);
-  test_puts(str, 
-      "Enter something and hit the return key to unblock Process %03d:\n",
-      me);
-  rc = sysread(fd, buf, TEST_STR_SIZE);
-  assert(rc >= 0);
+  // Input is fed in, a headless test run has no keyboard
+  for (i = 0; i < sizeof(LINE_STRING)/sizeof(char) - 1; i++) {
+    rc = test_insert_char(*(LINE_STRING+i));
+    assertEquals(rc, 0);
+  }
+
+  // The read ends after the newline, the rest stays buffered
+  rc = sysread(fd, buf, sizeof(LINE_STRING)/sizeof(char) - 1);
+  assertEquals(rc, 3);
   buf[rc] = 0;
+  assert(strcmp(buf, "ab\n") == 0);
+  test_puts(str, "Process %03d read line: %s", me, buf);
 
-  test_puts(str, "You entered: %s", buf);
+  rc = sysread(fd, buf, 1);
+  assertEquals(rc, 1);
+  assertEquals(buf[0], 'c');
 
-  test_puts(str, "Process %03d killing process %03d and exiting\n",
-      me, bg_pid);
-  syskill(bg_pid, TEST_SIG);
+  rc = sysclose(fd);
+  assertEquals(rc, 0);
 }
 
 void test_sysread_eof(void) {
@@ -1570,8 +2645,16 @@ void test_device() {
   create(test_nonblocking_sysread, TEST_STACK_SIZE, NULL);
   dispatch();
 
-  test_print("Test for blocking sysread:\n");
-  create(test_blocking_sysread, TEST_STACK_SIZE, NULL);
+  test_print("Test for vectored sysread:\n");
+  create(test_sysreadv, TEST_STACK_SIZE, NULL);
+  dispatch();
+
+  test_print("Test for syspoll:\n");
+  create(test_syspoll, TEST_STACK_SIZE, NULL);
+  dispatch();
+
+  test_print("Test for sysread ending at a newline:\n");
+  create(test_line_sysread, TEST_STACK_SIZE, NULL);
   dispatch();
 
   test_print("Test read reaching EOF:\n");
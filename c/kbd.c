@@ -39,7 +39,7 @@ int _keyboard_open(pcb *p) {
 
   // set driver state
   ps.pcb = p;
-  ps.buf = NULL;
+  ps.iov = NULL;
   ps.buf_len = 0;
   ps.ch_read = 0;
   ps.eof = DEFAULT_EOF;
@@ -81,7 +81,7 @@ int keyboard_open_echo(pcb* p) {
 int keyboard_close(pcb* p) {
   // reset driver state
   ps.pcb = NULL;
-  ps.buf = NULL;
+  ps.iov = NULL;
   ps.buf_len = 0;
   ps.ch_read = 0;
   ps.eof = DEFAULT_EOF;
@@ -118,6 +118,18 @@ int keyboard_write(pcb* p, void* buf, int buf_len) {
   return DRV_ERROR;
 }
 
+int keyboard_writev(pcb* p, iovec* iov, int iovcnt) {
+  return DRV_ERROR;
+}
+
+/*
+  A read returns right away once characters are buffered
+  or EOF has been reached
+*/
+int keyboard_poll(pcb* p) {
+  return size > 0 || ps.status & EOF_REACHED;
+}
+
 /*
   Checks if EOF has been reached since the keyboard was opened
   copy buffer to process and return immediately if there are more
@@ -125,15 +137,34 @@ int keyboard_write(pcb* p, void* buf, int buf_len) {
   in the driver state and tell DII to block the process
 */
 int keyboard_read(pcb* p, void* buf, int buf_len) {
+  ps.one.base = buf;
+  ps.one.len = buf_len;
+  return keyboard_readv(p, &ps.one, 1);
+}
+
+/*
+  Same as keyboard_read, characters fill the segments in order
+*/
+int keyboard_readv(pcb* p, iovec* iov, int iovcnt) {
+  int buf_len;
+
   if (ps.pcb != p) {
     kprintf("Should not happen\n");
     abort();
   }
+  buf_len = iov_length(iov, iovcnt);
+  if (buf_len == SYSERR) {
+    return DRV_ERROR;
+  } else if (!buf_len) {
+    p->irc = 0;
+    return DRV_DONE;
+  }
   
   // Process wants to read, EOF not reached 
   // but kernel buffer size is less than request length
   if (!(ps.status & EOF_IN_BUF) && size < buf_len) {
-    ps.buf = buf;
+    ps.iov = iov;
+    ps.seg = ps.seg_off = 0;
     ps.buf_len = buf_len;
     ps.ch_read = 0;
     p->state = READING;
@@ -141,12 +172,14 @@ int keyboard_read(pcb* p, void* buf, int buf_len) {
 
   // Buffer has more characters than the request length
   } else if (size >= buf_len || ps.status & EOF_IN_BUF) {
-    ps.buf = buf;
+    ps.iov = iov;
+    ps.seg = ps.seg_off = 0;
     ps.buf_len = buf_len;
     ps.ch_read = 0;
 
     // This FD has returned EOF at least once since open
     if (ps.status & EOF_REACHED) {
+      ps.buf_len = 0;
       p->irc = 0;
       return DRV_DONE;
 
@@ -197,7 +230,13 @@ int buf_copy() {
       goto read_done;
     }
 
-    ps.buf[ps.ch_read++] = a;
+    // Skip to the next segment with room left
+    while (ps.seg_off == ps.iov[ps.seg].len) {
+      ps.seg++;
+      ps.seg_off = 0;
+    }
+    ((unsigned char*) ps.iov[ps.seg].base)[ps.seg_off++] = a;
+    ps.ch_read++;
     // Echo
     if (ps.echo) {
       kputc(0, a);
@@ -210,6 +249,8 @@ int buf_copy() {
 
   read_done:
   ps.pcb->irc = ps.ch_read;
+  // No request left for the interrupt handler to feed
+  ps.buf_len = ps.ch_read = 0;
   return DRV_DONE;
 }
 
@@ -224,6 +265,7 @@ void keyboard_lower() {
   unsigned char byte, a;
   int rc;
 
+  trace(TR_IRQ, 1, 0);
   rc = 0;
   byte = inb(0x64);
   // Read from keyboard controller to driver buffer
@@ -239,8 +281,13 @@ void keyboard_lower() {
   }
 
   // If process still reading, let upper half feed chars to process
-  if (ps.ch_read < ps.buf_len && buf_copy() == DRV_DONE) {
-    ready(ps.pcb);
+  if (ps.ch_read < ps.buf_len) {
+    if (buf_copy() == DRV_DONE) {
+      ready(ps.pcb);
+    }
+  // Otherwise it may be polling the keyboard
+  } else if (ps.pcb && size) {
+    poll_notify(ps.pcb);
   }
 
   // signal APIC end of interrupt
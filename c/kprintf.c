@@ -6,6 +6,9 @@
 #include <stdarg.h>
 
 void	kputc(int, unsigned char);
+#if SERIAL_CONSOLE
+static	void	serialputc(unsigned char);
+#endif
 
 
 /*------------------------------------------------------------------------
@@ -178,5 +181,49 @@ static void kbmputc( unsigned char c )
  */
 void kputc(int dev, unsigned char c)
 {
+#if SERIAL_CONSOLE
+	if (c == '\n')
+		serialputc('\r');
+	serialputc(c);
+#endif
 	kbmputc(c);
 }
+
+#if SERIAL_CONSOLE
+#define COM1_BASE	0x3F8
+#define COM_THR		0	/* transmit holding register	*/
+#define COM_IER		1	/* interrupt enable register	*/
+#define COM_FCR		2	/* FIFO control register	*/
+#define COM_LCR		3	/* line control register	*/
+#define COM_MCR		4	/* modem control register	*/
+#define COM_LSR		5	/* line status register		*/
+#define COM_LSR_THRE	0x20	/* transmit holding reg. empty	*/
+#define COM_DIVISOR	1	/* 115200 baud			*/
+#define COM_SPIN	100000	/* give up on a missing port	*/
+
+/*------------------------------------------------------------------------
+ *  serialputc - write one character to COM1, polled
+ *------------------------------------------------------------------------
+ */
+static void serialputc(unsigned char c)
+{
+	static int	initialized = 0;
+	int		i;
+
+	if (!initialized) {
+		outb(COM1_BASE+COM_IER, 0x00);
+		outb(COM1_BASE+COM_LCR, 0x80);	/* divisor latch access	*/
+		outb(COM1_BASE+COM_THR, COM_DIVISOR & 0xff);
+		outb(COM1_BASE+COM_IER, COM_DIVISOR >> 8);
+		outb(COM1_BASE+COM_LCR, 0x03);	/* 8N1			*/
+		outb(COM1_BASE+COM_FCR, 0xC7);	/* clear and enable FIFO*/
+		outb(COM1_BASE+COM_MCR, 0x03);	/* DTR, RTS		*/
+		initialized = 1;
+	}
+
+	for (i = 0; i < COM_SPIN; i++)
+		if (inb(COM1_BASE+COM_LSR) & COM_LSR_THRE)
+			break;
+	outb(COM1_BASE+COM_THR, c);
+}
+#endif
@@ -0,0 +1,108 @@
+/* lend.c : message buffers lent between processes
+ */
+
+#include <xeroskernel.h>
+
+extern pcb pcbTable[MAX_NUM_PROCESS];
+
+#define LENT_HDR(buf) (((lentBuf*) (buf)) - 1)
+
+static void lend_link(lentBuf *hdr, pcb *p);
+static void lend_unlink(lentBuf *hdr);
+
+/*
+ * Allocates a buffer owned by p, it can be lent to another process
+ * with syslend and is freed with p if nobody freed it before
+ * @return the buffer, or NULL if out of memory
+ */
+void *lend_alloc(pcb *p, int size) {
+  lentBuf *hdr;
+
+  if (size < 0) {
+    return NULL;
+  }
+  hdr = kmalloc(sizeof(lentBuf) + size);
+  if (!hdr) {
+    return NULL;
+  }
+  hdr->size = size;
+  hdr->sanityCheck = hdr + 1;
+  lend_link(hdr, p);
+  return hdr + 1;
+}
+
+/*
+ * Checks buf is a buffer from lend_alloc owned by p
+ * @return usable size of the buffer, or SYSERR
+ */
+int lend_owned(pcb *p, void *buf) {
+  lentBuf *hdr;
+
+  if (!buf || ((unsigned long) buf) % 16) {
+    return SYSERR;
+  }
+  hdr = LENT_HDR(buf);
+  if (hdr->sanityCheck != buf || hdr->owner != p->pid) {
+    return SYSERR;
+  }
+  return hdr->size;
+}
+
+/*
+ * Frees a buffer owned by p
+ * @return OK, or SYSERR if p does not own buf
+ */
+int lend_free(pcb *p, void *buf) {
+  lentBuf *hdr;
+
+  if (lend_owned(p, buf) == SYSERR) {
+    return SYSERR;
+  }
+  hdr = LENT_HDR(buf);
+  lend_unlink(hdr);
+  hdr->sanityCheck = NULL;
+  kfree(hdr);
+  return OK;
+}
+
+/*
+ * Makes p the owner of a lent buffer
+ */
+void lend_give(void *buf, pcb *p) {
+  lentBuf *hdr;
+
+  hdr = LENT_HDR(buf);
+  lend_unlink(hdr);
+  lend_link(hdr, p);
+}
+
+/*
+ * Frees all buffers a stopping process still owns
+ */
+void lend_release(pcb *p) {
+  while (p->lent) {
+    lend_free(p, p->lent + 1);
+  }
+}
+
+/* Pushes a buffer to the head of its owner's list */
+static void lend_link(lentBuf *hdr, pcb *p) {
+  hdr->owner = p->pid;
+  hdr->prev = NULL;
+  hdr->next = p->lent;
+  if (p->lent) {
+    p->lent->prev = hdr;
+  }
+  p->lent = hdr;
+}
+
+static void lend_unlink(lentBuf *hdr) {
+  if (hdr->prev) {
+    hdr->prev->next = hdr->next;
+  } else {
+    pcbTable[PID_INDEX(hdr->owner)].lent = hdr->next;
+  }
+  if (hdr->next) {
+    hdr->next->prev = hdr->prev;
+  }
+}
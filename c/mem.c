@@ -8,32 +8,180 @@
 extern  long  freemem;
 
 /* Your code goes here */
-memHeader *freeList = NULL;
+
+// Size class list links, kept in the data area of a free block
+typedef struct _classLinks {
+  memHeader *prev;
+  memHeader *next;
+} classLinks;
+#define LINKS(hdr) ((classLinks*) (hdr)->dataStart)
+// Physical neighbours of a block, boundary tags of the same region
+#define NEXT_BLOCK(hdr) ((memHeader*) ((hdr)->dataStart + (hdr)->size))
+#define PREV_BLOCK(hdr) \
+  ((memHeader*) ((unsigned char*) (hdr) - (hdr)->prevSize - sizeof(memHeader)))
+
+static int size_class(unsigned long size);
+static void class_insert(memHeader *hdr);
+static void class_remove(memHeader *hdr);
+
+// Free blocks by size class, bit i of classBitmap is set if class i is not empty
+static memHeader *classList[NUM_SIZE_CLASS];
+static unsigned int classBitmap;
+static unsigned int numFreeBlocks;
+sizeClassStats kmallocStats[LARGE_CLASS];
+#if KMALLOC_BACKEND == KMALLOC_TLSF
+static tlsfPool kernelPool;
+#endif
+// Pages taken from the buddy allocator for small blocks
+static unsigned int heapPages;
+
+static void *heap_malloc(int size);
+static void heap_free(void *ptr);
+static int heap_grow(void);
 
 void kmeminit(void) {
-  // Get the first aligned address after freemem
-  long alignedStart = (freemem/16 + (freemem%16?1:0)) * 16;
+  buddy_init();
+  heapPages = 0;
+#if KMALLOC_BACKEND == KMALLOC_TLSF
+  tlsf_init(&kernelPool);
+#else
+  segfit_init();
+#endif
+
+  // Slabs of existing caches are gone
+  kmem_cache_init();
+}
 
-  // Initialize first node to be everything before the hole
-  freeList = (memHeader*) alignedStart;
-  freeList->size = HOLESTART - sizeof(memHeader) - (int) alignedStart;
-  freeList->prev = NULL;
-  freeList->next = (memHeader*) HOLEEND;
-  freeList->sanityCheck = NULL;
+void *kmalloc(int size) {
+  void *ptr;
+
+  if (size <= 0) {
+    return NULL;
+  }
 
-  // The second node is everything after the hole
-  memHeader *afterHole = (memHeader*) HOLEEND;
-  afterHole->size = FREEMEM_END - HOLEEND - sizeof(memHeader);
-  afterHole->prev = freeList;
-  afterHole->next = NULL;
-  afterHole->sanityCheck = NULL;  
+  // Large blocks get whole pages so they do not fragment the heap
+  if (size > KMALLOC_PAGE_MIN) {
+    ptr = alloc_pages((size + NBPG - 1) / NBPG);
+  } else {
+    ptr = heap_malloc(size);
+    if (!ptr && heap_grow() == OK) {
+      ptr = heap_malloc(size);
+    }
+  }
+  trace(TR_KMALLOC, (unsigned int) ptr, size);
+  return ptr;
 }
 
+void kfree(void *ptr) {
+  trace(TR_KFREE, (unsigned int) ptr, 0);
+  if (free_pages(ptr) != OK) {
+    heap_free(ptr);
+  }
+}
 
-void *kmalloc(int size) {
+/*
+ * Fills a fragmentation report
+ */
+void mem_report(memInfo *info) {
+  buddy_report(info);
+  info->heapPages = heapPages;
+}
+
+/*
+ * Number of free blocks of the small block heap, whichever the backend
+ */
+unsigned int heap_free_blocks(void) {
+#if KMALLOC_BACKEND == KMALLOC_TLSF
+  return tlsf_free_blocks(&kernelPool);
+#else
+  return segfit_free_blocks();
+#endif
+}
+
+static void *heap_malloc(int size) {
+#if KMALLOC_BACKEND == KMALLOC_TLSF
+  return tlsf_malloc(&kernelPool, size);
+#else
+  return segfit_malloc(size);
+#endif
+}
+
+static void heap_free(void *ptr) {
+#if KMALLOC_BACKEND == KMALLOC_TLSF
+  tlsf_free(&kernelPool, ptr);
+#else
+  segfit_free(ptr);
+#endif
+}
+
+/*
+ * Adds a chunk of pages to the heap, a single page if there is no
+ * free chunk, heap pages are never given back
+ */
+static int heap_grow(void) {
+  void *chunk;
+  int npages;
+
+  npages = KMALLOC_CHUNK_PAGES;
+  chunk = alloc_heap_pages(npages);
+  if (!chunk) {
+    npages = 1;
+    chunk = alloc_heap_pages(npages);
+  }
+  if (!chunk) {
+    return SYSERR;
+  }
+
+#if KMALLOC_BACKEND == KMALLOC_TLSF
+  tlsf_add_region(&kernelPool, chunk, chunk + npages*NBPG);
+#else
+  segfit_add_region(chunk, chunk + npages*NBPG);
+#endif
+  heapPages += npages;
+  return OK;
+}
+
+/*
+ * Segregated fit backend, free blocks are kept in size class lists and
+ * coalesced through the boundary tags in their headers
+ */
+void segfit_init(void) {
+  int i;
+
+  for (i = 0; i < NUM_SIZE_CLASS; i++) {
+    classList[i] = NULL;
+  }
+  for (i = 0; i < LARGE_CLASS; i++) {
+    kmallocStats[i].hits = kmallocStats[i].misses = 0;
+  }
+  classBitmap = 0;
+  numFreeBlocks = 0;
+}
+
+/*
+ * Gives the memory in [start, end) to the segregated fit lists,
+ * by freeing it as if it was allocated
+ */
+void segfit_add_region(void *start, void *end) {
+  memHeader *hdr;
+
+  // Align start up and end down to 16 bytes
+  hdr = (memHeader*) ((((unsigned long) start)/16 + (((unsigned long) start)%16?1:0)) * 16);
+  end = (void*) ((((unsigned long) end)/16) * 16);
+  if ((void*) hdr->dataStart >= end) {
+    return;
+  }
+  hdr->size = end - (void*) hdr->dataStart;
+  hdr->prevSize = 0;
+  hdr->flags = MEM_LAST;
+  hdr->sanityCheck = (char*) hdr->dataStart;
+  segfit_free(hdr->dataStart);
+}
+
+void *segfit_malloc(int size) {
   memHeader *node;
   memHeader *nextNode= NULL;
-  int rmdSize;
+  int rmdSize, class;
 
   // return immediately for some case
   if (size <= 0) {
@@ -43,97 +191,162 @@ void *kmalloc(int size) {
   int amount = ((size/16) + (size%16?1:0)) * 16;
   // kprintf("aligned amount 0x%x\n", amount);
 
-  node = freeList;
-  while (node != NULL && node->size < amount) {
-    node = node->next;
-  }
+  if (amount <= KMALLOC_SMALL_MAX) {
+    // Round up to the size class, every block in this class or above fits
+    class = size_class(amount);
+    if (amount != 16 << class) {
+      class++;
+    }
+    amount = 16 << class;
 
-  // Return if all free nodes are smaller than requested size
-  if (node == NULL) {
-    return NULL;
+    if (classBitmap & (1 << class)) {
+      kmallocStats[class].hits++;
+    } else {
+      kmallocStats[class].misses++;
+    }
+    if (!(classBitmap >> class)) {
+      return NULL;
+    }
+    node = classList[bit_scan_forward(classBitmap >> class) + class];
+
+  } else {
+    // First fit in the own class, whose blocks may be too small,
+    // then any block of a larger class
+    class = size_class(amount);
+    node = classList[class];
+    while (node != NULL && node->size < amount) {
+      node = LINKS(node)->next;
+    }
+    if (node == NULL && class < LARGE_CLASS && (classBitmap >> (class + 1))) {
+      node = classList[bit_scan_forward(classBitmap >> (class + 1)) + class + 1];
+    }
+
+    // Return if all free nodes are smaller than requested size
+    if (node == NULL) {
+      return NULL;
+    }
   }
+  class_remove(node);
 
   // Check if the node size is greater than requested size + memHeader size
   rmdSize = node->size - amount - sizeof(memHeader);
   if (rmdSize > 0) {
-    // Split the free node and initialize a new free node
-    // dprintf("nextNode start at 0x%x\n", node->dataStart + amount);
+    // Split the free node, the rest becomes a free node right above it
     nextNode = (memHeader*) (node->dataStart + amount);
     nextNode->size = rmdSize;
-    nextNode->next = node->next;
-    if (node->next) {
-      node->next->prev = nextNode;
+    nextNode->prevSize = amount;
+    nextNode->flags = MEM_FREE | (node->flags & MEM_LAST);
+    nextNode->sanityCheck = NULL;
+    if (!(nextNode->flags & MEM_LAST)) {
+      NEXT_BLOCK(nextNode)->prevSize = rmdSize;
     }
-  } else {
-    // Node not big enough to be splitted
-    nextNode = node->next;
+    node->flags &= ~MEM_LAST;
+    node->size = amount;
+    class_insert(nextNode);
   }
 
-  // Adjust free memory list
-  if (nextNode) {
-    nextNode->prev = node->prev;
-  }
-  if (node->prev) {
-    node->prev->next = nextNode;
-  } else {
-    freeList = nextNode;
-  }
- 
-  // Initialize memory header 
-  node->size = amount;
-  node->next = NULL;
-  node->prev = NULL;
+  // Initialize memory header
+  node->flags &= ~MEM_FREE;
   node->sanityCheck = (char*) node->dataStart;
   return node->dataStart;
 }
 
-void kfree(void *ptr) {
-  memHeader *hdr, *freeNode;
+void segfit_free(void *ptr) {
+  memHeader *hdr, *neighbour;
   hdr = (memHeader*) (ptr - sizeof(memHeader));
 
   // Validate sanity check
-  if (hdr->sanityCheck == (char*) hdr->dataStart) {
-    hdr->next = NULL;
-    hdr->prev = NULL; 
-    hdr->sanityCheck = NULL;
-    if (freeList == NULL) {
-      // Free list is empty, make free list -> node
-      freeList = hdr;
-    } else if (hdr < freeList) {
-      // First node in free list has higher address then ptr,
-      // prepend node to free list
-      freeList->prev = hdr;
-      hdr->next = freeList;
-      freeList = hdr;
-    } else {
-      // Try to insert node back while keeping list in order of address
-      freeNode = freeList;
-      while (freeNode->next != NULL && hdr > freeNode->next) {
-        freeNode = freeNode->next;
-      }
-      if (freeNode->next != NULL) {
-        hdr->next = freeNode->next;
-        freeNode->next->prev = hdr;
-      }
-      freeNode->next = hdr;
-      hdr->prev = freeNode;
+  if (hdr->sanityCheck != (char*) hdr->dataStart || (hdr->flags & MEM_FREE)) {
+    return;
+  }
+  hdr->sanityCheck = NULL;
+  hdr->flags |= MEM_FREE;
+
+  // Try to coalesce with the free block right below
+  if (hdr->prevSize) {
+    neighbour = PREV_BLOCK(hdr);
+    if (neighbour->flags & MEM_FREE) {
+      class_remove(neighbour);
+      neighbour->size += hdr->size + sizeof(memHeader);
+      neighbour->flags |= hdr->flags & MEM_LAST;
+      hdr = neighbour;
     }
-    // Try to coalesce with a free node at lower address
-    if (hdr->prev && (hdr->prev->dataStart + hdr->prev->size) == (unsigned char*) hdr ) {
-      hdr->prev->size += hdr->size + sizeof(memHeader);
-      hdr->prev->next = hdr->next;
-      if (hdr->next) {
-        hdr->next->prev = hdr->prev;
-      }
-      hdr = hdr->prev;
+  }
+  // Try to coalesce with the free block right above
+  if (!(hdr->flags & MEM_LAST)) {
+    neighbour = NEXT_BLOCK(hdr);
+    if (neighbour->flags & MEM_FREE) {
+      class_remove(neighbour);
+      hdr->size += neighbour->size + sizeof(memHeader);
+      hdr->flags |= neighbour->flags & MEM_LAST;
     }
-    // Try to coalesce with a free node at higher address
-    if (hdr->next && (hdr->dataStart + hdr->size) == (unsigned char*) (hdr->next)) {
-      hdr->size += hdr->next->size + sizeof(memHeader);
-      hdr->next = hdr->next->next;
-      if (hdr->next && hdr->next->next) {
-        hdr->next->next->prev = hdr;
-      }
+  }
+  if (!(hdr->flags & MEM_LAST)) {
+    NEXT_BLOCK(hdr)->prevSize = hdr->size;
+  }
+  class_insert(hdr);
+}
+
+/*
+ * Number of free blocks, one per region when nothing is allocated
+ */
+unsigned int segfit_free_blocks(void) {
+  return numFreeBlocks;
+}
+
+/*
+ * Size class of a free block
+ */
+static int size_class(unsigned long size) {
+  int class;
+
+  class = bit_scan_reverse(size >> 4);
+  return min(class, LARGE_CLASS);
+}
+
+/*
+ * Pushes a free block to the head of its size class list
+ */
+static void class_insert(memHeader *hdr) {
+  int class;
+
+  class = size_class(hdr->size);
+  LINKS(hdr)->prev = NULL;
+  LINKS(hdr)->next = classList[class];
+  if (classList[class]) {
+    LINKS(classList[class])->prev = hdr;
+  }
+  classList[class] = hdr;
+  classBitmap |= 1 << class;
+  numFreeBlocks++;
+}
+
+/*
+ * Unlinks a free block from its size class list
+ */
+static void class_remove(memHeader *hdr) {
+  int class;
+
+  class = size_class(hdr->size);
+  if (LINKS(hdr)->prev) {
+    LINKS(LINKS(hdr)->prev)->next = LINKS(hdr)->next;
+  } else {
+    classList[class] = LINKS(hdr)->next;
+    if (!classList[class]) {
+      classBitmap &= ~(1 << class);
     }
   }
+  if (LINKS(hdr)->next) {
+    LINKS(LINKS(hdr)->next)->prev = LINKS(hdr)->prev;
+  }
+  numFreeBlocks--;
+}
+
+void print_kmem_stats(void) {
+  int i;
+
+  for (i = 0; i < LARGE_CLASS; i++) {
+    kprintf("class %d (%d bytes): %u hits, %u misses\n",
+        i, 16 << i, kmallocStats[i].hits, kmallocStats[i].misses);
+  }
 }
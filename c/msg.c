@@ -7,11 +7,33 @@
 /* Your code goes here */
 extern pcb pcbTable[MAX_NUM_PROCESS];
 
+// Kinds of send and receive requests
+#define REQ_REPLY 1
+#define REQ_LEND 2
+#define REQ_BORROW 4
+#define REQ_VECTOR 8
+
 static void send_receive_transfer(pcb*, pcb*);
+static pcb* send_target(pcb*, unsigned int);
+static Bool waiting_receiver(pcb*, pcb*);
+static Bool mbox_take(pcb*, unsigned int*);
+static void send_request(pcb*, unsigned int, int);
+static void receive_request(pcb*, unsigned int*, int);
+static int msg_iov(pcb*, iovec*, iovec**);
+static int copy_to_receiver(pcb*, iovec*, int);
+static int msg_iov_length(pcb*, iovec**);
+static int iov_copy(iovec*, int, iovec*, int);
+static void sender_done(pcb*);
+static pcb* reply_queue_remove(pcb*, unsigned int);
+static pcb* wait_queue_take(pcbQueue*, unsigned int);
 static pcb* recv_queue_remove(pcb*, unsigned int);
 static pcb* send_queue_remove(pcb*, unsigned int);
 static void recv_queue_insert(pcb*, pcb*);
 static void send_queue_insert(pcb*, pcb*);
+static void block_timed(pcb*, unsigned int);
+static void msg_timeout(void*);
+
+static kmem_cache *mboxCache;
 
 /*
  * Sends a message to another process
@@ -20,61 +42,254 @@ static void send_queue_insert(pcb*, pcb*);
  * Blocks p if target process is not blocked receiving
  */
 void send(pcb* p, unsigned int dest_pid) {
-  unsigned int dest_pcb_index;
+  send_request(p, dest_pid, 0);
+}
+
+/*
+ * Sends a request like send, once the receiver took it p blocks in
+ * REPLY_BLOCKED until the receiver calls reply
+ */
+void sendrecv(pcb* p, unsigned int dest_pid) {
+  send_request(p, dest_pid, REQ_REPLY);
+}
+
+/*
+ * Sends a buffer from lend_alloc like send
+ * Readies p and returns SYS_SR_ERR if p does not own the buffer or it is
+ * shorter than the length, a receive_lent receiver becomes its owner
+ */
+void lend(pcb* p, unsigned int dest_pid) {
   va_list ap;
-  pcb *dest_p;
-  unsigned int *src_pid;
+  void *buf;
+  int size;
 
-  if (p->pid == dest_pid) {
-    p->irc = SYS_SR_SELF;
+  ap = (va_list) p->iargs;
+  va_arg(ap, int);
+  buf = (void*) va_arg(ap, int);
+  size = lend_owned(p, buf);
+  if (size == SYSERR || va_arg(ap, int) > size) {
+    p->irc = SYS_SR_ERR;
     ready(p);
-    return; 
+    return;
+  }
+  send_request(p, dest_pid, REQ_LEND);
+}
 
-  } else if (pidMapLookup(dest_pid, &dest_pcb_index) != OK) {
+/*
+ * Sends like send, gathering the message from the sender's segments
+ * Readies p and returns SYS_SR_ERR if the segments are out of range
+ */
+void sendv(pcb* p, unsigned int dest_pid) {
+  iovec *iov;
+
+  if (msg_iov_length(p, &iov) == SYSERR) {
+    p->irc = SYS_SR_ERR;
+    ready(p);
+    return;
+  }
+  send_request(p, dest_pid, REQ_VECTOR);
+}
+
+/*
+ * Answers the request of a process blocked in REPLY_BLOCKED on p
+ * Readies p and returns SYSERR if the length is negative, the client
+ * keeps waiting
+ * Readies p and returns SYS_SR_NO_PID if pid is not waiting for p's reply
+ * Readies both and returns bytes transferred to both otherwise
+ */
+void reply(pcb* p, unsigned int pid) {
+  va_list s_ap, r_ap;
+  void *src_buf, *dest_buf;
+  pcb *client;
+  int len;
+
+  s_ap = (va_list) p->iargs;
+  va_arg(s_ap, int);
+  src_buf = (void*) va_arg(s_ap, int);
+  len = va_arg(s_ap, int);
+  if (len < 0) {
+    p->irc = SYSERR;
+    ready(p);
+    return;
+  }
+
+  client = reply_queue_remove(p, pid);
+  if (!client) {
     p->irc = SYS_SR_NO_PID;
     ready(p);
-    return; 
+    return;
   }
 
-  // Look for specified process in receiver queue
-  dest_p = recv_queue_remove(p, dest_pid);
-  if (dest_p) {
+  // The reply buffer follows the request in the client's arguments
+  r_ap = (va_list) client->iargs;
+  va_arg(r_ap, int);
+  va_arg(r_ap, int);
+  va_arg(r_ap, int);
+  dest_buf = (void*) va_arg(r_ap, int);
+  len = min(len, va_arg(r_ap, int));
+  if (len > 0) {
+    _bcopy(src_buf, dest_buf, len);
+  }
+
+  p->irc = client->irc = len;
+  ready(p);
+  ready(client);
+}
+
+static void send_request(pcb* p, unsigned int dest_pid, int kind) {
+  pcb *dest_p;
+
+  p->wants_reply = (kind & REQ_REPLY) != 0;
+  p->lending = (kind & REQ_LEND) != 0;
+  p->vectored = (kind & REQ_VECTOR) != 0;
+  dest_p = send_target(p, dest_pid);
+  if (!dest_p) {
+    return;
+  }
+
+  if (waiting_receiver(p, dest_p)) {
+    send_receive_transfer(p, dest_p);
+    sender_done(p);
+    ready(dest_p);
+  } else {
+    // Put process in destination process' sender queue
+    send_queue_insert(dest_p, p);
+  }
+}
+
+/*
+ * Sends a message without waiting for the receiver
+ * Readies p and returns error code if target does not exist or is self,
+ * or SYS_SR_ERR if the message does not fit in a mailbox slot
+ * Readies p and returns bytes sent if target is blocked receiving from p or
+ * any, or if the message was queued in the target's mailbox
+ * Blocks p like send if the mailbox is full, or returns BLOCKERR with MSG_NONBLOCK
+ */
+void asend(pcb* p, unsigned int dest_pid, int flags) {
+  va_list ap;
+  pcb *dest_p;
+  mailbox *mbox;
+  mboxMsg *msg;
+  void *buf;
+  int len;
+
+  p->wants_reply = p->lending = p->vectored = FALSE;
+  dest_p = send_target(p, dest_pid);
+  if (!dest_p) {
+    return;
+  }
+
+  ap = (va_list) p->iargs;
+  va_arg(ap, int);
+  buf = (void*) va_arg(ap, int);
+  len = va_arg(ap, int);
+  if (len < 0 || len > MBOX_MSG_SIZE) {
+    p->irc = SYS_SR_ERR;
+    ready(p);
+    return;
+  }
+
+  // A waiting receiver gets the message right away
+  if (waiting_receiver(p, dest_p)) {
     send_receive_transfer(p, dest_p);
     ready(p);
     ready(dest_p);
+    return;
+  }
 
-  } else {
-    // Destination process not in queue, check if it's blocked recv from any
-    dest_p = pcbTable + dest_pcb_index;
-    ap = (va_list) dest_p->iargs;
-    src_pid = (unsigned int*) va_arg(ap, int);
-    if (dest_p->state == RECEIVING && !(*src_pid)) {
-      send_receive_transfer(p, dest_p);
+  mbox = dest_p->mbox;
+  if (!mbox) {
+    // Mailboxes all have the same size, they come from their own cache
+    if (!mboxCache) {
+      mboxCache = kmem_cache_create("mailbox", sizeof(mailbox), NULL);
+    }
+    mbox = mboxCache ? kmem_cache_alloc(mboxCache) : NULL;
+    if (!mbox) {
+      p->irc = SYSERR;
+      ready(p);
+      return;
+    }
+    mbox->head = mbox->count = 0;
+    dest_p->mbox = mbox;
+  }
+
+  if (mbox->count == MBOX_SLOTS) {
+    if (flags & MSG_NONBLOCK) {
+      p->irc = BLOCKERR;
       ready(p);
-      ready(dest_p);
     } else {
-      // Put process in destination process' sender queue
-      send_queue_insert(pcbTable + dest_pcb_index, p);
+      // Wait for the receiver like a synchronous sender,
+      // it takes senders after draining the mailbox
+      send_queue_insert(dest_p, p);
     }
+    return;
   }
+
+  msg = mbox->slot + (mbox->head + mbox->count) % MBOX_SLOTS;
+  msg->from = p->pid;
+  msg->len = len;
+  if (len) {
+    _bcopy(buf, msg->data, len);
+  }
+  mbox->count++;
+  p->irc = len;
+  ready(p);
+  poll_notify(dest_p);
 }
 
 /*
  * Receives a message from another process
  * Readies process and set returns error code if target does not exist or is self
- * Readies p and return bytes transferred if target is blocked sending to p
+ * Readies p and return bytes transferred if a message from the target is in
+ * p's mailbox or the target is blocked sending to p
  * Blocks if target process is not blocked sending
  */
 void receive(pcb* p, unsigned int *src_pid) {
+  receive_request(p, src_pid, 0);
+}
+
+/*
+ * Receives like receive, but into a buffer p owns afterwards, the
+ * sender's buffer if it lends it, else a copy from lend_alloc
+ */
+void receive_lent(pcb* p, unsigned int *src_pid) {
+  receive_request(p, src_pid, REQ_BORROW);
+}
+
+/*
+ * Receives like receive, scattering the message over p's segments
+ * Readies p and returns SYS_SR_ERR if the segments are out of range
+ */
+void receivev(pcb* p, unsigned int *src_pid) {
+  iovec *iov;
+
+  if (msg_iov_length(p, &iov) == SYSERR) {
+    p->irc = SYS_SR_ERR;
+    ready(p);
+    return;
+  }
+  receive_request(p, src_pid, REQ_VECTOR);
+}
+
+static void receive_request(pcb* p, unsigned int *src_pid, int kind) {
   unsigned int src_pcb_index;
   pcb *src_p;
 
+  p->borrowing = (kind & REQ_BORROW) != 0;
+  p->vectored = (kind & REQ_VECTOR) != 0;
   if (p->pid == *src_pid) {
     p->irc = SYS_SR_SELF;
     ready(p);
     return;
+  }
 
-  } else if (*src_pid && pidMapLookup(*src_pid, &src_pcb_index) != OK) {
+  // Queued messages come first, even from processes that since stopped
+  if (p->mbox && p->mbox->count && mbox_take(p, src_pid)) {
+    ready(p);
+    return;
+  }
+
+  if (*src_pid && pidMapLookup(*src_pid, &src_pcb_index) != OK) {
     p->irc = SYS_SR_NO_PID;
     ready(p);
     return;
@@ -87,7 +302,7 @@ void receive(pcb* p, unsigned int *src_pid) {
       // Found specified sender in sender queue
       send_receive_transfer(src_p, p);
       ready(p);
-      ready(src_p);
+      sender_done(src_p);
     } else {
       // specified process not found
       src_p = pcbTable + src_pcb_index;
@@ -96,13 +311,13 @@ void receive(pcb* p, unsigned int *src_pid) {
 
   } else {
     // if src_pid not specified, accept any sender in sender queue
-    if (p->senders) {
+    if (p->senders.head) {
       // Accept first sender in queue
-      src_p = p->senders;
+      src_p = p->senders.head;
+      wait_queue_remove(src_p);
       send_receive_transfer(src_p, p);
-      p->senders = src_p->next;
       ready(p);
-      ready(src_p);
+      sender_done(src_p);
     } else {
       // Block
       p->state = RECEIVING;
@@ -111,59 +326,217 @@ void receive(pcb* p, unsigned int *src_pid) {
 }
 
 /*
- * Removes destination process from p's receiver queue
+ * Sends like send, but readies p and returns TIMEOUT if the message
+ * was not taken within the given time, 0 ms only takes a waiting receiver
  */
-pcb* recv_queue_remove(pcb *p, unsigned int dest_pid) {
-  pcb **receiver, *dest_p;
-
-  dest_p = NULL;
-  receiver = &(p->receivers);
-  // Traverse the receiver queue and try to match a process with specified PID
-  while (*receiver) {
-    if ((*receiver)->pid == dest_pid) {
-      dest_p = *receiver;
-      *receiver = dest_p->next;
-      break;
-    } else {
-      receiver = &(*receiver)->next;
+void send_timed(pcb* p, unsigned int dest_pid, unsigned int milliseconds) {
+  send(p, dest_pid);
+  if (p->state == SENDING) {
+    block_timed(p, milliseconds);
+  }
+}
+
+/*
+ * Receives like receive, but readies p and returns TIMEOUT if no message
+ * arrived within the given time, 0 ms only takes a waiting sender
+ */
+void receive_timed(pcb* p, unsigned int *src_pid, unsigned int milliseconds) {
+  receive(p, src_pid);
+  if (p->state == RECEIVING) {
+    block_timed(p, milliseconds);
+  }
+}
+
+/*
+ * Frees the mailbox of a process that is cleaned up
+ */
+void mbox_release(pcb* p) {
+  if (p->mbox) {
+    kmem_cache_free(mboxCache, p->mbox);
+    p->mbox = NULL;
+  }
+}
+
+/*
+ * Takes a process blocked sending, receiving or waiting for a reply off its peer's queue
+ * and disarms its timeout, the caller readies it
+ */
+void msg_dequeue(pcb* p) {
+  timer_cancel(&p->timer);
+  if (p->wait_queue) {
+    wait_queue_remove(p);
+  }
+}
+
+static void block_timed(pcb *p, unsigned int milliseconds) {
+  unsigned long long ticks;
+
+  // In 64 bits, any number of milliseconds fits in ticks
+  ticks = (unsigned long long) milliseconds * MS_TO_TICKS(1);
+  if (ticks) {
+    timer_set(&p->timer, ticks, msg_timeout, p);
+  } else {
+    msg_timeout(p);
+  }
+}
+
+static void msg_timeout(void *arg) {
+  pcb *p = arg;
+
+  msg_dequeue(p);
+  p->irc = TIMEOUT;
+  ready(p);
+}
+
+/*
+ * Looks up the destination of a send
+ * Readies p with an error code and returns NULL if it does not exist or is p
+ */
+static pcb* send_target(pcb *p, unsigned int dest_pid) {
+  unsigned int dest_pcb_index;
+
+  if (p->pid == dest_pid) {
+    p->irc = SYS_SR_SELF;
+    ready(p);
+    return NULL;
+
+  } else if (pidMapLookup(dest_pid, &dest_pcb_index) != OK) {
+    p->irc = SYS_SR_NO_PID;
+    ready(p);
+    return NULL;
+  }
+  return pcbTable + dest_pcb_index;
+}
+
+/*
+ * Readies a sender after its message was transferred, or blocks it
+ * on the receiver's reply queue if it waits for a reply
+ */
+static void sender_done(pcb *src_p) {
+  va_list ap;
+  unsigned int dest_pcb_index;
+  pcb *dest_p;
+
+  if (!src_p->wants_reply) {
+    ready(src_p);
+    return;
+  }
+  ap = (va_list) src_p->iargs;
+  pidMapLookup(va_arg(ap, unsigned int), &dest_pcb_index);
+  dest_p = pcbTable + dest_pcb_index;
+  wait_queue_insert(&dest_p->awaiting_reply, src_p);
+  src_p->state = REPLY_BLOCKED;
+}
+
+/*
+ * Checks if receiving from src_pid, or from anyone if it is 0, would not
+ * block, either because a message is waiting or src_pid does not exist
+ */
+Bool msg_pending(pcb* p, unsigned int src_pid) {
+  unsigned int src_pcb_index, i;
+
+  if (p->mbox) {
+    for (i = 0; i < p->mbox->count; i++) {
+      if (!src_pid || p->mbox->slot[(p->mbox->head + i) % MBOX_SLOTS].from == src_pid) {
+        return TRUE;
+      }
     }
   }
-  return dest_p;
+  if (!src_pid) {
+    return p->senders.head != NULL;
+  }
+  if (pidMapLookup(src_pid, &src_pcb_index) != OK) {
+    return TRUE;
+  }
+  return pcbTable[src_pcb_index].wait_queue == &p->senders;
 }
 
 /*
- * Removes source process from p's sender queue
+ * Checks if dest_p is blocked receiving from p or any,
+ * takes it off p's receiver queue if it is
  */
-pcb* send_queue_remove(pcb *p, unsigned int src_pid) {
-  pcb **sender, *src_p;
-
-  src_p = NULL;
-  sender = &(p->senders);
-  // Traverse the sender queue and try to match a process with specified PID
-  while (*sender) {
-    if ((*sender)->pid == src_pid) {
-      src_p = *sender;
-      *sender = src_p->next;
+static Bool waiting_receiver(pcb *p, pcb *dest_p) {
+  va_list ap;
+  unsigned int *src_pid;
+
+  // Look for specified process in receiver queue
+  if (recv_queue_remove(p, dest_p->pid)) {
+    return TRUE;
+  }
+  // Destination process not in queue, check if it's blocked recv from any
+  ap = (va_list) dest_p->iargs;
+  src_pid = (unsigned int*) va_arg(ap, int);
+  return dest_p->state == RECEIVING && !(*src_pid);
+}
+
+/*
+ * Moves the oldest mailbox message from src_pid, or from anyone if
+ * *src_pid is 0, to p's receive buffer, sets the sender PID and return value.
+ * A message that could not be copied stays in the mailbox
+ * @return TRUE if there was such a message
+ */
+static Bool mbox_take(pcb *p, unsigned int *src_pid) {
+  mailbox *mbox;
+  mboxMsg *msg;
+  iovec one;
+  unsigned int i, slot;
+
+  mbox = p->mbox;
+  for (i = 0; i < mbox->count; i++) {
+    slot = (mbox->head + i) % MBOX_SLOTS;
+    if (!(*src_pid) || mbox->slot[slot].from == *src_pid) {
       break;
-    } else {
-      sender = &(*sender)->next;
     }
   }
-  return src_p;
+  if (i == mbox->count) {
+    return FALSE;
+  }
+
+  msg = mbox->slot + slot;
+  one.base = msg->data;
+  one.len = msg->len;
+  p->irc = copy_to_receiver(p, &one, 1);
+  if (p->irc == SYS_SR_ERR) {
+    return TRUE;
+  }
+  *src_pid = msg->from;
+
+  // Close the gap by moving older messages up one slot
+  for (; i > 0; i--) {
+    slot = (mbox->head + i) % MBOX_SLOTS;
+    _bcopy(mbox->slot + (mbox->head + i - 1) % MBOX_SLOTS, mbox->slot + slot, sizeof(mboxMsg));
+  }
+  mbox->head = (mbox->head + 1) % MBOX_SLOTS;
+  mbox->count--;
+  return TRUE;
+}
+
+/*
+ * Removes destination process from p's receiver queue
+ */
+pcb* recv_queue_remove(pcb *p, unsigned int dest_pid) {
+  return wait_queue_take(&p->receivers, dest_pid);
+}
+
+/*
+ * Removes source process from p's sender queue
+ */
+pcb* send_queue_remove(pcb *p, unsigned int src_pid) {
+  return wait_queue_take(&p->senders, src_pid);
+}
+
+/*
+ * Removes a client waiting for p's reply from p's reply queue
+ */
+pcb* reply_queue_remove(pcb *p, unsigned int pid) {
+  return wait_queue_take(&p->awaiting_reply, pid);
 }
 
 /*
  * Appends receiver to p's receiver queue
  */
 void recv_queue_insert(pcb *p, pcb *receiver) {
-  pcb **recv_q;
-
-  recv_q = &(p->receivers);
-  // Append process to end of receiver queue
-  while (*recv_q) {
-    recv_q = &(*recv_q)->next;
-  }
-  *recv_q = receiver;
+  wait_queue_insert(&p->receivers, receiver);
   receiver->state = RECEIVING;
 }
 
@@ -171,15 +544,65 @@ void recv_queue_insert(pcb *p, pcb *receiver) {
  * Appends sender to p's sender queue
  */
 void send_queue_insert(pcb *p, pcb *sender) {
-  pcb **send_q;
+  wait_queue_insert(&p->senders, sender);
+  sender->state = SENDING;
+  poll_notify(p);
+}
 
-  send_q = &(p->senders);
-  // Append process to end of sender queue
-  while (*send_q) {
-    send_q = &(*send_q)->next;
+/*
+ * Appends a blocked process to a queue of senders, receivers, clients or pollers
+ */
+void wait_queue_insert(pcbQueue *q, pcb *p) {
+  p->wait_queue = q;
+  p->next = NULL;
+  p->prev = q->tail;
+  if (q->tail) {
+    q->tail->next = p;
+  } else {
+    q->head = p;
   }
-  *send_q = sender;
-  sender->state = SENDING;
+  q->tail = p;
+}
+
+/*
+ * Takes a process off the queue it is blocked on
+ */
+void wait_queue_remove(pcb *p) {
+  pcbQueue *q;
+
+  q = p->wait_queue;
+  if (p->prev) {
+    p->prev->next = p->next;
+  } else {
+    q->head = p->next;
+  }
+  if (p->next) {
+    p->next->prev = p->prev;
+  } else {
+    q->tail = p->prev;
+  }
+  p->next = p->prev = NULL;
+  p->wait_queue = NULL;
+}
+
+/*
+ * Takes the process with the given PID off a queue, the PID leads
+ * straight to its PCB
+ * @return the process, or NULL if it is not on the queue
+ */
+static pcb* wait_queue_take(pcbQueue *q, unsigned int pid) {
+  unsigned int pcb_index;
+  pcb *p;
+
+  if (pidMapLookup(pid, &pcb_index) != OK) {
+    return NULL;
+  }
+  p = pcbTable + pcb_index;
+  if (p->wait_queue != q) {
+    return NULL;
+  }
+  wait_queue_remove(p);
+  return p;
 }
 
 /*
@@ -189,25 +612,119 @@ void send_queue_insert(pcb *p, pcb *sender) {
  */
 void send_receive_transfer(pcb *src_p, pcb* dest_p) {
   va_list s_ap, r_ap;
-  void *src_buf, *dest_buf;
-  int len;
+  iovec one, *iov;
+  void *buf;
+  int len, iovcnt;
   unsigned int *src_pid;
 
-  s_ap = (va_list) src_p->iargs;
   r_ap = (va_list) dest_p->iargs;
-  va_arg(s_ap, int);
   src_pid = (unsigned int*) va_arg(r_ap, int);
-  src_buf = (void*) va_arg(s_ap, int);
-  dest_buf = (void*) va_arg(r_ap, int);
 
-  // Transfer amount equals to the least of the two supplied lengths
-  len = min(va_arg(s_ap, int), va_arg(r_ap, int));
-
-  if (len) {
-    _bcopy(src_buf, dest_buf, len);
+  if (src_p->lending && dest_p->borrowing) {
+    // No copy, the receiver becomes the owner of the sender's buffer
+    s_ap = (va_list) src_p->iargs;
+    va_arg(s_ap, int);
+    buf = va_arg(s_ap, void*);
+    len = va_arg(s_ap, int);
+    *va_arg(r_ap, void**) = buf;
+    lend_give(buf, dest_p);
+  } else {
+    iovcnt = msg_iov(src_p, &one, &iov);
+    len = copy_to_receiver(dest_p, iov, iovcnt);
   }
 
   // write the sender PID to the address supplied by receiving process
   *src_pid = src_p->pid;
+  // either side may be waiting with a timeout
+  timer_cancel(&src_p->timer);
+  timer_cancel(&dest_p->timer);
   src_p->irc = dest_p->irc = len;
 }
+
+/*
+ * Segments of the message buffer of a sender or receiver, a plain buffer
+ * is described by one
+ * @return number of segments
+ */
+static int msg_iov(pcb *p, iovec *one, iovec **iov) {
+  va_list ap;
+
+  ap = (va_list) p->iargs;
+  va_arg(ap, int);
+  if (p->vectored) {
+    *iov = va_arg(ap, iovec*);
+    return va_arg(ap, int);
+  }
+  one->base = va_arg(ap, void*);
+  one->len = va_arg(ap, int);
+  *iov = one;
+  return 1;
+}
+
+/*
+ * Total length of the segments passed to a vectored send or receive
+ */
+static int msg_iov_length(pcb *p, iovec **iov) {
+  va_list ap;
+
+  ap = (va_list) p->iargs;
+  va_arg(ap, int);
+  *iov = va_arg(ap, iovec*);
+  return iov_length(*iov, va_arg(ap, int));
+}
+
+/*
+ * Copies a message to a receiver's buffer, the receiver's length limits
+ * the copy, or to a new buffer from lend_alloc for a receive_lent receiver
+ * @return bytes copied, or SYS_SR_ERR if no buffer could be allocated
+ */
+int copy_to_receiver(pcb *dest_p, iovec *src, int srccnt) {
+  va_list ap;
+  iovec one, *dest;
+  int destcnt;
+  void **lent_buf;
+
+  if (dest_p->borrowing) {
+    ap = (va_list) dest_p->iargs;
+    va_arg(ap, int);
+    lent_buf = va_arg(ap, void**);
+    one.len = iov_length(src, srccnt);
+    *lent_buf = one.base = lend_alloc(dest_p, one.len);
+    if (!one.base) {
+      return SYS_SR_ERR;
+    }
+    dest = &one;
+    destcnt = 1;
+  } else {
+    destcnt = msg_iov(dest_p, &one, &dest);
+  }
+  return iov_copy(dest, destcnt, src, srccnt);
+}
+
+/*
+ * Copies segment to segment until either side runs out
+ * @return bytes copied, the least of the two total lengths
+ */
+static int iov_copy(iovec *dest, int destcnt, iovec *src, int srccnt) {
+  int d, s, d_off, s_off, n, total;
+
+  d = s = d_off = s_off = total = 0;
+  while (d < destcnt && s < srccnt) {
+    n = min(dest[d].len - d_off, src[s].len - s_off);
+    if (n > 0) {
+      _bcopy(src[s].base + s_off, dest[d].base + d_off, n);
+    }
+    d_off += n;
+    s_off += n;
+    total += n;
+    if (d_off == dest[d].len) {
+      d++;
+      d_off = 0;
+    }
+    if (s_off == src[s].len) {
+      s++;
+      s_off = 0;
+    }
+  }
+  return total;
+}
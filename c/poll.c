@@ -0,0 +1,90 @@
+/* poll.c : waiting on several devices and messages at once
+ */
+
+#include <xeroskernel.h>
+#include <stdarg.h>
+
+extern pcb pcbTable[MAX_NUM_PROCESS];
+
+static int poll_ready(pcb*);
+
+/*
+ * Waits for the events in p's arguments, POLL_FD bits of opened devices
+ * and POLL_MSG for a message from the PID in the arguments or anyone
+ * Readies p and returns SYSERR if there are no events, a device can not
+ * be polled or the PID is p's own
+ * Readies p and returns the ready events if there are any
+ * Blocks p otherwise, a message poller for a PID waits on its queue of
+ * pollers to learn when it stops
+ */
+void poll(pcb* p) {
+  va_list ap;
+  unsigned int events, src_pid, src_pcb_index;
+  int fd;
+
+  ap = (va_list) p->iargs;
+  events = va_arg(ap, unsigned int);
+  src_pid = va_arg(ap, unsigned int);
+  if (!events || events & ~(POLL_MSG | (POLL_MSG - 1)) ||
+      (events & POLL_MSG && src_pid == p->pid)) {
+    p->irc = SYSERR;
+    ready(p);
+    return;
+  }
+  for (fd = 0; fd < NUM_FD; fd++) {
+    if (events & POLL_FD(fd) && (!p->opened_dv[fd] || !p->opened_dv[fd]->dvpoll)) {
+      p->irc = SYSERR;
+      ready(p);
+      return;
+    }
+  }
+
+  p->irc = poll_ready(p);
+  if (p->irc) {
+    ready(p);
+    return;
+  }
+  if (events & POLL_MSG && src_pid) {
+    pidMapLookup(src_pid, &src_pcb_index);
+    wait_queue_insert(&pcbTable[src_pcb_index].pollers, p);
+  }
+  p->state = POLLING;
+}
+
+/*
+ * Called by drivers and the messaging system when an event may have
+ * become ready for p, readies p with the ready events if it polls for one
+ */
+void poll_notify(pcb* p) {
+  if (p->state != POLLING) {
+    return;
+  }
+  p->irc = poll_ready(p);
+  if (p->irc) {
+    msg_dequeue(p);
+    ready(p);
+  }
+}
+
+/*
+ * Events in p's arguments that are ready
+ */
+static int poll_ready(pcb* p) {
+  va_list ap;
+  unsigned int events, src_pid;
+  int fd, ready_events;
+
+  ap = (va_list) p->iargs;
+  events = va_arg(ap, unsigned int);
+  src_pid = va_arg(ap, unsigned int);
+  ready_events = 0;
+  for (fd = 0; fd < NUM_FD; fd++) {
+    if (events & POLL_FD(fd) && p->opened_dv[fd]->dvpoll(p)) {
+      ready_events |= POLL_FD(fd);
+    }
+  }
+  if (events & POLL_MSG && msg_pending(p, src_pid)) {
+    ready_events |= POLL_MSG;
+  }
+  return ready_events;
+}
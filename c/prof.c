@@ -0,0 +1,80 @@
+/* prof.c : sampling profiler
+ *
+ * While profiling is on, the dispatcher hands every process whose time
+ * slice ended to prof_sample, which counts the interrupted EIP in a
+ * histogram of PROF_BUCKETS buckets of 1 << PROF_SHIFT bytes from
+ * address 0, where the image is linked. The kernel itself runs with
+ * interrupts disabled, so only process code is sampled.
+ */
+
+#include <xeroskernel.h>
+#include <xeroslib.h>
+
+static unsigned int hist[PROF_BUCKETS];
+// Samples taken and samples of addresses past the last bucket
+static unsigned int samples, outside;
+static Bool running;
+
+static void prof_dump(void);
+
+/* Counts the EIP p was interrupted at */
+void prof_sample(pcb* p) {
+  unsigned int bucket;
+
+  if (!running) {
+    return;
+  }
+  samples++;
+  bucket = ((contextFrame*) p->esp)->iret_eip >> PROF_SHIFT;
+  if (bucket < PROF_BUCKETS) {
+    hist[bucket]++;
+  } else {
+    outside++;
+  }
+}
+
+/*
+ * PROF_START clears the histogram and starts sampling, PROF_STOP stops
+ * and PROF_DUMP prints the histogram to the console
+ * @return number of samples, or SYSERR for an unknown command
+ */
+int prof_control(int cmd) {
+  switch (cmd) {
+    case PROF_START:
+      memset(hist, 0, sizeof(hist));
+      samples = outside = 0;
+      running = TRUE;
+      break;
+    case PROF_STOP:
+      running = FALSE;
+      break;
+    case PROF_DUMP:
+      prof_dump();
+      break;
+    default:
+      return SYSERR;
+  }
+  return samples;
+}
+
+/* Samples counted in the bucket of addr */
+unsigned int prof_hits(unsigned int addr) {
+  return addr >> PROF_SHIFT < PROF_BUCKETS ? hist[addr >> PROF_SHIFT] : 0;
+}
+
+/*
+ * One line per bucket that has samples, between a header and an end
+ * line, in the format host/xprof reads back from the console log
+ */
+static void prof_dump(void) {
+  unsigned int i;
+
+  kprintf("PROF bucket %u samples %u outside %u\n",
+      1 << PROF_SHIFT, samples, outside);
+  for (i = 0; i < PROF_BUCKETS; i++) {
+    if (hist[i]) {
+      kprintf("PROF %x %u\n", i << PROF_SHIFT, hist[i]);
+    }
+  }
+  kprintf("PROF end\n");
+}
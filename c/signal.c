@@ -63,6 +63,7 @@ int signal(unsigned int pid, int sig_no) {
   }
 
   p = pcbTable + pcb_index;
+  trace(TR_SIGNAL, pid, sig_no);
 
   // Check if signal should be recorded for delivery
   if (p->allowed_sig & SIG_INT(sig_no)) {
@@ -72,6 +73,11 @@ int signal(unsigned int pid, int sig_no) {
     if (p->state == STOPPED) {
       abort();
     } else if (p->state > READY && p->state < WAITING) {
+      if (p->state == SENDING || p->state == RECEIVING ||
+          p->state == REPLY_BLOCKED || p->state == POLLING) {
+        msg_dequeue(p);
+      }
+      timer_cancel(&p->timer);
       ready(p);
       p->irc = -129;
     } else if (p->state == WAITING) {
@@ -0,0 +1,111 @@
+/* slab.c : object caches on top of kmalloc
+ */
+
+#include <xeroskernel.h>
+
+static int kmem_cache_grow(kmem_cache *cache);
+
+// Free list link of an object
+#define FREE_LINK(cache, obj) (*(void**) ((unsigned char*) (obj) + (cache)->link))
+
+static kmem_cache cachePool[MAX_KMEM_CACHE];
+static int numCache;
+
+/*
+ * Empties all caches, called by kmeminit since their slabs are gone,
+ * the caches themselves stay valid
+ */
+void kmem_cache_init(void) {
+  int i;
+
+  for (i = 0; i < numCache; i++) {
+    cachePool[i].free = NULL;
+    cachePool[i].slabs = 0;
+    cachePool[i].in_use = 0;
+  }
+}
+
+/*
+ * Creates a cache of objects of the given size
+ * @param name - name of the cache, for debugging
+ * @param size - object size in bytes
+ * @param ctor - called on every object of a new slab, may be NULL
+ * @return the cache or NULL if there are already MAX_KMEM_CACHE caches
+ */
+kmem_cache* kmem_cache_create(char *name, int size, void (*ctor)(void*)) {
+  kmem_cache *cache;
+
+  if (size <= 0 || numCache >= MAX_KMEM_CACHE) {
+    return NULL;
+  }
+
+  cache = cachePool + numCache++;
+  cache->name = name;
+  // The free list link overwrites the first word of a free object,
+  // unless there is a constructor whose work must not be undone
+  cache->link = 0;
+  if (ctor) {
+    cache->link = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    size = cache->link + sizeof(void*);
+  }
+  // Keep objects 16 byte aligned
+  cache->size = ((size/16) + (size%16?1:0)) * 16;
+  cache->per_slab = max(KMEM_SLAB_SIZE / cache->size, 1);
+  cache->ctor = ctor;
+  cache->free = NULL;
+  cache->slabs = 0;
+  cache->in_use = 0;
+  return cache;
+}
+
+/*
+ * Pops an object off the cache free list, allocating a new slab when empty
+ * @return the object or NULL if out of memory
+ */
+void* kmem_cache_alloc(kmem_cache *cache) {
+  void *obj;
+
+  if (!cache->free && kmem_cache_grow(cache) != OK) {
+    return NULL;
+  }
+
+  obj = cache->free;
+  cache->free = FREE_LINK(cache, obj);
+  cache->in_use++;
+  return obj;
+}
+
+/*
+ * Pushes an object back on the cache free list, objects of a cache with a
+ * constructor must be returned in their constructed state
+ */
+void kmem_cache_free(kmem_cache *cache, void *obj) {
+  FREE_LINK(cache, obj) = cache->free;
+  cache->free = obj;
+  cache->in_use--;
+}
+
+/*
+ * Allocates a slab with kmalloc and carves it into objects
+ */
+static int kmem_cache_grow(kmem_cache *cache) {
+  unsigned char *slab, *obj;
+  unsigned int i;
+
+  slab = kmalloc(cache->size * cache->per_slab);
+  if (!slab) {
+    return SYSERR;
+  }
+
+  // Push in reverse so objects are handed out in address order
+  for (i = cache->per_slab; i-- > 0;) {
+    obj = slab + i * cache->size;
+    if (cache->ctor) {
+      cache->ctor(obj);
+    }
+    FREE_LINK(cache, obj) = cache->free;
+    cache->free = obj;
+  }
+  cache->slabs++;
+  return OK;
+}
@@ -4,60 +4,37 @@
 #include <xeroskernel.h>
 
 /* Your code goes here */
-pcb *sleep_list;
+static void sleep_ticks(pcb *p, unsigned long long ticks);
+static void wakeup(void *arg);
 
 /*
- * Decrements key of head of the delta list,
- * puts all process with key == 0 on ready queue
+ * Puts a process to sleep on its timer for the given time,
+ * readies it right away for 0 ms
  */
-void tick() {
-  pcb *p;
-
-  if (sleep_list) {
-    sleep_list->delta--;
-    while (sleep_list->delta == 0) {
-      p = sleep_list;
-      p->irc = 0;
-      sleep_list = p->next;
-      ready(p);
-    }
-  }
+void sleep(pcb *p, unsigned int milliseconds) {
+  // In 64 bits, any number of milliseconds fits in ticks
+  sleep_ticks(p, (unsigned long long) milliseconds * MS_TO_TICKS(1));
 }
 
 /*
- * Insert a process into the delta list 
+ * Same for a time in microseconds, rounded up to timer ticks
  */
-void sleep(pcb *p, unsigned int milliseconds) {
-  unsigned int delta;
-  pcb** next;
+void usleep(pcb *p, unsigned int microseconds) {
+  sleep_ticks(p, US_TO_TICKS(microseconds));
+}
 
-  delta = (milliseconds/TIME_SLICE_MS) + (milliseconds%TIME_SLICE_MS?1:0);
-  if (delta) {
-    next = &sleep_list;
-    // Traverse the delta list
-    while (*next && (*next)->delta <= delta) {
-      // Adjust the delta value of the sleep process
-      delta -= (*next)->delta;
-      next = &(*next)->next;
-    }
-    p->next = *next;
-    p->delta = delta;
-    if (p->next) {
-      p->next->delta -= delta;
-    }
-    *next = p;
+static void sleep_ticks(pcb *p, unsigned long long ticks) {
+  if (ticks) {
+    timer_set(&p->timer, ticks, wakeup, p);
     p->state = SLEEPING;
   } else {
     ready(p);
   }
 }
 
-void traverseSleepList(void) {
-  pcb *pcb = sleep_list;
-  kprintf("Sleep list: ");
-  while (pcb) {
-    kprintf("P%u:%u -> ", pcb->pid, pcb->delta);
-    pcb = pcb->next;
-  }
-  kprintf("\n");
+static void wakeup(void *arg) {
+  pcb *p = arg;
+
+  p->irc = 0;
+  ready(p);
 }
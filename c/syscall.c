@@ -7,6 +7,7 @@
 /* Your code goes here */
 static unsigned int x;
 static inline void debugEsp(void);
+static inline __attribute__ ((always_inline)) int fast_syscall(int call, unsigned int arg0, unsigned int arg1, unsigned int arg2, unsigned int arg3);
 
 int syscall(int call, ...) {
   int rc;
@@ -28,12 +29,28 @@ int syscall(int call, ...) {
   return rc;
 }
 
+/*
+ * Syscall through SYSCALL_FAST, the request and arguments stay in
+ * registers, used for the most frequent requests
+ */
+static inline int fast_syscall(int call, unsigned int arg0, unsigned int arg1, unsigned int arg2, unsigned int arg3) {
+  int rc;
+
+  __asm __volatile(
+      "int $" xstr(SYSCALL_FAST) ";\n"
+      :"=a"(rc)
+      :"a"(call), "b"(arg0), "c"(arg1), "d"(arg2), "S"(arg3)
+      :"memory"
+      );
+  return rc;
+}
+
 int syscreate(void (*func)(void), int stack) {
   return syscall(CREATE, func, stack);
 }
 
 void sysyield(void) {
-  syscall(YIELD);
+  fast_syscall(YIELD, 0, 0, 0, 0);
 }
 
 void sysstop(void) {
@@ -41,11 +58,11 @@ void sysstop(void) {
 }
 
 unsigned int sysgetpid(void) {
-  return syscall(GET_PID);
+  return fast_syscall(GET_PID, 0, 0, 0, 0);
 }
 
 unsigned int sysgetppid(void) {
-  return syscall(GET_P_PID);
+  return fast_syscall(GET_P_PID, 0, 0, 0, 0);
 }
 
 void sysputs(char *str) {
@@ -53,17 +70,95 @@ void sysputs(char *str) {
 }
 
 int syssend( unsigned int dest_pid, void *buffer, int buffer_len) {
-  return syscall(SEND, dest_pid, buffer, buffer_len);
+  return fast_syscall(SEND, dest_pid, (unsigned int) buffer, buffer_len, 0);
 }
 
 int sysrecv( unsigned int *from_pid, void *buffer, int buffer_len ) {
-  return syscall(RECV, from_pid, buffer, buffer_len);
+  return fast_syscall(RECV, (unsigned int) from_pid, (unsigned int) buffer, buffer_len, 0);
+}
+
+/* Like syssend, returns TIMEOUT if no receiver took the message in time */
+int syssendtimed(unsigned int dest_pid, void *buffer, int buffer_len, unsigned int milliseconds) {
+  return fast_syscall(SEND_TIMED, dest_pid, (unsigned int) buffer, buffer_len, milliseconds);
+}
+
+/* Like sysrecv, returns TIMEOUT if no message arrived in time */
+int sysrecvtimed(unsigned int *from_pid, void *buffer, int buffer_len, unsigned int milliseconds) {
+  return fast_syscall(RECV_TIMED, (unsigned int) from_pid, (unsigned int) buffer, buffer_len, milliseconds);
+}
+
+/*
+ * Queues a message in the destination's mailbox and returns the bytes
+ * queued, a full mailbox blocks like syssend unless flags has MSG_NONBLOCK
+ */
+int sysasend(unsigned int dest_pid, void *buffer, int buffer_len, int flags) {
+  return syscall(ASEND, dest_pid, buffer, buffer_len, flags);
+}
+
+/*
+ * Sends a request like syssend, then blocks until the receiver answers
+ * with sysreply, returns the bytes of the reply or a syssend error code
+ */
+int syssendrecv(unsigned int dest_pid, void *request, int request_len, void *reply, int reply_len) {
+  return syscall(SENDRECV, dest_pid, request, request_len, reply, reply_len);
+}
+
+/*
+ * Answers a syssendrecv request received from pid, returns -1 for a
+ * negative length and the client keeps waiting
+ */
+int sysreply(unsigned int pid, void *buffer, int buffer_len) {
+  return fast_syscall(REPLY, pid, (unsigned int) buffer, buffer_len, 0);
+}
+
+/* Allocates a buffer that can be lent with syslend, NULL if out of memory */
+void *sysbufalloc(int size) {
+  return (void*) syscall(BUF_ALLOC, size);
+}
+
+/* Frees a buffer from sysbufalloc or sysrecvlent */
+int sysbuffree(void *buffer) {
+  return syscall(BUF_FREE, buffer);
+}
+
+/*
+ * Sends like syssend, but a sysrecvlent receiver gets the buffer from
+ * sysbufalloc itself without a copy and becomes its owner
+ */
+int syslend(unsigned int dest_pid, void *buffer, int buffer_len) {
+  return syscall(LEND, dest_pid, buffer, buffer_len);
+}
+
+/*
+ * Receives like sysrecv into a buffer the caller then owns and frees
+ * with sysbuffree, it is the sender's buffer if it was sent with syslend
+ */
+int sysrecvlent(unsigned int *from_pid, void **buffer) {
+  return syscall(RECV_LENT, from_pid, buffer);
+}
+
+/* Sends like syssend, gathering the message from iovcnt segments */
+int syssendv(unsigned int dest_pid, iovec *iov, int iovcnt) {
+  return syscall(SENDV, dest_pid, iov, iovcnt);
+}
+
+/* Receives like sysrecv, scattering the message over iovcnt segments */
+int sysrecvv(unsigned int *from_pid, iovec *iov, int iovcnt) {
+  return syscall(RECVV, from_pid, iov, iovcnt);
 }
 
 unsigned int syssleep(unsigned int milliseconds) {
   return syscall(SLEEP, milliseconds);
 }
 
+/*
+ * Sleeps for at least the given number of microseconds,
+ * rounded up to TIMER_RES_US
+ */
+unsigned int sysusleep(unsigned int microseconds) {
+  return syscall(USLEEP, microseconds);
+}
+
 int syssighandler(int signal, void (*newhandler)(void *), void (** oldHandler)(void *)) {
   return syscall(SIGHANDLER, signal, newhandler, oldHandler);
 }
@@ -99,6 +194,32 @@ int sysread(int fd, void *buf, int buflen) {
   return syscall(READ, fd, buf, buflen);
 }
 
+int syswritev(int fd, iovec *iov, int iovcnt) {
+  return syscall(WRITEV, fd, iov, iovcnt);
+}
+
+int sysreadv(int fd, iovec *iov, int iovcnt) {
+  return syscall(READV, fd, iov, iovcnt);
+}
+
+/*
+ * Blocks until a read of one of the POLL_FD(fd) devices or, with POLL_MSG,
+ * a sysrecv from from_pid or anyone would not block, returns the events
+ * that are ready or -1 for an invalid request
+ */
+int syspoll(unsigned int events, unsigned int from_pid) {
+  return syscall(POLL, events, from_pid);
+}
+
+/*
+ * Runs up to MAX_BATCH requests in one trap, each entry gets the return
+ * value of its request, or -1 if the request can not run in a batch
+ * Returns the number of entries, or -1 for an invalid batch
+ */
+int sysbatch(batchEntry *entries, int count) {
+  return fast_syscall(BATCH, (unsigned int) entries, count, 0, 0);
+}
+
 int sysioctl(int fd, unsigned long cmd, ...) {
   va_list ap;
   int rc;
@@ -109,6 +230,49 @@ int sysioctl(int fd, unsigned long cmd, ...) {
   return rc;
 }
 
+int syssetprio(unsigned int pid, int priority) {
+  return syscall(SET_PRIO, pid, priority);
+}
+
+int sysgetprio(unsigned int pid) {
+  return syscall(GET_PRIO, pid);
+}
+
+int sysmeminfo(memInfo *info) {
+  return syscall(MEM_INFO, info);
+}
+
+/*
+ * Copies the CPU accounting of pid, or of the caller if pid is 0, into
+ * stat. PROC_SLOT(i) names the process in PCB table slot i, so every
+ * process can be listed without knowing its PID
+ * Returns OK, or SYSERR if there is no such process
+ */
+int sysprocstat(unsigned int pid, procStat *stat) {
+  return fast_syscall(PROC_STAT, pid, (unsigned int) stat, 0, 0);
+}
+
+/*
+ * Controls the sampling profiler, PROF_START clears the histogram and
+ * starts sampling on every time slice, PROF_STOP stops and PROF_DUMP
+ * prints the histogram to the console for host/xprof
+ * Returns the number of samples, or -1 for an unknown command
+ */
+int sysprofile(int cmd) {
+  return syscall(PROFILE, cmd);
+}
+
+/*
+ * Controls the kernel event trace of a KTRACE build, TRACE_START empties
+ * the ring and records again, TRACE_STOP stops recording and TRACE_DUMP
+ * prints the ring to the console for host/xtrace
+ * Returns the number of records, or -1 for an unknown command or
+ * a kernel built without KTRACE
+ */
+int systrace(int cmd) {
+  return syscall(TRACE_CTL, cmd);
+}
+
 // Experimental function to time a context switch by calling 
 // a system call that does not do any work
 unsigned long time_int(void) {
@@ -0,0 +1,313 @@
+/* timer.c : hierarchical timing wheel and one-shot PIT
+ */
+
+#include <xeroskernel.h>
+#include <i386.h>
+
+extern void enable_irq(unsigned int, int);
+
+static void timer_insert(ktimer *t);
+static void timer_unlink(ktimer *t);
+static void cascade(int level, unsigned int index);
+static void timer_sync(void);
+static void timer_arm(void);
+static unsigned int next_slot(int level, unsigned int index);
+static unsigned int pit_read(void);
+
+// Slot s of level l holds timers expiring within TW_SIZE^l ticks of each
+// other, level 0 one slot per tick. Slots are circular lists headed by
+// an unused timer.
+static ktimer wheel[TW_LEVELS][TW_SIZE];
+// Bit s of a level is set while slot s holds timers
+static unsigned int wheelBitmap[TW_LEVELS][TW_BITMAP_WORDS];
+// Ticks since init_timers
+static unsigned int timerTicks;
+// Tick the current time slice ends on
+static unsigned int sliceEnd;
+// Set once timer_start programmed the PIT
+static Bool pitRunning;
+// PIT counter 0 at the last sync, and the tick its one-shot count ends on
+static unsigned int pitLast, pitExpires;
+// PIT counts since the last tick times TICKS_PER_SEC, a tick is TIMER_FREQ
+static unsigned int pitRemainder;
+// Set while timer_sync runs expired timers
+static Bool syncing;
+
+/* TRUE if tick a comes before tick b, across wrap around */
+static inline Bool tick_before(unsigned int a, unsigned int b) {
+  return (int) (a - b) < 0;
+}
+
+void init_timers(void) {
+  int level, index;
+
+  for (level = 0; level < TW_LEVELS; level++) {
+    for (index = 0; index < TW_SIZE; index++) {
+      wheel[level][index].prev = wheel[level][index].next = wheel[level] + index;
+    }
+    for (index = 0; index < TW_BITMAP_WORDS; index++) {
+      wheelBitmap[level][index] = 0;
+    }
+  }
+  timerTicks = 0;
+  sliceEnd = TIME_SLICE_TICKS;
+  // A running PIT keeps its one-shot, which fires and re-arms
+  pitExpires = 0;
+}
+
+/*
+ * Programs the first one-shot of the PIT and enables its interrupt
+ */
+void timer_start(void) {
+  pitRemainder = 0;
+  pitRunning = TRUE;
+  timer_arm();
+  enable_irq(TIMER_IRQ, 0);
+}
+
+/*
+ * Called on the timer interrupt, runs the timers that expired and arms
+ * the next interrupt
+ * @return TRUE if the time slice of the interrupted process ended
+ */
+Bool timer_interrupt(void) {
+  Bool slice_over;
+
+  timer_sync();
+  slice_over = !tick_before(timerTicks, sliceEnd);
+  while (!tick_before(timerTicks, sliceEnd)) {
+    sliceEnd += TIME_SLICE_TICKS;
+  }
+  timer_arm();
+  return slice_over;
+}
+
+/*
+ * Arms a timer to call callback(arg) from tick() after the given number
+ * of ticks, re-arming a pending timer moves it
+ * @param ticks - at least 1, a timer beyond TW_MAX_TICKS goes round the
+ * wheel again for the rest
+ */
+void timer_set(ktimer *t, unsigned long long ticks, void (*callback)(void*), void *arg) {
+  timer_cancel(t);
+  timer_sync();
+  // The tick that has partly gone by does not count,
+  // so a timer never fires early
+  if (pitRemainder && !syncing) {
+    ticks++;
+  }
+  ticks = max(ticks, 1);
+  t->rest = ticks - min(ticks, TW_MAX_TICKS);
+  t->expires = timerTicks + (unsigned int) (ticks - t->rest);
+  t->callback = callback;
+  t->arg = arg;
+  timer_insert(t);
+  if (pitRunning && !syncing && tick_before(t->expires, pitExpires)) {
+    timer_arm();
+  }
+}
+
+/*
+ * Disarms a timer
+ * @return TRUE if the timer was pending
+ */
+int timer_cancel(ktimer *t) {
+  if (!t->next) {
+    return FALSE;
+  }
+  timer_unlink(t);
+  return TRUE;
+}
+
+/*
+ * Ticks left before a pending timer expires, 0 if it is not pending
+ */
+unsigned long long timer_remaining(ktimer *t) {
+  return t->next ? t->expires - timerTicks + t->rest : 0;
+}
+
+/*
+ * Advances the wheel by one tick and runs every timer expiring on it
+ */
+void tick(void) {
+  ktimer *slot, *t;
+  unsigned int ticks;
+  int level;
+
+  timerTicks++;
+
+  // When a level wraps around, the next slot of the level above
+  // is spread over the levels below
+  for (level = 1; level < TW_LEVELS &&
+      !((timerTicks >> (TW_BITS * (level - 1))) & TW_MASK); level++) {
+    cascade(level, (timerTicks >> (TW_BITS * level)) & TW_MASK);
+  }
+
+  slot = wheel[0] + (timerTicks & TW_MASK);
+  while (slot->next != slot) {
+    t = slot->next;
+    timer_unlink(t);
+    if (t->rest) {
+      // Went round the whole wheel, go round again for the rest
+      ticks = min(t->rest, TW_MAX_TICKS);
+      t->rest -= ticks;
+      t->expires = timerTicks + ticks;
+      timer_insert(t);
+    } else {
+      t->callback(t->arg);
+    }
+  }
+}
+
+/*
+ * Brings the wheel up to the time the PIT counted since the last sync,
+ * running every timer expiring on the way
+ */
+static void timer_sync(void) {
+  unsigned int count, ticks;
+
+  if (!pitRunning || syncing) {
+    return;
+  }
+  // The counter keeps counting down past 0 and wraps around
+  count = pit_read();
+  pitRemainder += ((pitLast - count) & 0xffff) * TICKS_PER_SEC;
+  pitLast = count;
+  ticks = pitRemainder / TIMER_FREQ;
+  pitRemainder -= ticks * TIMER_FREQ;
+
+  // Expired timers may set timers of their own
+  syncing = TRUE;
+  while (ticks--) {
+    tick();
+  }
+  syncing = FALSE;
+}
+
+/*
+ * Programs the PIT one-shot for the end of the time slice, the next timer
+ * on level 0, or the wrap around of level 0 if it cascades timers from
+ * the levels above, whichever comes first. Only called right after
+ * timer_sync
+ */
+static void timer_arm(void) {
+  unsigned int deadline, wrap, index, t, count;
+
+  // No further than the longest one-shot
+  deadline = timerTicks + PIT_MAX_COUNT * TICKS_PER_SEC / TIMER_FREQ;
+  if (tick_before(sliceEnd, deadline)) {
+    deadline = sliceEnd;
+  }
+  // The first wrap onto an occupied slot of level 1, or onto slot 0
+  // which cascades level 2
+  wrap = (timerTicks | TW_MASK) + 1;
+  index = (wrap >> TW_BITS) & TW_MASK;
+  wrap += min(next_slot(1, index), -index & TW_MASK) << TW_BITS;
+  if (tick_before(wrap, deadline)) {
+    deadline = wrap;
+  }
+  // A timer on level 0 expires within a wrap around
+  index = next_slot(0, (timerTicks + 1) & TW_MASK);
+  t = timerTicks + 1 + index;
+  if (index < TW_SIZE && tick_before(t, deadline)) {
+    deadline = t;
+  }
+
+  // The slice may have ended since the last interrupt
+  if (tick_before(timerTicks, deadline)) {
+    count = ((deadline - timerTicks) * TIMER_FREQ - pitRemainder +
+        TICKS_PER_SEC - 1) / TICKS_PER_SEC;
+  } else {
+    count = PIT_MIN_COUNT;
+  }
+  count = max(count, PIT_MIN_COUNT);
+  count = min(count, PIT_MAX_COUNT);
+
+  outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+  outb(TIMER_CNTR0, count & 0xff);
+  outb(TIMER_CNTR0, count >> 8);
+  pitLast = count;
+  pitExpires = timerTicks + (pitRemainder + count * TICKS_PER_SEC) / TIMER_FREQ;
+}
+
+/*
+ * Slots from index on, going round, to the first occupied slot of a level
+ * @return TW_SIZE if the level is empty
+ */
+static unsigned int next_slot(int level, unsigned int index) {
+  unsigned int word, bits;
+  int i;
+
+  // The word holding index comes round again for the slots below it
+  for (i = 0; i <= TW_BITMAP_WORDS; i++) {
+    word = ((index >> 5) + i) % TW_BITMAP_WORDS;
+    bits = wheelBitmap[level][word];
+    if (!i) {
+      bits &= ~0u << (index & 31);
+    } else if (i == TW_BITMAP_WORDS) {
+      bits &= ~(~0u << (index & 31));
+    }
+    if (bits) {
+      return ((word << 5) + bit_scan_forward(bits) - index) & TW_MASK;
+    }
+  }
+  return TW_SIZE;
+}
+
+/* Latches and reads PIT counter 0 */
+static unsigned int pit_read(void) {
+  unsigned int lo;
+
+  outb(TIMER_MODE, TIMER_SEL0 | TIMER_LATCH);
+  lo = inb(TIMER_CNTR0);
+  return lo | inb(TIMER_CNTR0) << 8;
+}
+
+/*
+ * Appends a timer to the slot of its expiry tick, on the lowest level
+ * whose range covers it
+ */
+static void timer_insert(ktimer *t) {
+  unsigned int ticks, index;
+  ktimer *slot;
+  int level;
+
+  ticks = t->expires - timerTicks;
+  for (level = 0; level < TW_LEVELS - 1 &&
+      ticks >= (1u << (TW_BITS * (level + 1))); level++);
+  index = (t->expires >> (TW_BITS * level)) & TW_MASK;
+  slot = wheel[level] + index;
+  wheelBitmap[level][index >> 5] |= 1u << (index & 31);
+
+  t->next = slot;
+  t->prev = slot->prev;
+  slot->prev->next = t;
+  slot->prev = t;
+}
+
+static void timer_unlink(ktimer *t) {
+  unsigned int slot;
+
+  // Only the head is left on a slot that emptied
+  if (t->prev == t->next) {
+    slot = t->next - wheel[0];
+    wheelBitmap[slot >> TW_BITS][(slot & TW_MASK) >> 5] &= ~(1u << (slot & 31));
+  }
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+}
+
+/*
+ * Reinserts all timers of a slot, they now fit on a lower level
+ */
+static void cascade(int level, unsigned int index) {
+  ktimer *slot, *t;
+
+  slot = wheel[level] + index;
+  while (slot->next != slot) {
+    t = slot->next;
+    timer_unlink(t);
+    timer_insert(t);
+  }
+}
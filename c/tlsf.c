@@ -0,0 +1,232 @@
+/* tlsf.c : two level segregated fit allocator
+ */
+
+#include <xeroskernel.h>
+
+// Free list links, kept in the data area of a free block
+typedef struct _tlsfLinks {
+  tlsfBlock *prev;
+  tlsfBlock *next;
+} tlsfLinks;
+#define LINKS(block) ((tlsfLinks*) (block)->dataStart)
+#define NEXT_PHYS(block) ((tlsfBlock*) ((block)->dataStart + (block)->size))
+
+static void mapping_insert(unsigned long size, int *fl, int *sl);
+static tlsfBlock* search_suitable(tlsfPool *pool, unsigned long size);
+static void insert_block(tlsfPool *pool, tlsfBlock *block);
+static void remove_block(tlsfPool *pool, tlsfBlock *block);
+
+/*
+ * Empties all free lists of a pool
+ */
+void tlsf_init(tlsfPool *pool) {
+  int i, j;
+
+  pool->flBitmap = 0;
+  for (i = 0; i < TLSF_FL_COUNT; i++) {
+    pool->slBitmap[i] = 0;
+    for (j = 0; j < TLSF_SL_COUNT; j++) {
+      pool->blocks[i][j] = NULL;
+    }
+  }
+}
+
+/*
+ * Gives the memory in [start, end) to a pool
+ * @return OK, or SYSERR if the region is too small or too large
+ */
+int tlsf_add_region(tlsfPool *pool, void *start, void *end) {
+  tlsfBlock *block, *sentinel;
+  long size;
+
+  // Align start up and end down to 16 bytes
+  start = (void*) ((((unsigned long) start)/16 + (((unsigned long) start)%16?1:0)) * 16);
+  end = (void*) ((((unsigned long) end)/16) * 16);
+  size = end - start - 2*sizeof(tlsfBlock);
+  if (size < (long) sizeof(tlsfLinks) || size >= (1 << TLSF_FL_MAX_LOG2)) {
+    return SYSERR;
+  }
+
+  block = (tlsfBlock*) start;
+  block->prevPhys = NULL;
+  block->size = size;
+
+  // Zero sized allocated block at the end, never coalesced
+  sentinel = NEXT_PHYS(block);
+  sentinel->prevPhys = block;
+  sentinel->size = 0;
+  sentinel->sanityCheck = NULL;
+  sentinel->isFree = FALSE;
+
+  insert_block(pool, block);
+  return OK;
+}
+
+void *tlsf_malloc(tlsfPool *pool, int size) {
+  tlsfBlock *block, *rest;
+  unsigned long amount;
+
+  if (size <= 0) {
+    return NULL;
+  }
+  amount = ((size/16) + (size%16?1:0)) * 16;
+
+  block = search_suitable(pool, amount);
+  if (!block) {
+    return NULL;
+  }
+  remove_block(pool, block);
+
+  // Split off the remainder if it can hold a free block
+  if (block->size >= amount + sizeof(tlsfBlock) + sizeof(tlsfLinks)) {
+    rest = (tlsfBlock*) (block->dataStart + amount);
+    rest->prevPhys = block;
+    rest->size = block->size - amount - sizeof(tlsfBlock);
+    NEXT_PHYS(rest)->prevPhys = rest;
+    block->size = amount;
+    insert_block(pool, rest);
+  }
+
+  block->isFree = FALSE;
+  block->sanityCheck = (char*) block->dataStart;
+  return block->dataStart;
+}
+
+void tlsf_free(tlsfPool *pool, void *ptr) {
+  tlsfBlock *block, *neighbour;
+
+  block = (tlsfBlock*) (ptr - sizeof(tlsfBlock));
+
+  // Validate sanity check
+  if (block->sanityCheck != (char*) block->dataStart) {
+    return;
+  }
+  block->sanityCheck = NULL;
+
+  // Coalesce with the block at lower address
+  neighbour = block->prevPhys;
+  if (neighbour && neighbour->isFree) {
+    remove_block(pool, neighbour);
+    neighbour->size += block->size + sizeof(tlsfBlock);
+    block = neighbour;
+    NEXT_PHYS(block)->prevPhys = block;
+  }
+
+  // Coalesce with the block at higher address
+  neighbour = NEXT_PHYS(block);
+  if (neighbour->isFree) {
+    remove_block(pool, neighbour);
+    block->size += neighbour->size + sizeof(tlsfBlock);
+    NEXT_PHYS(block)->prevPhys = block;
+  }
+
+  insert_block(pool, block);
+}
+
+/*
+ * Number of free blocks on all lists of a pool
+ */
+unsigned int tlsf_free_blocks(tlsfPool *pool) {
+  tlsfBlock *block;
+  unsigned int count;
+  int i, j;
+
+  count = 0;
+  for (i = 0; i < TLSF_FL_COUNT; i++) {
+    for (j = 0; j < TLSF_SL_COUNT; j++) {
+      for (block = pool->blocks[i][j]; block; block = LINKS(block)->next) {
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+/*
+ * First and second level index of the list holding blocks of a size
+ */
+static void mapping_insert(unsigned long size, int *fl, int *sl) {
+  int t;
+
+  if (size < TLSF_SMALL_BLOCK) {
+    *fl = 0;
+    *sl = size >> 4;
+  } else {
+    t = bit_scan_reverse(size);
+    *sl = (size >> (t - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    *fl = t - TLSF_FL_SHIFT + 1;
+  }
+}
+
+/*
+ * Finds a free block of at least size bytes, size is rounded up to the next
+ * list boundary so any block of the list found is large enough
+ */
+static tlsfBlock* search_suitable(tlsfPool *pool, unsigned long size) {
+  unsigned int map;
+  int fl, sl;
+
+  if (size >= TLSF_SMALL_BLOCK) {
+    size += (1 << (bit_scan_reverse(size) - TLSF_SL_LOG2)) - 1;
+  }
+  mapping_insert(size, &fl, &sl);
+  if (fl >= TLSF_FL_COUNT) {
+    return NULL;
+  }
+
+  map = pool->slBitmap[fl] & (~0u << sl);
+  if (!map) {
+    // Nothing left on this level, take the smallest list of a larger level
+    map = pool->flBitmap & (~0u << (fl + 1));
+    if (!map) {
+      return NULL;
+    }
+    fl = bit_scan_forward(map);
+    map = pool->slBitmap[fl];
+  }
+  sl = bit_scan_forward(map);
+  return pool->blocks[fl][sl];
+}
+
+/*
+ * Marks a block free and pushes it to the head of its list
+ */
+static void insert_block(tlsfPool *pool, tlsfBlock *block) {
+  int fl, sl;
+
+  mapping_insert(block->size, &fl, &sl);
+  block->isFree = TRUE;
+  block->sanityCheck = NULL;
+  LINKS(block)->prev = NULL;
+  LINKS(block)->next = pool->blocks[fl][sl];
+  if (pool->blocks[fl][sl]) {
+    LINKS(pool->blocks[fl][sl])->prev = block;
+  }
+  pool->blocks[fl][sl] = block;
+  pool->flBitmap |= 1 << fl;
+  pool->slBitmap[fl] |= 1 << sl;
+}
+
+/*
+ * Unlinks a free block from its list
+ */
+static void remove_block(tlsfPool *pool, tlsfBlock *block) {
+  int fl, sl;
+
+  mapping_insert(block->size, &fl, &sl);
+  if (LINKS(block)->prev) {
+    LINKS(LINKS(block)->prev)->next = LINKS(block)->next;
+  } else {
+    pool->blocks[fl][sl] = LINKS(block)->next;
+    if (!pool->blocks[fl][sl]) {
+      pool->slBitmap[fl] &= ~(1 << sl);
+      if (!pool->slBitmap[fl]) {
+        pool->flBitmap &= ~(1 << fl);
+      }
+    }
+  }
+  if (LINKS(block)->next) {
+    LINKS(LINKS(block)->next)->prev = LINKS(block)->prev;
+  }
+  block->isFree = FALSE;
+}
@@ -0,0 +1,92 @@
+/* trace.c : kernel event trace
+ *
+ * Built with KTRACE, the trace() calls in the kernel record timestamped
+ * events in a ring of TRACE_SIZE records that always holds the latest
+ * ones. systrace(TRACE_DUMP) prints the ring to the console, where
+ * host/xtrace decodes it. Without KTRACE the calls compile to nothing.
+ */
+
+#include <xeroskernel.h>
+
+#if KTRACE
+
+static traceRec ring[TRACE_SIZE];
+// Records ever reserved, the next one goes to slot head % TRACE_SIZE
+static unsigned int head;
+static Bool tracing = TRUE;
+
+static void trace_dump(void);
+
+/*
+ * The dispatcher runs with interrupts disabled, but kmalloc and kfree
+ * also run in processes, so the slot is reserved with a single xadd
+ * that an interrupt recording its own event can not split
+ */
+void trace_event(unsigned int event, unsigned int arg0, unsigned int arg1) {
+  traceRec *rec;
+  unsigned int slot;
+
+  if (!tracing) {
+    return;
+  }
+  slot = 1;
+  asm volatile("xaddl %0, %1;\n" : "+r"(slot), "+m"(head));
+  rec = ring + (slot & (TRACE_SIZE - 1));
+  rec->tsc = read_tsc();
+  rec->event = event;
+  rec->arg0 = arg0;
+  rec->arg1 = arg1;
+}
+
+/*
+ * TRACE_START empties the ring and records again, TRACE_STOP keeps the
+ * ring as it is and TRACE_DUMP prints it
+ * @return number of records in the ring, or SYSERR for an unknown command
+ */
+int trace_control(int cmd) {
+  switch (cmd) {
+    case TRACE_START:
+      head = 0;
+      tracing = TRUE;
+      break;
+    case TRACE_STOP:
+      tracing = FALSE;
+      break;
+    case TRACE_DUMP:
+      trace_dump();
+      break;
+    default:
+      return SYSERR;
+  }
+  return min(head, TRACE_SIZE);
+}
+
+/*
+ * Oldest record first, one line each between a header and an end line,
+ * with the time stamp split in its high and low words
+ */
+static void trace_dump(void) {
+  traceRec *rec;
+  unsigned int i;
+  Bool was_tracing;
+
+  was_tracing = tracing;
+  tracing = FALSE;
+  kprintf("TRACE records %u lost %u\n", min(head, TRACE_SIZE),
+      head > TRACE_SIZE ? head - TRACE_SIZE : 0);
+  for (i = head > TRACE_SIZE ? head - TRACE_SIZE : 0; i != head; i++) {
+    rec = ring + (i & (TRACE_SIZE - 1));
+    kprintf("TRACE %x %x %u %x %x\n", (unsigned int) (rec->tsc >> 32),
+        (unsigned int) rec->tsc, rec->event, rec->arg0, rec->arg1);
+  }
+  kprintf("TRACE end\n");
+  tracing = was_tracing;
+}
+
+#else
+
+int trace_control(int cmd) {
+  return SYSERR;
+}
+
+#endif
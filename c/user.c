@@ -8,7 +8,7 @@
 
 #define NUM_CHILDREN 4
 #define STR_SIZE 0x100
-#define STACK_SIZE 0x2000
+#define STACK_SIZE DEFAULT_STACK_SIZE
 #define puts(F, ...) \
   c = kmalloc(STR_SIZE); \
 sprintf(c, F, ##__VA_ARGS__); \
@@ -156,3 +156,58 @@ void root() {
 
 }
 
+
+/* Per cent of total, in 32 bits, both are cycles of one refresh period */
+static unsigned int percent(unsigned long long part, unsigned long long total) {
+  unsigned int t;
+
+  t = (unsigned int) (total >> 10);
+  return t ? (unsigned int) (part >> 10) * 100 / t : 0;
+}
+
+static char *state_str[] = {
+  "STOPPED", "RUNNING", "READY", "SENDING", "RECEIVING", "SLEEPING",
+  "READING", "WRITING", "REPLY", "POLLING", "WAITING"
+};
+
+/*
+ * Lists every process every TOP_INTERVAL_MS, with the share of the
+ * period it spent running and waiting on the ready queue, its time
+ * slices, voluntary and involuntary switches and syscalls so far
+ */
+void top(void) {
+  static unsigned int lastPid[MAX_NUM_PROCESS];
+  static unsigned long long lastCycles[MAX_NUM_PROCESS];
+  static unsigned long long lastWait[MAX_NUM_PROCESS];
+  unsigned long long now, last, cycles, wait;
+  procStat stat;
+  int i;
+  char *c;
+
+  last = read_tsc();
+  for (;;) {
+    syssleep(TOP_INTERVAL_MS);
+    now = read_tsc();
+    puts("%6s %6s %-9s %3s %4s %5s %8s %8s %8s %8s\n", "PID", "PPID",
+        "STATE", "PRI", "%CPU", "%WAIT", "TICKS", "VOL", "INVOL", "SYSCALLS");
+    for (i = 0; i < MAX_NUM_PROCESS; i++) {
+      if (sysprocstat(PROC_SLOT(i), &stat) != OK) {
+        continue;
+      }
+      // Count a process created during the period from zero
+      if (stat.pid != lastPid[i]) {
+        lastPid[i] = stat.pid;
+        lastCycles[i] = lastWait[i] = 0;
+      }
+      cycles = stat.cycles - lastCycles[i];
+      wait = stat.wait_cycles - lastWait[i];
+      lastCycles[i] = stat.cycles;
+      lastWait[i] = stat.wait_cycles;
+      puts("%6u %6u %-9s %3d %4u %5u %8u %8u %8u %8u\n", stat.pid,
+          stat.parentPid, state_str[stat.state], stat.priority,
+          percent(cycles, now - last), percent(wait, now - last), stat.ticks,
+          stat.voluntary, stat.involuntary, stat.syscalls);
+    }
+    last = now;
+  }
+}
@@ -3,7 +3,13 @@
 #define EOF_IN_BUF  2
 typedef struct _proc_state {
   pcb* pcb;
-  unsigned char *buf;
+  // Segments of the read request, one holds a plain read's buffer
+  iovec *iov;
+  iovec one;
+  // Segment and offset the next character goes to
+  int seg;
+  int seg_off;
+  // Total length of the request and characters read
   int buf_len;
   int ch_read;
   int eof;
@@ -17,6 +23,9 @@ int keyboard_close(pcb* p);
 int keyboard_ioclt(pcb* p, unsigned long cmd, ...);
 int keyboard_write(pcb* p, void* buf, int buf_len);
 int keyboard_read(pcb* p, void* buf, int buf_len);
+int keyboard_writev(pcb* p, iovec* iov, int iovcnt);
+int keyboard_readv(pcb* p, iovec* iov, int iovcnt);
+int keyboard_poll(pcb* p);
 void keyboard_lower(void);
 void _KeyboardISREntryPoint(void);
 
@@ -22,11 +22,23 @@ typedef	char		Bool;		/* Boolean type			*/
 
 // Kernel global defines
 #define SYSCALL 80
+// Syscalls with the request in EAX and up to FAST_ARGS arguments
+// in EBX, ECX, EDX and ESI
+#define SYSCALL_FAST 81
+#define FAST_ARGS 4
 #define xstr(exp) str(exp)
 #define str(exp) #exp
 #define MAX_NUM_PROCESS 256
+// PID is (generation << PID_INDEX_BITS | PCB table index)
+#define PID_INDEX_BITS 8
+#define PID_INDEX(pid) ((pid) & ((1 << PID_INDEX_BITS) - 1))
+// A PID never has the top bit set, so sysprocstat takes PROC_SLOT(i)
+// for the process in PCB table slot i, whatever its PID
+#define PROC_SLOT_FLAG 0x80000000
+#define PROC_SLOT(i) (PROC_SLOT_FLAG | (i))
 #define FREEMEM_END 0x400000
 #define SAFETY_MARGIN 0x40
+#define DEFAULT_STACK_SIZE 0x2000
 #define NUM_SIGNAL 32
 #define NUM_FD 4
 #define KEYBOARD_0 0
@@ -38,14 +50,76 @@ typedef	char		Bool;		/* Boolean type			*/
 #define SYS_SR_SELF -2
 #define SYS_SR_ERR -3
 
+// syspoll events, POLL_FD(fd) for each file descriptor
+#define POLL_FD(fd) (1 << (fd))
+#define POLL_MSG (1 << NUM_FD)
+
 // Driver to DII return codes
 #define DRV_DONE   0
 #define DRV_BLOCK  1
 #define DRV_ERROR -1
 
-// System timer init params
+// Scheduler priority levels, 0 is the highest
+// the lowest level is reserved for the idle process
+#define NUM_PRIORITY 4
+#define IDLE_PRIORITY (NUM_PRIORITY - 1)
+#define DEFAULT_PRIORITY 0
+
+// Scheduling policy, selected at build time
+#define SCHED_RR 0
+#define SCHED_MLFQ 1
+#define SCHEDULER SCHED_RR
+// MLFQ time quantum of a level, in time slices
+#define MLFQ_QUANTUM(level) (1 << (level))
+// Time slices between moving every process back to the top level
+#define MLFQ_BOOST_TICKS 100
+
+// Most segments of a vectored request
+#define MAX_IOV 16
+#define INT_MAX 0x7fffffff
+
+// Most entries of a sysbatch request
+#define MAX_BATCH 64
+
+// Sampling profiler histogram, PROF_BUCKETS buckets of 1 << PROF_SHIFT
+// bytes from address 0, enough for the text of the image
+#define PROF_SHIFT 4
+#define PROF_BUCKETS 8192
+// sysprofile commands
+#define PROF_START 0
+#define PROF_STOP 1
+#define PROF_DUMP 2
+
+// Mailboxes, ring of MBOX_SLOTS messages of up to MBOX_MSG_SIZE bytes
+#define MBOX_SLOTS 16
+#define MBOX_MSG_SIZE 64
+// sysasend flags, return BLOCKERR instead of blocking on a full mailbox
+#define MSG_NONBLOCK 1
+
+// Scheduling quantum, a process is preempted at the end of a time slice
 #define TIME_SLICE_MS 10
-#define TIME_SLICE_DIV (1000/TIME_SLICE_MS)
+// Resolution of sleeps, timeouts and kernel timers, one timer tick.
+// There is no periodic interrupt, the PIT is programmed in one-shot mode
+// for the end of the time slice or the next timer, whichever comes first.
+// Must divide 1000 and be at least 20
+#define TIMER_RES_US 100
+#define TICKS_PER_SEC (1000000 / TIMER_RES_US)
+#define MS_TO_TICKS(ms) ((ms) * (1000 / TIMER_RES_US))
+#define US_TO_TICKS(us) (((us) / TIMER_RES_US) + ((us) % TIMER_RES_US ? 1 : 0))
+#define TIME_SLICE_TICKS MS_TO_TICKS(TIME_SLICE_MS)
+// Longest one-shot count, leaves room to count the interrupt latency
+// before the PIT counter wraps, and shortest one
+#define PIT_MAX_COUNT 0x8000
+#define PIT_MIN_COUNT 16
+
+// Timing wheel, TW_LEVELS levels of TW_SIZE slots
+#define TW_BITS 7
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+#define TW_MAX_TICKS ((1u << (TW_BITS * TW_LEVELS)) - 1)
+// Words of the occupancy bitmap of a level
+#define TW_BITMAP_WORDS ((TW_SIZE + 31) / 32)
 
 // debug print toggle
 #define DEBUG 0
@@ -55,10 +129,45 @@ typedef	char		Bool;		/* Boolean type			*/
 #define dprintf(...)
 #endif
 
-// test toggle
+// test toggle, can also be set from the make command line
+#ifndef RUNTEST
 #define RUNTEST 0
+#endif
 #define TEST_VERBOSE 1
 
+// Benchmark toggle, runs the latency benchmarks in c/bench.c instead of
+// the root process, can also be set from the make command line
+#ifndef RUNBENCH
+#define RUNBENCH 0
+#endif
+
+// Kernel event trace toggle, records switches, syscalls, interrupts and
+// more in a ring printed by systrace(TRACE_DUMP) for host/xtrace,
+// can also be set from the make command line
+#ifndef KTRACE
+#define KTRACE 0
+#endif
+// Records in the trace ring, a power of 2
+#define TRACE_SIZE 4096
+// systrace commands
+#define TRACE_START 0
+#define TRACE_STOP 1
+#define TRACE_DUMP 2
+
+// Start the top process next to the root process
+#define TOP_PROCESS 0
+// Refresh period of the top process
+#define TOP_INTERVAL_MS 2000
+
+// Console toggle, also write kernel output to COM1 for headless runs
+#define SERIAL_CONSOLE 1
+
+// Test result written to the QEMU isa-debug-exit port,
+// QEMU then exits with status (code << 1) | 1
+#define DEBUG_EXIT_PORT 0xf4
+#define EXIT_PASS 0
+#define EXIT_FAIL 1
+
 // max/min
 #define max(a,b) \
    ({ __typeof__ (a) _a = (a); \
@@ -72,6 +181,18 @@ typedef	char		Bool;		/* Boolean type			*/
 // Signal number to integer with bit at position signo set
 #define SIG_INT(sig) (1 << sig)
 
+// Index of the least/most significant set bit, x must not be 0
+static inline int bit_scan_forward(unsigned int x) {
+  int pos;
+  asm("bsfl %1, %0;\n" : "=r"(pos) : "rm"(x));
+  return pos;
+}
+static inline int bit_scan_reverse(unsigned int x) {
+  int pos;
+  asm("bsrl %1, %0;\n" : "=r"(pos) : "rm"(x));
+  return pos;
+}
+
 /* Test functions and macro */
 #if TEST_VERBOSE
 #define test_print(...) kprintf(__VA_ARGS__)
@@ -85,11 +206,13 @@ typedef	char		Bool;		/* Boolean type			*/
 #define assertEquals(A, E); \
   if (E != A) {\
     kprintf("%s(%u): Assertion failed: actual 0x%x mismatch expected 0x%x\n", __func__, __LINE__, A, E);\
+    debug_exit(EXIT_FAIL);\
     for(;;);\
   }
 #define assert(C); \
   if (!(C)) {\
     kprintf("%s(%u): Assertion failed: (%s) not true\n", __func__, __LINE__, xstr(C));\
+    debug_exit(EXIT_FAIL);\
     for(;;);\
   }
 #define where(); \
@@ -98,30 +221,230 @@ typedef	char		Bool;		/* Boolean type			*/
 
 
 
-// Memory block header
+// Memory block header, blocks of a region follow each other in memory
 typedef struct _memHeader {
  // Size of the usable memory of this node
   unsigned long size;
- // Free node with the highest address that is lower than this
-  struct _memHeader *prev;
- // Free node with the lowest address that is higher than this
-  struct _memHeader *next;
+ // Size of the block right below this one, 0 for the first block of a region
+  unsigned long prevSize;
+ // MEM_FREE and MEM_LAST
+  unsigned long flags;
  // Should be the same as dataStart when this node is allocated
   char *sanityCheck;
   unsigned char dataStart[0];
 } memHeader;
+#define MEM_FREE 0x1
+// No block follows this one in its region
+#define MEM_LAST 0x2
+
+
+// kmalloc size classes, class i holds free blocks of [16 << i, 16 << (i+1))
+// bytes and the last class every larger block. Small requests are rounded up
+// to a power of two and served from the size class lists, larger ones first
+// fit from their own class, then from any larger class.
+#define NUM_SIZE_CLASS 8
+#define LARGE_CLASS (NUM_SIZE_CLASS - 1)
+#define KMALLOC_SMALL_MAX (16 << (LARGE_CLASS - 1))
+
+// Per size class kmalloc counters, a miss had to split a block of a larger class
+typedef struct _sizeClassStats {
+  unsigned int hits;
+  unsigned int misses;
+} sizeClassStats;
+
+
+// Buddy page allocator, blocks are 1 << order pages
+#define BUDDY_NUM_ORDER 11
+
+// Fragmentation report of the page allocator
+typedef struct _memInfo {
+  unsigned int freePages;
+  // Size in bytes of the largest free block
+  unsigned int largestFree;
+  // Pages taken by kmalloc for blocks of at most KMALLOC_PAGE_MIN bytes
+  unsigned int heapPages;
+  // Number of free blocks of each order
+  unsigned int freeBlocks[BUDDY_NUM_ORDER];
+} memInfo;
+
+// Accounting of a process, filled in by sysprocstat
+typedef struct _procStat {
+  unsigned int pid;
+  unsigned int parentPid;
+  // PCB state and priority level
+  int state;
+  int priority;
+  // TSC cycles spent running and waiting on the ready queue
+  unsigned long long cycles;
+  unsigned long long wait_cycles;
+  // Time slices that ended while the process was running
+  unsigned int ticks;
+  // Switches away from the process after one of its syscalls,
+  // and when its time slice ended
+  unsigned int voluntary;
+  unsigned int involuntary;
+  unsigned int syscalls;
+} procStat;
+
+// kmalloc requests larger than half a page get pages of their own, smaller
+// ones come from heap chunks of KMALLOC_CHUNK_PAGES pages
+#define KMALLOC_PAGE_MIN 2048
+#define KMALLOC_CHUNK_PAGES 16
+
+// kmalloc backend, selected at build time
+#define KMALLOC_SEGFIT 0
+#define KMALLOC_TLSF 1
+#define KMALLOC_BACKEND KMALLOC_SEGFIT
+
+// TLSF block header, blocks of a region are contiguous and the region ends
+// with an allocated block of size 0 so that every block has a next block
+typedef struct _tlsfBlock {
+  // Block right before this one in memory, NULL for the first of a region
+  struct _tlsfBlock *prevPhys;
+  // Size of the usable memory of this block
+  unsigned long size;
+  // Same as dataStart when this block is allocated
+  char *sanityCheck;
+  unsigned long isFree;
+  unsigned char dataStart[0];
+} tlsfBlock;
+
+// TLSF free lists, first level i > 0 holds blocks of [1 << (i+7), 1 << (i+8))
+// bytes split into TLSF_SL_COUNT second level lists of equal range, level 0
+// holds blocks smaller than TLSF_SMALL_BLOCK in steps of 16 bytes
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 4)
+#define TLSF_SMALL_BLOCK (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_MAX_LOG2 22
+#define TLSF_FL_COUNT (TLSF_FL_MAX_LOG2 - TLSF_FL_SHIFT + 1)
+typedef struct _tlsfPool {
+  unsigned int flBitmap;
+  unsigned int slBitmap[TLSF_FL_COUNT];
+  tlsfBlock *blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} tlsfPool;
+
+
+// Object caches, objects are carved out of slabs of about KMEM_SLAB_SIZE bytes
+#define MAX_KMEM_CACHE 8
+#define KMEM_SLAB_SIZE 4096
+typedef struct _kmem_cache {
+  char *name;
+  // Object size and number of objects per slab
+  unsigned int size;
+  unsigned int per_slab;
+  // Offset of the free list link in a free object
+  unsigned int link;
+  // Called on every object when its slab is allocated
+  void (*ctor)(void*);
+  // Free objects, linked through the word at offset link
+  void *free;
+  unsigned int slabs;
+  unsigned int in_use;
+} kmem_cache;
 
 
 /* Deivce independent interface struct*/
 typedef struct _pcb pcb;
+
+/* PCB queue, linked through next */
+typedef struct _pcbQueue {
+  pcb *head, *tail;
+} pcbQueue;
+
+/* Segment of a vectored message or device request */
+typedef struct _iovec {
+  void *base;
+  int len;
+} iovec;
+
 typedef struct _devsw {
   int (*dvopen)(pcb*);
   int (*dvclose)(pcb*);
   int (*dvread)(pcb*, void*, int);
   int (*dvwrite)(pcb*, void*, int);
   int (*dvioctl)(pcb*, unsigned long, ...);
+  // Vectored read and write, NULL if the driver has none
+  int (*dvreadv)(pcb*, iovec*, int);
+  int (*dvwritev)(pcb*, iovec*, int);
+  // TRUE if a read would not block, NULL if the driver can not be polled
+  int (*dvpoll)(pcb*);
 } devsw;
 
+/* Kernel timer, calls callback(arg) from tick() when it expires */
+typedef struct _ktimer {
+  // Links in a timing wheel slot, NULL if not pending
+  struct _ktimer *prev, *next;
+  unsigned int expires;
+  // Ticks left to wait once expires comes, for timers beyond TW_MAX_TICKS
+  unsigned long long rest;
+  void (*callback)(void*);
+  void *arg;
+} ktimer;
+
+/* Mailbox of asynchronous messages, allocated on the first sysasend */
+typedef struct _mboxMsg {
+  unsigned int from;
+  int len;
+  char data[MBOX_MSG_SIZE];
+} mboxMsg;
+
+typedef struct _mailbox {
+  // Oldest message and number of messages
+  unsigned int head, count;
+  mboxMsg slot[MBOX_SLOTS];
+} mailbox;
+
+/* Request of a sysbatch, the kernel fills in the result */
+typedef struct _batchEntry {
+  int request;
+  unsigned int args[FAST_ARGS];
+  int result;
+} batchEntry;
+
+/* Header of a buffer that can be lent with syslend */
+typedef struct _lentBuf {
+  // Links in the owner's list
+  struct _lentBuf *prev, *next;
+  // PID of the owning process
+  unsigned int owner;
+  // Usable bytes after the header
+  int size;
+  // Points to the data, like the segfit block header
+  void *sanityCheck;
+  // Keeps the data 16 byte aligned
+  unsigned int pad[3];
+} lentBuf;
+
+/* Kernel trace events, with the meaning of the two arguments of a record */
+typedef enum {
+  // PID switched to, PID switched from and how it trapped, 0 for a
+  // syscall, 1 for the timer and 2 for a fast syscall
+  TR_SWITCH_IN, TR_SWITCH_OUT,
+  // PID and request_type, when the dispatcher starts and finishes a request
+  TR_SYSCALL, TR_SYSRET,
+  // IRQ line and the PID the dispatcher was running, 0 if not known
+  TR_IRQ,
+  // PID put back on the ready queue and the state it was blocked in
+  TR_WAKEUP,
+  // PID and signal number posted to it
+  TR_SIGNAL,
+  // Block and requested size, block freed
+  TR_KMALLOC, TR_KFREE
+} traceEvent;
+
+typedef struct _traceRec {
+  unsigned long long tsc;
+  unsigned int event;
+  unsigned int arg0, arg1;
+} traceRec;
+
+#if KTRACE
+#define trace(event, arg0, arg1) trace_event(event, arg0, arg1)
+#else
+#define trace(event, arg0, arg1)
+#endif
+
 /* Process Control Block */
 struct _pcb {
   unsigned int pid; // Process ID
@@ -129,14 +452,38 @@ struct _pcb {
   enum {
     STOPPED = 0, RUNNING, READY,
     /* all normal blocked state */
-    SENDING, RECEIVING, SLEEPING, READING, WRITING,
+    SENDING, RECEIVING, SLEEPING, READING, WRITING, REPLY_BLOCKED, POLLING,
     /* waiting is special */
     WAITING
   } state;
   // Next process in ready/send queue
   struct _pcb *next;
-  // Head of queue of senders & receivers
-  struct _pcb *senders ,*receivers;
+  // Previous process and queue of senders, receivers or clients
+  // this process is blocked on, NULL if none
+  struct _pcb *prev;
+  pcbQueue *wait_queue;
+  // Ready queue level, see NUM_PRIORITY
+  unsigned int priority;
+  // Time slices left in the current MLFQ quantum
+  unsigned int slice_left;
+  // Queue of senders & receivers
+  pcbQueue senders, receivers;
+  // Queue of syssendrecv clients waiting for this process' reply
+  pcbQueue awaiting_reply;
+  // Queue of processes polling for a message from this process
+  pcbQueue pollers;
+  // Set while sending with syssendrecv, the transfer then blocks in REPLY_BLOCKED
+  Bool wants_reply;
+  // Set while sending with syslend, a sysrecvlent receiver gets the buffer itself
+  Bool lending;
+  // Set while receiving with sysrecvlent
+  Bool borrowing;
+  // Set while sending or receiving with syssendv or sysrecvv
+  Bool vectored;
+  // Buffers from sysbufalloc owned by this process
+  lentBuf *lent;
+  // Messages sent with sysasend, NULL until the first one
+  mailbox *mbox;
   unsigned int esp;
   // start of process stack returned by malloc
   void *stack;
@@ -144,8 +491,19 @@ struct _pcb {
   int irc;
   // Interrupt arguments pointer
   unsigned int iargs;
-  // Time slice left to be waken
-  unsigned int delta;
+  // Register arguments of a fast syscall, iargs then points here
+  unsigned int rargs[FAST_ARGS];
+  // Entries of the sysbatch being run and index of the next one,
+  // batch is NULL outside of sysbatch
+  batchEntry *batch;
+  int batch_count, batch_next;
+  // Accounting reported by sysprocstat, see procStat
+  unsigned long long cycles, wait_cycles;
+  unsigned int ticks, voluntary, involuntary, syscalls;
+  // TSC when the process last went on the ready queue
+  unsigned long long ready_since;
+  // Wakes the process up from sleep
+  ktimer timer;
   // signal handlers
   void (*sig_handler[32])(void*);
   unsigned int pending_sig;
@@ -184,20 +542,58 @@ typedef struct _signal_frame {
   unsigned int old_irc;
 } signal_frame;
 
-/* PCB queues struct and functions */
+/* Process management */
+extern int create(void (*func)(void), int stack, unsigned int parent);
+extern void cleanup(pcb*);
+extern void init_pcb_table(void);
+extern void dispatch(void);
+extern void idleproc(void);
+extern void initSyscall(void);
+extern void enableTimerInterrupt(void);
+
+/* PCB queue functions */
 extern pcb* next(void);
 extern void ready(pcb*);
+extern int setprio(pcb*, int);
+extern void init_ready_queue(void);
 
 /* Memory functions */
+extern void kmeminit(void);
 extern void* kmalloc(int);
 extern void kfree(void*);
+extern void print_kmem_stats(void);
+extern void mem_report(memInfo*);
+extern unsigned int heap_free_blocks(void);
+extern void buddy_init(void);
+extern void* alloc_pages(int npages);
+extern void* alloc_heap_pages(int npages);
+extern int free_pages(void*);
+extern void buddy_report(memInfo*);
+extern void segfit_init(void);
+extern void segfit_add_region(void *start, void *end);
+extern void* segfit_malloc(int);
+extern void segfit_free(void*);
+extern unsigned int segfit_free_blocks(void);
+extern void tlsf_init(tlsfPool*);
+extern int tlsf_add_region(tlsfPool*, void *start, void *end);
+extern void* tlsf_malloc(tlsfPool*, int);
+extern void tlsf_free(tlsfPool*, void*);
+extern unsigned int tlsf_free_blocks(tlsfPool*);
+extern void kmem_cache_init(void);
+extern kmem_cache* kmem_cache_create(char *name, int size, void (*ctor)(void*));
+extern void* kmem_cache_alloc(kmem_cache*);
+extern void kmem_cache_free(kmem_cache*, void*);
 
 /* System calls */
 typedef enum {
   TIME_INT, CREATE, YIELD, STOP, GET_PID, GET_P_PID, PUTS, SEND, RECV,
   SYS_TIMER, SLEEP, SIGHANDLER, SIGRETURN, KILL, SIGWAIT, OPEN, CLOSE,
-  WRITE, READ, IO_CTL
+  WRITE, READ, IO_CTL, SET_PRIO, GET_PRIO, MEM_INFO, SEND_TIMED, RECV_TIMED,
+  ASEND, SENDRECV, REPLY, BUF_ALLOC, BUF_FREE, LEND, RECV_LENT,
+  SENDV, RECVV, READV, WRITEV, POLL, BATCH, PROC_STAT,
+  PROFILE, TRACE_CTL, USLEEP
 } request_type;
+extern int syscall(int call, ...);
 extern int syscreate(void (*func)(void), int stack);
 extern void sysyield(void);
 extern void sysstop(void);
@@ -206,7 +602,23 @@ extern unsigned int sysgetppid(void);
 extern void sysputs(char*);
 extern int syssend( unsigned int dest_pid, void *buffer, int buffer_len);
 extern int sysrecv( unsigned int *from_pid, void *buffer, int buffer_len );
+extern int syssendtimed(unsigned int dest_pid, void *buffer, int buffer_len, unsigned int milliseconds);
+extern int sysrecvtimed(unsigned int *from_pid, void *buffer, int buffer_len, unsigned int milliseconds);
+extern int sysasend(unsigned int dest_pid, void *buffer, int buffer_len, int flags);
+extern int syssendrecv(unsigned int dest_pid, void *request, int request_len, void *reply, int reply_len);
+extern int sysreply(unsigned int pid, void *buffer, int buffer_len);
+extern void *sysbufalloc(int size);
+extern int sysbuffree(void *buffer);
+extern int syslend(unsigned int dest_pid, void *buffer, int buffer_len);
+extern int sysrecvlent(unsigned int *from_pid, void **buffer);
+extern int syssendv(unsigned int dest_pid, iovec *iov, int iovcnt);
+extern int sysrecvv(unsigned int *from_pid, iovec *iov, int iovcnt);
+extern int syswritev(int fd, iovec *iov, int iovcnt);
+extern int sysreadv(int fd, iovec *iov, int iovcnt);
+extern int syspoll(unsigned int events, unsigned int from_pid);
+extern int sysbatch(batchEntry *entries, int count);
 extern unsigned int syssleep(unsigned int milliseconds);
+extern unsigned int sysusleep(unsigned int microseconds);
 extern void syssigreturn(void *old_sp);
 extern int syssighandler(int signal, handler new_handler, handler* old_handler);
 extern int syskill(unsigned int pid, int signal);
@@ -216,32 +628,98 @@ extern int sysclose(int fd);
 extern int syswrite(int fd, void *buf, int buflen);
 extern int sysread(int fd, void *buf, int buflen);
 extern int sysioctl(int fd, unsigned long cmd, ...);
+extern int syssetprio(unsigned int pid, int priority);
+extern int sysgetprio(unsigned int pid);
+extern int sysmeminfo(memInfo *info);
+extern int sysprocstat(unsigned int pid, procStat *stat);
+extern int sysprofile(int cmd);
+extern int systrace(int cmd);
 
 /* Inter-process communications */
 extern void send(pcb* p, unsigned int dest_pid);
 extern void receive(pcb* p, unsigned int *from_pid);
+extern void send_timed(pcb* p, unsigned int dest_pid, unsigned int milliseconds);
+extern void receive_timed(pcb* p, unsigned int *from_pid, unsigned int milliseconds);
+extern void msg_dequeue(pcb* p);
+extern void mbox_release(pcb* p);
+extern void wait_queue_insert(pcbQueue* q, pcb* p);
+extern void wait_queue_remove(pcb* p);
+extern Bool msg_pending(pcb* p, unsigned int from_pid);
+extern void asend(pcb* p, unsigned int dest_pid, int flags);
+extern void sendrecv(pcb* p, unsigned int dest_pid);
+extern void reply(pcb* p, unsigned int pid);
+extern void lend(pcb* p, unsigned int dest_pid);
+extern void receive_lent(pcb* p, unsigned int *from_pid);
+extern void sendv(pcb* p, unsigned int dest_pid);
+extern void receivev(pcb* p, unsigned int *from_pid);
+
+/* Waiting on several devices and messages */
+extern void poll(pcb* p);
+extern void poll_notify(pcb* p);
+
+/* Sampling profiler */
+extern void prof_sample(pcb* p);
+extern int prof_control(int cmd);
+extern unsigned int prof_hits(unsigned int addr);
+
+/* Kernel event trace */
+extern void trace_event(unsigned int event, unsigned int arg0, unsigned int arg1);
+extern int trace_control(int cmd);
+
+/* Lent message buffers */
+extern void *lend_alloc(pcb* p, int size);
+extern int lend_owned(pcb* p, void *buf);
+extern int lend_free(pcb* p, void *buf);
+extern void lend_give(void *buf, pcb* p);
+extern void lend_release(pcb* p);
 
 /* Sleep device */
 extern void tick(void);
 extern void sleep(pcb*, unsigned int);
+extern void usleep(pcb*, unsigned int);
+extern void init_timers(void);
+extern void timer_start(void);
+extern Bool timer_interrupt(void);
+extern void timer_set(ktimer*, unsigned long long ticks, void (*callback)(void*), void *arg);
+extern int timer_cancel(ktimer*);
+extern unsigned long long timer_remaining(ktimer*);
 
 /* Misc functions */
 extern unsigned long time_int(void);
 extern void root(void);
+extern void top(void);
 extern void semaphore_root(void);
 void inline abort(void);
 extern void print_ready_q(void);
 
-/* ASL tree struct and functions */
-typedef struct _treeNode {
-  unsigned int pid;
-  unsigned int pcbIndex;
-  struct _treeNode *left, *right;
-  unsigned int height;
-} treeNode;
-void pidMapInsert(unsigned int pid, unsigned int pcbIndex);
+/* PID to PCB index map */
 int pidMapLookup(unsigned int pid, unsigned int *pcbIndex);
-void pidMapDelete(unsigned int pid);
+
+/*
+ * Total length of a vectored request, SYSERR if the count or a length is
+ * out of range or the total does not fit in an int
+ */
+static inline int iov_length(iovec *iov, int iovcnt) {
+  int i, len;
+
+  if (iovcnt < 0 || iovcnt > MAX_IOV) {
+    return SYSERR;
+  }
+  for (i = len = 0; i < iovcnt; i++) {
+    if (iov[i].len < 0 || iov[i].len > INT_MAX - len) {
+      return SYSERR;
+    }
+    len += iov[i].len;
+  }
+  return len;
+}
+
+/* Time stamp counter, for benchmarks */
+static inline unsigned long long read_tsc(void) {
+  unsigned long long tsc;
+  asm volatile("rdtsc;\n" : "=A"(tsc));
+  return tsc;
+}
 
 /* Functions defined by startup code */
 void bzero(void *base, int cnt);
@@ -252,3 +730,4 @@ void init8259(void);
 void disable(void);
 void outb(unsigned int, unsigned char);
 unsigned char inb(unsigned int);
+void debug_exit(int code);
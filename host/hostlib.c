@@ -0,0 +1,157 @@
+/* hostlib.c : runs kernel code as a Linux i386 process
+ *
+ * The kernel modules are compiled with the same flags as for the kernel
+ * image, this file provides the pieces of i386.c, kprintf.c, ctsw.c and
+ * startup.S they call, on top of Linux system calls.
+ */
+
+#include <xeroskernel.h>
+#include <xeroslib.h>
+#include <i386.h>
+#include <stdarg.h>
+
+// Linux i386 system call numbers and mmap flags
+#define SYS_EXIT 1
+#define SYS_WRITE 4
+#define SYS_MMAP 90
+#define PROT_RW 3
+#define MAP_PRIVATE_ANON 0x22
+#define MAP_FIXED_NOREPLACE 0x100000
+
+// Kernel memory is mapped at the same addresses as on the PC,
+// freemem is left unaligned like after a kernel image
+#define HOST_MEM_START 0x10000
+#define HOST_FREEMEM (HOST_MEM_START + 0x1234)
+
+#define OUT_BUF_SIZE 1024
+
+extern int host_main(void);
+void host_exit(int code);
+
+long freemem;
+static char outBuf[OUT_BUF_SIZE];
+static int outLen;
+
+static int linux_syscall(int num, int a, int b, int c) {
+  int rc;
+
+  __asm __volatile(
+      "int $0x80;\n"
+      :"=a"(rc)
+      :"a"(num), "b"(a), "c"(b), "d"(c)
+      :"memory"
+      );
+  return rc;
+}
+
+static void flush(void) {
+  if (outLen) {
+    linux_syscall(SYS_WRITE, 1, (int) outBuf, outLen);
+    outLen = 0;
+  }
+}
+
+void _start(void) {
+  unsigned int mmapArgs[6];
+
+  mmapArgs[0] = HOST_MEM_START;
+  mmapArgs[1] = FREEMEM_END - HOST_MEM_START;
+  mmapArgs[2] = PROT_RW;
+  mmapArgs[3] = MAP_PRIVATE_ANON | MAP_FIXED_NOREPLACE;
+  mmapArgs[4] = -1;
+  mmapArgs[5] = 0;
+  if (linux_syscall(SYS_MMAP, (int) mmapArgs, 0, 0) != HOST_MEM_START) {
+    kprintf("failed to map kernel memory at 0x%x\n", HOST_MEM_START);
+    host_exit(1);
+  }
+  freemem = HOST_FREEMEM;
+
+  host_exit(host_main());
+}
+
+void host_exit(int code) {
+  flush();
+  linux_syscall(SYS_EXIT, code, 0, 0);
+  for(;;);
+}
+
+void kputc(int dev, unsigned char c) {
+  outBuf[outLen++] = c;
+  if (c == '\n' || outLen == OUT_BUF_SIZE) {
+    flush();
+  }
+}
+
+int kprintf(char * fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  _doprnt(fmt, (void *) ap, kputc, 0);
+  va_end(ap);
+  return 1;
+}
+
+// Kernel assertions report their result like under QEMU
+void debug_exit(int code) {
+  host_exit(code);
+}
+
+void abort(void) {
+  kprintf("abort\n");
+  host_exit(2);
+}
+
+void _bcopy(const void *src, void *dest, unsigned int n) {
+  const unsigned char *s = src;
+  unsigned char *d = dest;
+
+  while (n--) {
+    *d++ = *s++;
+  }
+}
+
+extern unsigned short getCS(void) {
+  unsigned short cs;
+
+  __asm __volatile("movw %%cs, %0;\n" :"=r"(cs));
+  return cs;
+}
+
+// Processes never run on the host
+int contextswitch(pcb *p) {
+  kprintf("contextswitch() is not available on the host\n");
+  host_exit(1);
+  return SYSERR;
+}
+
+// No devices on the host but counter 0 of the PIT, hostPitCount is the
+// last count programmed and hostPitNow the count a latched read returns
+unsigned int hostPitCount, hostPitNow;
+static int pitByte;
+
+void outb(unsigned int port, unsigned char val) {
+  if (port == TIMER_MODE && (val & TIMER_SEL2) == TIMER_SEL0) {
+    pitByte = 0;
+  } else if (port == TIMER_CNTR0 && pitByte++ == 0) {
+    hostPitCount = val;
+  } else if (port == TIMER_CNTR0) {
+    hostPitCount |= val << 8;
+    hostPitNow = hostPitCount;
+  }
+}
+
+unsigned char inb(unsigned int port) {
+  if (port == TIMER_CNTR0) {
+    return pitByte++ == 0 ? hostPitNow & 0xff : hostPitNow >> 8;
+  }
+  return 0;
+}
+
+void end_of_intr(void) {
+}
+
+void enable_irq(unsigned int irq, int disable) {
+}
+
+void set_evec(unsigned int xnum, unsigned long handler) {
+}
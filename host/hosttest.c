@@ -0,0 +1,1222 @@
+/* hosttest.c : unit tests and benchmarks of kernel data structures
+ */
+
+#include <xeroskernel.h>
+#include <xeroslib.h>
+#include <i386.h>
+
+extern void host_exit(int code);
+extern void sleep(pcb*, unsigned int);
+extern void send(pcb*, unsigned int);
+extern void receive(pcb*, unsigned int*);
+extern pcb pcbTable[MAX_NUM_PROCESS];
+extern unsigned int hostPitCount, hostPitNow;
+
+// Assertions end the test run instead of spinning
+#undef assertEquals
+#undef assert
+#define assertEquals(A, E) \
+  if ((E) != (A)) {\
+    kprintf("%s(%u): Assertion failed: actual 0x%x mismatch expected 0x%x\n", __func__, __LINE__, A, E);\
+    host_exit(1);\
+  }
+#define assert(C) \
+  if (!(C)) {\
+    kprintf("%s(%u): Assertion failed: (%s) not true\n", __func__, __LINE__, xstr(C));\
+    host_exit(1);\
+  }
+
+#define CHURN_SEED 415
+#define CHURN_SLOTS 512
+#define CHURN_OPS 200000
+#define SEGFIT_REGION 0x100000
+#define SEGFIT_SLOTS 128
+#define SEGFIT_OPS 100000
+#define SEGFIT_MAX_SIZE 0x1000
+#define PID_ROUNDS 1000
+#define PID_STACK_SIZE 0x200
+#define SLEEP_SEED 7
+#define SLEEP_PROC 250
+#define SLEEP_MAX_MS 600000
+#define MSG_ROUNDS 10000
+#define QUEUE_SENDERS 200
+#define QUEUE_ROUNDS 100
+#define LEND_SIZE 0x2000
+#define LEND_ROUNDS 1000
+#define PROF_EIP 0x1230
+#define PROF_SAMPLES 100
+
+static void testKmallocChurn(void);
+static void testSegfit(void);
+static void testPidTable(void);
+static void testTimerWheel(void);
+static void testMessages(void);
+static void testMailbox(void);
+static void testSenderQueue(void);
+static void testRpc(void);
+static void testLending(void);
+static void testVectored(void);
+static void testPoll(void);
+static void testProfile(void);
+#if KTRACE
+static void testTrace(void);
+#endif
+static void testOneShot(void);
+
+int host_main(void) {
+  testKmallocChurn();
+  kprintf("Passed kmalloc churn test\n");
+  testSegfit();
+  kprintf("Passed segfit coalescing test\n");
+  testPidTable();
+  kprintf("Passed PID table test\n");
+  testTimerWheel();
+  kprintf("Passed timer wheel test\n");
+  testMessages();
+  kprintf("Passed message test\n");
+  testMailbox();
+  kprintf("Passed mailbox test\n");
+  testSenderQueue();
+  kprintf("Passed sender queue test\n");
+  testRpc();
+  kprintf("Passed RPC test\n");
+  testLending();
+  kprintf("Passed buffer lending test\n");
+  testVectored();
+  kprintf("Passed vectored message test\n");
+  testPoll();
+  kprintf("Passed poll test\n");
+  testProfile();
+  kprintf("Passed profiler test\n");
+#if KTRACE
+  testTrace();
+  kprintf("Passed trace test\n");
+#endif
+  // Starts the PIT model, so it runs last
+  testOneShot();
+  kprintf("Passed one-shot timer test\n");
+
+  kprintf("Passed all host tests\n");
+  return 0;
+}
+
+static void nullProc(void) {
+}
+
+/* Returns all processes on the ready queue to the PCB table */
+static void cleanupReady(void) {
+  pcb *p;
+
+  while ((p = next())) {
+    cleanup(p);
+  }
+}
+
+/*
+ * Randomized kmalloc/kfree trace, each block is tagged at both ends
+ * to catch overlapping blocks, all pages but the heap's come back at the end
+ */
+void testKmallocChurn(void) {
+  unsigned char *slots[CHURN_SLOTS];
+  int sizes[CHURN_SLOTS];
+  unsigned long start, cycles, allocMax, allocTotal, freeMax, freeTotal;
+  unsigned int i, op, numAlloc, numFree;
+  memInfo before, after;
+
+  kmeminit();
+  mem_report(&before);
+  for (i = 0; i < CHURN_SLOTS; i++) {
+    slots[i] = NULL;
+  }
+  allocMax = allocTotal = freeMax = freeTotal = 0;
+  numAlloc = numFree = 0;
+
+  srand(CHURN_SEED);
+  for (op = 0; op < CHURN_OPS; op++) {
+    i = rand() % CHURN_SLOTS;
+    if (slots[i]) {
+      assertEquals(slots[i][0], (unsigned char) i);
+      assertEquals(slots[i][sizes[i] - 1], (unsigned char) i);
+      start = (unsigned long) read_tsc();
+      kfree(slots[i]);
+      cycles = (unsigned long) read_tsc() - start;
+      slots[i] = NULL;
+      freeTotal += cycles;
+      freeMax = max(freeMax, cycles);
+      numFree++;
+    } else {
+      sizes[i] = (rand() % 16) ? rand() % 0x400 + 1 : rand() % 0x8000 + 1;
+      start = (unsigned long) read_tsc();
+      slots[i] = kmalloc(sizes[i]);
+      cycles = (unsigned long) read_tsc() - start;
+      assert(slots[i]);
+      assertEquals((unsigned int) slots[i] % 16, 0);
+      slots[i][0] = slots[i][sizes[i] - 1] = i;
+      allocTotal += cycles;
+      allocMax = max(allocMax, cycles);
+      numAlloc++;
+    }
+  }
+
+  for (i = 0; i < CHURN_SLOTS; i++) {
+    if (slots[i]) {
+      kfree(slots[i]);
+    }
+  }
+  mem_report(&after);
+  assertEquals(after.freePages + after.heapPages, before.freePages);
+
+  kprintf("kmalloc churn: kmalloc avg %u max %u cycles, kfree avg %u max %u cycles\n",
+      allocTotal / numAlloc, allocMax, freeTotal / numFree, freeMax);
+  kprintf("kmalloc churn: %u heap pages, largest free block 0x%x\n",
+      after.heapPages, after.largestFree);
+}
+
+/*
+ * Randomized segfit trace over small and large blocks in one region, the
+ * boundary tags must coalesce everything back into a single free block
+ */
+void testSegfit(void) {
+  unsigned char *region, *slots[SEGFIT_SLOTS];
+  int sizes[SEGFIT_SLOTS];
+  unsigned long start, cycles, allocTotal, freeMax, freeTotal;
+  unsigned int i, op, numAlloc, numFree;
+  memHeader *hdr;
+
+  // The region is pages, the heap of the selected backend is reset after
+  kmeminit();
+  region = kmalloc(SEGFIT_REGION);
+  assert(region);
+  segfit_init();
+  segfit_add_region(region, region + SEGFIT_REGION);
+  assertEquals(segfit_free_blocks(), 1);
+  for (i = 0; i < SEGFIT_SLOTS; i++) {
+    slots[i] = NULL;
+  }
+  allocTotal = freeMax = freeTotal = 0;
+  numAlloc = numFree = 0;
+
+  srand(CHURN_SEED);
+  for (op = 0; op < SEGFIT_OPS; op++) {
+    i = rand() % SEGFIT_SLOTS;
+    if (slots[i]) {
+      assertEquals(slots[i][0], (unsigned char) i);
+      assertEquals(slots[i][sizes[i] - 1], (unsigned char) i);
+      start = (unsigned long) read_tsc();
+      segfit_free(slots[i]);
+      cycles = (unsigned long) read_tsc() - start;
+      slots[i] = NULL;
+      freeTotal += cycles;
+      freeMax = max(freeMax, cycles);
+      numFree++;
+    } else {
+      sizes[i] = rand() % SEGFIT_MAX_SIZE + 1;
+      start = (unsigned long) read_tsc();
+      slots[i] = segfit_malloc(sizes[i]);
+      allocTotal += (unsigned long) read_tsc() - start;
+      assert(slots[i]);
+      slots[i][0] = slots[i][sizes[i] - 1] = i;
+      numAlloc++;
+    }
+  }
+
+  for (i = 0; i < SEGFIT_SLOTS; i++) {
+    if (slots[i]) {
+      segfit_free(slots[i]);
+    }
+  }
+  assertEquals(segfit_free_blocks(), 1);
+  hdr = (memHeader*) region;
+  assertEquals(hdr->flags, MEM_FREE | MEM_LAST);
+  assertEquals(hdr->size, SEGFIT_REGION - sizeof(memHeader));
+
+  // Double free is ignored
+  segfit_free(slots[0] = segfit_malloc(0x10));
+  segfit_free(slots[0]);
+  assertEquals(segfit_free_blocks(), 1);
+
+  kprintf("segfit: malloc avg %u cycles, free avg %u max %u cycles\n",
+      allocTotal / numAlloc, freeTotal / numFree, freeMax);
+  kfree(region);
+  kmeminit();
+}
+
+/*
+ * Fills and empties the PCB table, checking every PID resolves until its
+ * process is cleaned up and stays stale after its PCB is reused
+ */
+void testPidTable(void) {
+  unsigned int pids[MAX_NUM_PROCESS], oldPids[MAX_NUM_PROCESS], index;
+  unsigned long start, createCycles, lookupCycles, cleanupCycles;
+  int i, j;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  createCycles = lookupCycles = cleanupCycles = 0;
+
+  for (j = 0; j < PID_ROUNDS; j++) {
+    start = (unsigned long) read_tsc();
+    for (i = 0; i < MAX_NUM_PROCESS; i++) {
+      pids[i] = create(nullProc, PID_STACK_SIZE, 0);
+    }
+    createCycles += (unsigned long) read_tsc() - start;
+    for (i = 0; i < MAX_NUM_PROCESS; i++) {
+      assert(pids[i] != SYSERR);
+      if (j) {
+        assertEquals(pidMapLookup(oldPids[i], &index), 0);
+      }
+    }
+    assertEquals(create(nullProc, PID_STACK_SIZE, 0), SYSERR);
+
+    start = (unsigned long) read_tsc();
+    for (i = 0; i < MAX_NUM_PROCESS; i++) {
+      pidMapLookup(pids[i], &index);
+    }
+    lookupCycles += (unsigned long) read_tsc() - start;
+    for (i = 0; i < MAX_NUM_PROCESS; i++) {
+      assertEquals(pidMapLookup(pids[i], &index), OK);
+      assertEquals(index, PID_INDEX(pids[i]));
+    }
+
+    start = (unsigned long) read_tsc();
+    cleanupReady();
+    cleanupCycles += (unsigned long) read_tsc() - start;
+    for (i = 0; i < MAX_NUM_PROCESS; i++) {
+      assertEquals(pidMapLookup(pids[i], &index), 0);
+      oldPids[i] = pids[i];
+    }
+  }
+
+  kprintf("PID table: create avg %u, lookup avg %u, cleanup avg %u cycles\n",
+      createCycles / (PID_ROUNDS * MAX_NUM_PROCESS),
+      lookupCycles / (PID_ROUNDS * MAX_NUM_PROCESS),
+      cleanupCycles / (PID_ROUNDS * MAX_NUM_PROCESS));
+}
+
+/*
+ * Puts processes to sleep for random times up to several wheel levels,
+ * then ticks until all woke up, checking each one wakes up on its tick
+ */
+void testTimerWheel(void) {
+  unsigned int wakeTick[MAX_NUM_PROCESS], ms, t;
+  unsigned long start, insertCycles, tickCycles;
+  int i, pid;
+  pcb *p;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  insertCycles = tickCycles = 0;
+
+  for (i = 0; i < SLEEP_PROC; i++) {
+    pid = create(nullProc, PID_STACK_SIZE, 0);
+    assert(pid != SYSERR);
+  }
+  srand(SLEEP_SEED);
+  for (i = 0; i < SLEEP_PROC; i++) {
+    p = next();
+    ms = rand() % SLEEP_MAX_MS + 1;
+    wakeTick[p - pcbTable] = MS_TO_TICKS(ms);
+    start = (unsigned long) read_tsc();
+    sleep(p, ms);
+    insertCycles += (unsigned long) read_tsc() - start;
+    assertEquals(p->state, SLEEPING);
+  }
+  assertEquals(next(), NULL);
+
+  i = 0;
+  for (t = 1; i < SLEEP_PROC; t++) {
+    start = (unsigned long) read_tsc();
+    tick();
+    tickCycles += (unsigned long) read_tsc() - start;
+    while ((p = next())) {
+      assertEquals(wakeTick[p - pcbTable], t);
+      cleanup(p);
+      i++;
+    }
+  }
+  assertEquals(i, SLEEP_PROC);
+
+  kprintf("Timer wheel: sleep avg %u cycles with %u sleepers, tick avg %u cycles\n",
+      insertCycles / SLEEP_PROC, SLEEP_PROC, tickCycles / t);
+
+  // Milliseconds beyond 32 bits of ticks are not cut short
+  create(nullProc, PID_STACK_SIZE, 0);
+  p = next();
+  sleep(p, ~0u);
+  assert(timer_remaining(&p->timer) == (unsigned long long) ~0u * MS_TO_TICKS(1));
+  timer_cancel(&p->timer);
+
+  // Beyond the range of the wheel, a sleeper goes round it again
+  sleep(p, (TW_MAX_TICKS + TW_SIZE + 3) / MS_TO_TICKS(1));
+  wakeTick[0] = (TW_MAX_TICKS + TW_SIZE + 3) / MS_TO_TICKS(1) * MS_TO_TICKS(1);
+  for (t = 1; t < wakeTick[0]; t++) {
+    tick();
+  }
+  assertEquals(p->state, SLEEPING);
+  assert(timer_remaining(&p->timer) == 1);
+  tick();
+  assertEquals(next(), p);
+  cleanup(p);
+}
+
+/*
+ * Message rendezvous with either side blocking first
+ */
+void testMessages(void) {
+  unsigned int sendArgs[3], recvArgs[3], from;
+  char sendBuf[] = "hello", recvBuf[16];
+  unsigned long start, cycles;
+  pcb *sender, *receiver;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  create(nullProc, PID_STACK_SIZE, 0);
+  sender = next();
+  receiver = next();
+  sender->iargs = (unsigned int) sendArgs;
+  receiver->iargs = (unsigned int) recvArgs;
+
+  // Receiver blocks first, receiving from anyone
+  from = 0;
+  recvArgs[0] = (unsigned int) &from;
+  recvArgs[1] = (unsigned int) recvBuf;
+  recvArgs[2] = sizeof(recvBuf);
+  receive(receiver, &from);
+  assertEquals(receiver->state, RECEIVING);
+  sendArgs[0] = receiver->pid;
+  sendArgs[1] = (unsigned int) sendBuf;
+  sendArgs[2] = sizeof(sendBuf);
+  send(sender, receiver->pid);
+  assertEquals(receiver->irc, sizeof(sendBuf));
+  assertEquals(sender->irc, sizeof(sendBuf));
+  assertEquals(from, sender->pid);
+  assertEquals(strcmp(recvBuf, sendBuf), 0);
+  assertEquals(next(), sender);
+  assertEquals(next(), receiver);
+
+  // Sender blocks first, receiver names it
+  recvBuf[0] = 0;
+  from = sender->pid;
+  send(sender, receiver->pid);
+  assertEquals(sender->state, SENDING);
+  receive(receiver, &from);
+  assertEquals(receiver->irc, sizeof(sendBuf));
+  assertEquals(strcmp(recvBuf, sendBuf), 0);
+  assertEquals(next(), receiver);
+  assertEquals(next(), sender);
+
+  // Timed receive from the sender gives up and leaves its queue
+  from = sender->pid;
+  receive_timed(receiver, &from, 2 * TIME_SLICE_MS);
+  assertEquals(sender->receivers.head, receiver);
+  for (i = 1; i < MS_TO_TICKS(2 * TIME_SLICE_MS); i++) {
+    tick();
+  }
+  assertEquals(next(), NULL);
+  tick();
+  assertEquals(next(), receiver);
+  assertEquals(receiver->irc, TIMEOUT);
+  assertEquals(sender->receivers.head, NULL);
+
+  // Timed send taken before its timeout does not time out later
+  send_timed(sender, receiver->pid, TIME_SLICE_MS);
+  assertEquals(receiver->senders.head, sender);
+  from = 0;
+  receive(receiver, &from);
+  assertEquals(sender->irc, sizeof(sendBuf));
+  assertEquals(next(), receiver);
+  assertEquals(next(), sender);
+  for (i = 0; i < MS_TO_TICKS(TIME_SLICE_MS); i++) {
+    tick();
+  }
+  assertEquals(next(), NULL);
+
+  start = (unsigned long) read_tsc();
+  for (i = 0; i < MSG_ROUNDS; i++) {
+    from = 0;
+    receive(receiver, &from);
+    send(sender, receiver->pid);
+    next();
+    next();
+  }
+  cycles = (unsigned long) read_tsc() - start;
+  kprintf("Messages: rendezvous avg %u cycles\n", cycles / MSG_ROUNDS);
+
+  cleanup(sender);
+  cleanup(receiver);
+}
+
+/*
+ * Fills a mailbox from two senders, drains it in order, picking one sender
+ * first, then times an asend and receive pair against the rendezvous above
+ */
+void testMailbox(void) {
+  unsigned int aArgs[4], bArgs[4], recvArgs[3], from, aWord, bWord, word;
+  unsigned long start, cycles;
+  void **hog, **block, *lent;
+  mailbox *box;
+  pcb *a, *b, *receiver, *sender;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  for (i = 0; i < 3; i++) {
+    create(nullProc, PID_STACK_SIZE, 0);
+  }
+  a = next();
+  b = next();
+  receiver = next();
+  a->iargs = (unsigned int) aArgs;
+  b->iargs = (unsigned int) bArgs;
+  receiver->iargs = (unsigned int) recvArgs;
+  aArgs[0] = bArgs[0] = receiver->pid;
+  aArgs[1] = (unsigned int) &aWord;
+  bArgs[1] = (unsigned int) &bWord;
+  aArgs[2] = bArgs[2] = sizeof(int);
+  recvArgs[0] = (unsigned int) &from;
+  recvArgs[1] = (unsigned int) &word;
+  recvArgs[2] = sizeof(int);
+
+  // a queues the even words, b the odd ones
+  for (i = 0; i < MBOX_SLOTS; i++) {
+    aWord = bWord = i;
+    sender = i % 2 ? b : a;
+    asend(sender, receiver->pid, MSG_NONBLOCK);
+    assertEquals(sender->irc, sizeof(int));
+    assertEquals(next(), sender);
+  }
+  asend(a, receiver->pid, MSG_NONBLOCK);
+  assertEquals(a->irc, BLOCKERR);
+  assertEquals(next(), a);
+  aWord = MBOX_SLOTS;
+  asend(a, receiver->pid, 0);
+  assertEquals(a->state, SENDING);
+  assertEquals(receiver->senders.head, a);
+
+  // Oldest message from b, then everything in order, then the blocked sender
+  from = b->pid;
+  receive(receiver, &from);
+  assertEquals(word, 1);
+  assertEquals(next(), receiver);
+  for (i = 0; i <= MBOX_SLOTS; i++) {
+    if (i == 1) {
+      continue;
+    }
+    from = 0;
+    receive(receiver, &from);
+    assertEquals(receiver->irc, sizeof(int));
+    assertEquals(word, i);
+    assertEquals(from, i % 2 && i < MBOX_SLOTS ? b->pid : a->pid);
+    assertEquals(next(), receiver);
+    if (i == MBOX_SLOTS) {
+      assertEquals(next(), a);
+    }
+  }
+  assertEquals(receiver->mbox->count, 0);
+  assertEquals(next(), NULL);
+
+  start = (unsigned long) read_tsc();
+  for (i = 0; i < MSG_ROUNDS; i++) {
+    asend(a, receiver->pid, MSG_NONBLOCK);
+    from = 0;
+    receive(receiver, &from);
+    next();
+    next();
+  }
+  cycles = (unsigned long) read_tsc() - start;
+  kprintf("Mailbox: asend and receive avg %u cycles\n", cycles / MSG_ROUNDS);
+
+  // A borrowing receiver that gets no buffer leaves the message queued,
+  // memory is used up by a chain of pages and heap blocks
+  aWord = MBOX_SLOTS;
+  asend(a, receiver->pid, MSG_NONBLOCK);
+  assertEquals(next(), a);
+  hog = NULL;
+  while ((block = alloc_pages(1)) || (block = kmalloc(sizeof(lentBuf) + sizeof(int)))) {
+    *block = hog;
+    hog = block;
+  }
+  recvArgs[1] = (unsigned int) &lent;
+  from = 0;
+  receive_lent(receiver, &from);
+  assertEquals(receiver->irc, SYS_SR_ERR);
+  assertEquals(from, 0);
+  assertEquals(receiver->mbox->count, 1);
+  assertEquals(next(), receiver);
+  while (hog) {
+    block = *hog;
+    kfree(hog);
+    hog = block;
+  }
+  receive_lent(receiver, &from);
+  assertEquals(receiver->irc, sizeof(int));
+  assertEquals(from, a->pid);
+  assertEquals(*((unsigned int*) lent), MBOX_SLOTS);
+  assertEquals(receiver->mbox->count, 0);
+  assertEquals(next(), receiver);
+
+  // The mailbox goes back to its cache and is handed out again
+  box = receiver->mbox;
+  cleanup(receiver);
+  create(nullProc, PID_STACK_SIZE, 0);
+  receiver = next();
+  receiver->iargs = (unsigned int) recvArgs;
+  aArgs[0] = receiver->pid;
+  asend(a, receiver->pid, MSG_NONBLOCK);
+  assertEquals(a->irc, sizeof(int));
+  assertEquals(receiver->mbox, box);
+  assertEquals(next(), a);
+
+  cleanup(a);
+  cleanup(b);
+  cleanup(receiver);
+}
+
+/*
+ * Blocks many senders on one receiver, takes them by PID in reverse order,
+ * then in arrival order, and one out of the middle of the queue
+ */
+void testSenderQueue(void) {
+  unsigned int args[QUEUE_SENDERS][3], recvArgs[3], words[QUEUE_SENDERS];
+  unsigned int from, word;
+  unsigned long start, sendCycles, pickCycles, anyCycles;
+  pcb *senders[QUEUE_SENDERS], *receiver;
+  int i, j;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  for (i = 0; i <= QUEUE_SENDERS; i++) {
+    assert(create(nullProc, PID_STACK_SIZE, 0) != SYSERR);
+  }
+  receiver = next();
+  receiver->iargs = (unsigned int) recvArgs;
+  recvArgs[0] = (unsigned int) &from;
+  recvArgs[1] = (unsigned int) &word;
+  recvArgs[2] = sizeof(int);
+  for (i = 0; i < QUEUE_SENDERS; i++) {
+    senders[i] = next();
+    senders[i]->iargs = (unsigned int) args[i];
+    words[i] = i;
+    args[i][0] = receiver->pid;
+    args[i][1] = (unsigned int) (words + i);
+    args[i][2] = sizeof(int);
+  }
+  assertEquals(next(), NULL);
+  sendCycles = pickCycles = anyCycles = 0;
+
+  for (j = 0; j < QUEUE_ROUNDS; j++) {
+    start = (unsigned long) read_tsc();
+    for (i = 0; i < QUEUE_SENDERS; i++) {
+      send(senders[i], receiver->pid);
+    }
+    sendCycles += (unsigned long) read_tsc() - start;
+    assertEquals(receiver->senders.head, senders[0]);
+    assertEquals(receiver->senders.tail, senders[QUEUE_SENDERS - 1]);
+
+    // The last sender on the queue is the worst case for a list walk
+    start = (unsigned long) read_tsc();
+    for (i = QUEUE_SENDERS - 1; i >= 0; i--) {
+      from = senders[i]->pid;
+      receive(receiver, &from);
+      next();
+      next();
+    }
+    pickCycles += (unsigned long) read_tsc() - start;
+    assertEquals(receiver->senders.head, NULL);
+    assertEquals(receiver->senders.tail, NULL);
+    for (i = 0; i < QUEUE_SENDERS; i++) {
+      assertEquals(senders[i]->irc, sizeof(int));
+      assertEquals(senders[i]->wait_queue, NULL);
+    }
+    assertEquals(word, 0);
+
+    for (i = 0; i < QUEUE_SENDERS; i++) {
+      send(senders[i], receiver->pid);
+    }
+    start = (unsigned long) read_tsc();
+    for (i = 0; i < QUEUE_SENDERS; i++) {
+      from = 0;
+      receive(receiver, &from);
+      next();
+      next();
+    }
+    anyCycles += (unsigned long) read_tsc() - start;
+    assertEquals(next(), NULL);
+    assertEquals(from, senders[QUEUE_SENDERS - 1]->pid);
+    assertEquals(word, QUEUE_SENDERS - 1);
+  }
+
+  // A sender taken off the middle leaves its neighbours linked,
+  // and can not be received from any more
+  for (i = 0; i < 3; i++) {
+    send(senders[i], receiver->pid);
+  }
+  msg_dequeue(senders[1]);
+  assertEquals(senders[0]->next, senders[2]);
+  assertEquals(senders[2]->prev, senders[0]);
+  from = senders[1]->pid;
+  receive(receiver, &from);
+  assertEquals(receiver->state, RECEIVING);
+  assertEquals(senders[1]->receivers.head, receiver);
+  cleanup(senders[1]);
+  assertEquals(receiver->irc, SYS_SR_NO_PID);
+  assertEquals(next(), receiver);
+  for (i = 0; i < 2; i++) {
+    from = 0;
+    receive(receiver, &from);
+    assertEquals(from, senders[2 * i]->pid);
+    next();
+    next();
+  }
+  assertEquals(next(), NULL);
+
+  kprintf("Sender queue: %u senders, send avg %u, receive by PID avg %u,"
+      " receive any avg %u cycles\n", QUEUE_SENDERS,
+      sendCycles / (QUEUE_ROUNDS * QUEUE_SENDERS),
+      pickCycles / (QUEUE_ROUNDS * QUEUE_SENDERS),
+      anyCycles / (QUEUE_ROUNDS * QUEUE_SENDERS));
+
+  cleanup(receiver);
+  for (i = 0; i < QUEUE_SENDERS; i++) {
+    if (i != 1) {
+      cleanup(senders[i]);
+    }
+  }
+}
+
+/*
+ * Request and reply between a client and a server, a server that stops
+ * releases its clients, then times a round trip against two rendezvous
+ */
+void testRpc(void) {
+  unsigned int clientArgs[5], serverArgs[3], from, request, answer;
+  unsigned long start, rpcCycles, pairCycles;
+  pcb *client, *server;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  create(nullProc, PID_STACK_SIZE, 0);
+  client = next();
+  server = next();
+  client->iargs = (unsigned int) clientArgs;
+  server->iargs = (unsigned int) serverArgs;
+  clientArgs[0] = server->pid;
+  clientArgs[1] = (unsigned int) &request;
+  clientArgs[2] = clientArgs[4] = sizeof(int);
+  clientArgs[3] = (unsigned int) &answer;
+  serverArgs[0] = (unsigned int) &from;
+  serverArgs[2] = sizeof(int);
+
+  // Server takes the request, the client then waits for the reply
+  request = 41;
+  from = 0;
+  serverArgs[1] = (unsigned int) &request;
+  receive(server, &from);
+  sendrecv(client, server->pid);
+  assertEquals(client->state, REPLY_BLOCKED);
+  assertEquals(server->awaiting_reply.head, client);
+  assertEquals(next(), server);
+  assertEquals(next(), NULL);
+  answer = 0;
+  request++;
+  reply(server, server->pid);
+  assertEquals(server->irc, SYS_SR_NO_PID);
+  assertEquals(next(), server);
+  // A negative length is refused and the client keeps waiting
+  serverArgs[2] = -1;
+  reply(server, client->pid);
+  assertEquals(server->irc, SYSERR);
+  assertEquals(client->state, REPLY_BLOCKED);
+  assertEquals(server->awaiting_reply.head, client);
+  assertEquals(next(), server);
+  serverArgs[2] = sizeof(int);
+  reply(server, client->pid);
+  assertEquals(server->irc, sizeof(int));
+  assertEquals(client->irc, sizeof(int));
+  assertEquals(answer, 42);
+  assertEquals(server->awaiting_reply.head, NULL);
+  assertEquals(next(), server);
+  assertEquals(next(), client);
+
+  // A plain send after a syssendrecv does not wait for a reply
+  from = 0;
+  send(client, server->pid);
+  receive(server, &from);
+  assertEquals(next(), server);
+  assertEquals(next(), client);
+
+  start = (unsigned long) read_tsc();
+  for (i = 0; i < MSG_ROUNDS; i++) {
+    from = 0;
+    receive(server, &from);
+    sendrecv(client, server->pid);
+    next();
+    reply(server, client->pid);
+    next();
+    next();
+  }
+  rpcCycles = (unsigned long) read_tsc() - start;
+
+  start = (unsigned long) read_tsc();
+  for (i = 0; i < MSG_ROUNDS; i++) {
+    from = 0;
+    receive(server, &from);
+    send(client, server->pid);
+    next();
+    next();
+    // The client receives the answer with its request buffer
+    from = server->pid;
+    clientArgs[0] = (unsigned int) &from;
+    receive(client, &from);
+    serverArgs[0] = client->pid;
+    send(server, client->pid);
+    next();
+    next();
+    clientArgs[0] = server->pid;
+    serverArgs[0] = (unsigned int) &from;
+  }
+  pairCycles = (unsigned long) read_tsc() - start;
+  kprintf("RPC: sendrecv and reply avg %u cycles, two rendezvous avg %u cycles\n",
+      rpcCycles / MSG_ROUNDS, pairCycles / MSG_ROUNDS);
+
+  // Clients waiting for a reply get an error when the server stops
+  from = 0;
+  receive(server, &from);
+  sendrecv(client, server->pid);
+  assertEquals(next(), server);
+  cleanup(server);
+  assertEquals(client->irc, SYS_SR_NO_PID);
+  assertEquals(next(), client);
+  cleanup(client);
+}
+
+/*
+ * Ownership of a lent buffer moves to the receiver and cleanup frees the
+ * buffers a process still owns, then times a large message copied and lent
+ */
+void testLending(void) {
+  unsigned int sendArgs[3], recvArgs[3], from;
+  unsigned long start, copyCycles, lendCycles;
+  memInfo before, after;
+  pcb *sender, *receiver;
+  char *buf, *copy, *lent;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  create(nullProc, PID_STACK_SIZE, 0);
+  sender = next();
+  receiver = next();
+  sender->iargs = (unsigned int) sendArgs;
+  receiver->iargs = (unsigned int) recvArgs;
+  mem_report(&before);
+
+  buf = lend_alloc(sender, LEND_SIZE);
+  assert(buf);
+  assertEquals(lend_owned(sender, buf), LEND_SIZE);
+  assertEquals(lend_owned(receiver, buf), SYSERR);
+  buf[0] = 'L';
+  sendArgs[0] = receiver->pid;
+  sendArgs[1] = (unsigned int) buf;
+  sendArgs[2] = LEND_SIZE;
+  recvArgs[0] = (unsigned int) &from;
+  recvArgs[1] = (unsigned int) &lent;
+
+  // Lent buffer changes owner
+  from = 0;
+  receive_lent(receiver, &from);
+  lend(sender, receiver->pid);
+  assertEquals(sender->irc, LEND_SIZE);
+  assertEquals(receiver->irc, LEND_SIZE);
+  assertEquals(lent, buf);
+  assertEquals(sender->lent, NULL);
+  assertEquals((char*) (receiver->lent + 1), buf);
+  assertEquals(next(), sender);
+  assertEquals(next(), receiver);
+
+  // Lending a buffer the sender does not own fails
+  lend(sender, receiver->pid);
+  assertEquals(sender->irc, SYS_SR_ERR);
+  assertEquals(next(), sender);
+
+  // Copied message to a borrowing receiver comes in a new buffer
+  copy = kmalloc(LEND_SIZE);
+  copy[0] = 'C';
+  sendArgs[1] = (unsigned int) copy;
+  send(sender, receiver->pid);
+  receive_lent(receiver, &from);
+  assertEquals(receiver->irc, LEND_SIZE);
+  assert(lent != buf);
+  assertEquals(lent[0], 'C');
+  assertEquals(lend_owned(receiver, lent), LEND_SIZE);
+  next();
+  next();
+
+  // Both buffers are freed with the receiver
+  cleanup(receiver);
+  kfree(copy);
+  mem_report(&after);
+  assertEquals(after.freePages, before.freePages);
+  create(nullProc, PID_STACK_SIZE, 0);
+  receiver = next();
+  receiver->iargs = (unsigned int) recvArgs;
+
+  // Copy into a receive buffer against lending it back and forth
+  buf = lend_alloc(sender, LEND_SIZE);
+  copy = kmalloc(LEND_SIZE);
+  sendArgs[0] = receiver->pid;
+  sendArgs[1] = (unsigned int) buf;
+  recvArgs[1] = (unsigned int) copy;
+  recvArgs[2] = LEND_SIZE;
+  start = (unsigned long) read_tsc();
+  for (i = 0; i < LEND_ROUNDS; i++) {
+    from = 0;
+    receive(receiver, &from);
+    send(sender, receiver->pid);
+    next();
+    next();
+  }
+  copyCycles = (unsigned long) read_tsc() - start;
+
+  recvArgs[1] = (unsigned int) &lent;
+  start = (unsigned long) read_tsc();
+  for (i = 0; i < LEND_ROUNDS; i++) {
+    from = 0;
+    receive_lent(receiver, &from);
+    lend(sender, receiver->pid);
+    next();
+    next();
+    lend_give(lent, sender);
+  }
+  lendCycles = (unsigned long) read_tsc() - start;
+  kprintf("Lending: %u byte message copied avg %u cycles, lent avg %u cycles\n",
+      LEND_SIZE, copyCycles / LEND_ROUNDS, lendCycles / LEND_ROUNDS);
+
+  kfree(copy);
+  cleanup(sender);
+  cleanup(receiver);
+}
+
+/*
+ * Gathered, scattered and mixed messages copy segment to segment,
+ * truncated to the shorter side
+ */
+void testVectored(void) {
+  unsigned int sendArgs[3], recvArgs[3], from, header, rheader;
+  char payload[] = "payload", flat[16], b[16];
+  iovec siov[3], riov[3];
+  pcb *sender, *receiver;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  create(nullProc, PID_STACK_SIZE, 0);
+  sender = next();
+  receiver = next();
+  sender->iargs = (unsigned int) sendArgs;
+  receiver->iargs = (unsigned int) recvArgs;
+  recvArgs[0] = (unsigned int) &from;
+
+  // Header and payload gathered into a flat buffer
+  header = 0xfeed;
+  siov[0].base = &header;
+  siov[0].len = sizeof(header);
+  siov[1].base = NULL;
+  siov[1].len = 0;
+  siov[2].base = payload;
+  siov[2].len = sizeof(payload);
+  sendArgs[0] = receiver->pid;
+  sendArgs[1] = (unsigned int) siov;
+  sendArgs[2] = 3;
+  recvArgs[1] = (unsigned int) flat;
+  recvArgs[2] = sizeof(flat);
+  from = 0;
+  receive(receiver, &from);
+  sendv(sender, receiver->pid);
+  assertEquals(sender->irc, sizeof(header) + sizeof(payload));
+  assertEquals(*((unsigned int*) flat), header);
+  assertEquals(strcmp(flat + sizeof(header), payload), 0);
+  next();
+  next();
+
+  // Scattered over segments that split the header and payload
+  riov[0].base = &rheader;
+  riov[0].len = 2;
+  riov[1].base = ((char*) &rheader) + 2;
+  riov[1].len = sizeof(rheader) - 2;
+  riov[2].base = b;
+  riov[2].len = sizeof(b);
+  recvArgs[1] = (unsigned int) riov;
+  recvArgs[2] = 3;
+  sendv(sender, receiver->pid);
+  assertEquals(sender->state, SENDING);
+  receivev(receiver, &from);
+  assertEquals(receiver->irc, sizeof(header) + sizeof(payload));
+  assertEquals(rheader, header);
+  assertEquals(strcmp(b, payload), 0);
+  next();
+  next();
+
+  // Flat message into segments, cut at the end of the last one
+  riov[2].len = 1;
+  sendArgs[1] = (unsigned int) payload;
+  sendArgs[2] = sizeof(payload);
+  receivev(receiver, &from);
+  send(sender, receiver->pid);
+  assertEquals(receiver->irc, sizeof(header) + 1);
+  assertEquals(b[0], payload[sizeof(header)]);
+  next();
+  next();
+
+  // Segment counts and lengths are checked
+  recvArgs[2] = MAX_IOV + 1;
+  receivev(receiver, &from);
+  assertEquals(receiver->irc, SYS_SR_ERR);
+  riov[1].len = -1;
+  recvArgs[2] = 3;
+  receivev(receiver, &from);
+  assertEquals(receiver->irc, SYS_SR_ERR);
+  // The total length must fit in an int
+  riov[1].len = INT_MAX - riov[0].len;
+  assertEquals(iov_length(riov, 2), INT_MAX);
+  receivev(receiver, &from);
+  assertEquals(receiver->irc, SYS_SR_ERR);
+  next();
+  next();
+  assertEquals(next(), NULL);
+
+  cleanup(sender);
+  cleanup(receiver);
+}
+
+/*
+ * Pollers wake up for a waiting sender, a mailbox message and a stopping
+ * peer, and leave the queue of pollers when they do
+ */
+void testPoll(void) {
+  unsigned int pollArgs[2], sendArgs[4], word;
+  pcb *poller, *sender, *other;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  create(nullProc, PID_STACK_SIZE, 0);
+  create(nullProc, PID_STACK_SIZE, 0);
+  poller = next();
+  sender = next();
+  other = next();
+  poller->iargs = (unsigned int) pollArgs;
+  sender->iargs = other->iargs = (unsigned int) sendArgs;
+  word = 42;
+  sendArgs[0] = poller->pid;
+  sendArgs[1] = (unsigned int) &word;
+  sendArgs[2] = sizeof(int);
+  sendArgs[3] = 0;
+
+  // Invalid requests
+  pollArgs[0] = 0;
+  pollArgs[1] = 0;
+  poll(poller);
+  assertEquals(poller->irc, SYSERR);
+  assertEquals(next(), poller);
+  pollArgs[0] = POLL_FD(0);
+  poll(poller);
+  assertEquals(poller->irc, SYSERR);
+  assertEquals(next(), poller);
+
+  // A sender from somebody else does not wake a poller for a given PID
+  pollArgs[0] = POLL_MSG;
+  pollArgs[1] = sender->pid;
+  poll(poller);
+  assertEquals(poller->state, POLLING);
+  assertEquals(sender->pollers.head, poller);
+  send(other, poller->pid);
+  assertEquals(poller->state, POLLING);
+  send(sender, poller->pid);
+  assertEquals(poller->irc, POLL_MSG);
+  assertEquals(sender->pollers.head, NULL);
+  assertEquals(next(), poller);
+  assertEquals(next(), NULL);
+
+  // Waiting senders are ready right away
+  poll(poller);
+  assertEquals(poller->irc, POLL_MSG);
+  assertEquals(next(), poller);
+  cleanup(poller);
+  assertEquals(next(), other);
+  assertEquals(next(), sender);
+  assertEquals(sender->irc, SYS_SR_NO_PID);
+
+  // A mailbox message wakes a poller for anyone
+  create(nullProc, PID_STACK_SIZE, 0);
+  poller = next();
+  poller->iargs = (unsigned int) pollArgs;
+  sendArgs[0] = poller->pid;
+  pollArgs[1] = 0;
+  poll(poller);
+  assertEquals(poller->state, POLLING);
+  asend(sender, poller->pid, 0);
+  assertEquals(poller->irc, POLL_MSG);
+  assertEquals(next(), sender);
+  assertEquals(next(), poller);
+
+  // So does the peer stopping
+  pollArgs[1] = other->pid;
+  poll(poller);
+  assertEquals(poller->state, POLLING);
+  cleanup(other);
+  assertEquals(poller->irc, POLL_MSG);
+  assertEquals(next(), poller);
+  assertEquals(next(), NULL);
+
+  cleanup(poller);
+  cleanup(sender);
+}
+
+/*
+ * Samples of a process spread over one bucket and one past the
+ * histogram, only samples between PROF_START and PROF_STOP count
+ */
+void testProfile(void) {
+  contextFrame *context;
+  pcb *p;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  p = next();
+  context = (contextFrame*) p->esp;
+
+  context->iret_eip = PROF_EIP;
+  prof_sample(p);
+  assertEquals(prof_control(PROF_START), 0);
+  for (i = 0; i < PROF_SAMPLES; i++) {
+    context->iret_eip = PROF_EIP + i % (1 << PROF_SHIFT);
+    prof_sample(p);
+  }
+  context->iret_eip = PROF_BUCKETS << PROF_SHIFT;
+  prof_sample(p);
+  assertEquals(prof_control(PROF_STOP), PROF_SAMPLES + 1);
+  prof_sample(p);
+  assertEquals(prof_hits(PROF_EIP), PROF_SAMPLES);
+  assertEquals(prof_hits(PROF_EIP - 1), 0);
+  assertEquals(prof_hits(PROF_EIP + (1 << PROF_SHIFT)), 0);
+  assertEquals(prof_control(-1), SYSERR);
+
+  // Starting again clears the histogram
+  assertEquals(prof_control(PROF_START), 0);
+  assertEquals(prof_hits(PROF_EIP), 0);
+  prof_control(PROF_STOP);
+  cleanup(p);
+}
+
+#if KTRACE
+/*
+ * Records of kmalloc, kfree and a wakeup, then a ring that wraps around
+ */
+void testTrace(void) {
+  void *block;
+  pcb *p;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  p = next();
+
+  assertEquals(trace_control(TRACE_START), 0);
+  block = kmalloc(TRACE_SIZE);
+  kfree(block);
+  // Only a blocked process makes a wakeup record
+  ready(p);
+  next();
+  p->state = SLEEPING;
+  ready(p);
+  next();
+  assertEquals(trace_control(TRACE_STOP), 3);
+  kfree(kmalloc(16));
+  assertEquals(trace_control(TRACE_DUMP), 3);
+  assertEquals(trace_control(-1), SYSERR);
+
+  trace_control(TRACE_START);
+  for (i = 0; i < TRACE_SIZE + 10; i++) {
+    trace_event(TR_IRQ, 0, i);
+  }
+  assertEquals(trace_control(TRACE_STOP), TRACE_SIZE);
+  trace_control(TRACE_START);
+  cleanup(p);
+}
+#endif
+
+/*
+ * The one-shot PIT follows the end of the time slice and the earliest
+ * sleeper, a count reaching 0 is the timer interrupt
+ */
+static void countExpiry(void *arg) {
+  (*(int*) arg)++;
+}
+
+void testOneShot(void) {
+  unsigned int count;
+  ktimer t = { 0 };
+  pcb *p;
+  int i;
+
+  kmeminit();
+  init_pcb_table();
+  init_ready_queue();
+  create(nullProc, PID_STACK_SIZE, 0);
+  p = next();
+
+  // Alone, the PIT counts down to the end of the time slice
+  timer_start();
+  count = hostPitCount;
+  assertEquals(count, (TIME_SLICE_TICKS * TIMER_FREQ + TICKS_PER_SEC - 1) / TICKS_PER_SEC);
+
+  // Half way, a short sleep moves the interrupt forward, and lasts at
+  // least its length although the current tick has partly gone by
+  hostPitNow = count / 2;
+  usleep(p, 3 * TIMER_RES_US);
+  assertEquals(p->state, SLEEPING);
+  assert(hostPitCount * TICKS_PER_SEC >= 3 * TIMER_FREQ);
+  assert(hostPitCount * TICKS_PER_SEC <= 4 * TIMER_FREQ + TICKS_PER_SEC);
+
+  // The sleeper wakes up, the time slice goes on
+  hostPitNow = 0;
+  assert(!timer_interrupt());
+  assertEquals(next(), p);
+  assertEquals(next(), NULL);
+
+  // Then every interrupt ends a time slice, also when it comes late
+  for (i = 0; i < TW_SIZE; i++) {
+    hostPitNow = i & 1 ? 0 : 0x10000 - TIMER_FREQ / TICKS_PER_SEC / 2;
+    assert(timer_interrupt());
+    assert(hostPitCount <= count);
+  }
+
+  // A cancelled timer leaves its slot and no longer holds the
+  // interrupt back
+  timer_set(&t, 5, countExpiry, &i);
+  assert(hostPitCount * TICKS_PER_SEC <= 6 * TIMER_FREQ + TICKS_PER_SEC);
+  assert(timer_cancel(&t));
+  assert(!timer_interrupt());
+  assert(hostPitCount * TICKS_PER_SEC > 6 * TIMER_FREQ + TICKS_PER_SEC);
+  cleanup(p);
+}